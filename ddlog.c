@@ -15,15 +15,24 @@
 #include <sys/time.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <sched.h>
 
 #include "ddlog.h"
 #include "private/ddlog_internal.h"
+#include "private/ddlog_fmt.h"
+#include "private/ddlog_clock.h"
+#include "private/ddlog_thread.h"
+#include "private/ddlog_stats.h"
+#include "private/ddlog_recorder.h"
 #include "private/ddlog_debug.h"
 #include "private/ddlog_display.h"
 #include "ddlog_ext.h"
 
 int ddlog_lib_inited = 0;
 int ddlog_enabled = 0;
+int ddlog_level = DDLOG_LEVEL_TRACE;
+volatile int ddlog_active_level = DDLOG_LEVEL_NONE;
 
 ddlog_buffer_t* ddlog_buffers[DDLOG_MAX_BUF_NUM];
 ddlog_buffer_t* ddlog_default_buf = 0;
@@ -31,9 +40,14 @@ int ddlog_default_buf_id = -1;
 
 pthread_spinlock_t ddlog_global_lock;
 static ddlog_lock_state_t ddlog_global_lock_state = DDLOG_LOCK_UNINITED;
+static uint32_t ddlog_buffer_instance = 0;
+
+pthread_key_t ddlog_thread_key;
+static int ddlog_thread_key_created = 0;
 
 __thread char ddlog_thread_name[16] = {0};
 __thread uint8_t ddlog_thread_indent_level = 0;
+__thread ddlog_thread_buffer_ref_t ddlog_thread_buffers[DDLOG_MAX_BUF_NUM];
 
 /******************************************************************************
  *
@@ -42,6 +56,25 @@ __thread uint8_t ddlog_thread_indent_level = 0;
  ******************************************************************************/
 
 
+/**
+ * \brief Selects the clock source of the event timestamps
+ *
+ * \param source The clock source (DDLOG_CLOCK_*)
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ALREADY_INITED if the library
+ *         is already initialized, DDLOG_RET_ERR if the source is not available
+ *         (DDLOG_CLOCK_TSC needs an x86 CPU with invariant TSC)
+ *
+ * Has to be called before ddlog_init(). The events store the raw ticks
+ * of the clock source, the calibration record taken at ddlog_init() is
+ * used to convert them to wall clock time when they are displayed.
+ */
+int ddlog_set_clock_source(ddlog_clock_source_t source){
+    if (ddlog_lib_inited){
+        return DDLOG_RET_ALREADY_INITED;
+    }
+    return ddlog_clock_set_source_internal(source);
+}
+
 /**
  * \brief Initializes the ddlog library. Allocates the default log buffer.
  *
@@ -52,47 +85,50 @@ __thread uint8_t ddlog_thread_indent_level = 0;
  * Initializes the ddlog logging library.
  * If the size parameter is 0, we use the default buffer size.
  * Initialzes one log buffer which becomes the default buffer.
+ *
+ * The size is a memory budget: the buffer takes about the memory of size
+ * events of the former fixed size format, and holds at least size events.
+ * The events are stored as variable length records, so a buffer of short
+ * messages holds up to about 2.6 times as many.
  */
 int ddlog_init(size_t size){
-    int spin_res = 0;
-    int ext_init_res = DDLOG_RET_ERR;
-
-    if (ddlog_lib_inited == 1) {
-        return DDLOG_RET_ALREADY_INITED;
-    }
+    ddlog_buffer_opt_t opt = {size, 0, DDLOG_OVERFLOW_OVERWRITE, 0, NULL};
+    return ddlog_init_internal(&opt);
+}
 
-    if (size > DDLOG_MAX_EVENT_NUM) {
-        size = DDLOG_MAX_EVENT_NUM;
-    }
+/**
+ * \brief Initializes the ddlog library with a per thread default buffer.
+ *
+ * \param size The maximum number of log messages in the log buffer
+ *             and in every private thread ring of it.
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
+ *
+ * Same as ddlog_init() but the default buffer is created in per thread
+ * mode: every thread calling ddlog_thread_init() gets its own private
+ * ring in the buffer, which is written without any locking or atomic
+ * operation. The rings are merged by the event timestamps when the
+ * buffer is printed. Threads without a private ring log into the shared
+ * ring of the buffer.
+ */
+int ddlog_init_per_thread(size_t size){
+    ddlog_buffer_opt_t opt = {size, 1, DDLOG_OVERFLOW_OVERWRITE, 0, NULL};
+    return ddlog_init_internal(&opt);
+}
 
-    /* init the global lock */
-    spin_res = pthread_spin_init(&ddlog_global_lock, PTHREAD_PROCESS_PRIVATE);
-    if (spin_res) {
+/**
+ * \brief Initializes the ddlog library with a default buffer created with options.
+ *
+ * \param opt The options of the default buffer (see ddlog_create_buffer_opt())
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
+ *
+ * Same as ddlog_init() but the default buffer can be a per thread buffer,
+ * can have a non overwriting overflow policy or can be backed by a file.
+ */
+int ddlog_init_opt(const ddlog_buffer_opt_t* opt){
+    if (opt == NULL || opt->overflow < DDLOG_OVERFLOW_OVERWRITE || opt->overflow > DDLOG_OVERFLOW_BLOCK){
         return DDLOG_RET_ERR;
     }
-    ddlog_global_lock_state = DDLOG_LOCK_UNLOCKED;
-
-    /* set up the buffer pointer array and allocate the default
-     * log buffer
-     */
-    memset(ddlog_buffers, 0, sizeof(ddlog_buffers));
-
-    if (size != 0) {
-        ddlog_buffers[0] = ddlog_init_buffer_internal(size);
-        if (ddlog_buffers[0]) {
-            ddlog_default_buf = ddlog_buffers[0];
-            ddlog_default_buf_id = 0;
-        }
-    }
-
-    ext_init_res = ddlog_ext_init();
-    if (ext_init_res == DDLOG_RET_OK){
-        ddlog_enable_internal();
-        ddlog_lib_inited = 1;
-        return DDLOG_RET_OK;
-    }
-
-    return DDLOG_RET_ERR;
+    return ddlog_init_internal(opt);
 }
 
 /**
@@ -103,12 +139,26 @@ int ddlog_init(size_t size){
  * If this variable is set, the events logged by the thread
  * will contain the thread name. Thi thread name is added to the
  * log message automatically.
+ * The thread is registered in the thread registry, the events store
+ * only the numeric id of the thread, the name is resolved when the
+ * events are displayed.
+ * In the per thread buffers a private ring is assigned to the thread.
  */
 void ddlog_thread_init(const char* thread_name){
+    int i = 0;
     if (thread_name){
         snprintf(ddlog_thread_name, sizeof(ddlog_thread_name) - 1, "%s", thread_name);
     }
+    ddlog_thread_register_internal(ddlog_thread_name);
     ddlog_thread_indent_level = 0;
+
+    if (ddlog_lib_inited){
+        for (i = 0; i < DDLOG_MAX_BUF_NUM; i++){
+            if (ddlog_buffers[i] && ddlog_buffers[i]->per_thread){
+                ddlog_attach_thread_buffer_internal(ddlog_buffers[i]);
+            }
+        }
+    }
 }
 
 /**
@@ -118,7 +168,8 @@ void ddlog_thread_init(const char* thread_name){
  *
  * Resets all log buffers, cleans the messages. After calling this the
  * buffers will contain no messages. Does not delete the log buffers,
- * only the messages from them.
+ * only the messages from them. The counters returned by ddlog_get_stats()
+ * are not cleared.
  */
 int ddlog_reset(void){
     int res = DDLOG_RET_ERR;
@@ -151,7 +202,8 @@ int ddlog_reset(void){
  *
  * Resets the selected log buffer, cleans the messages. After calling this the
  * buffer will contain no messages. Does not remove the buffer,
- * only the log messages are deleted.
+ * only the log messages are deleted. The counters returned by
+ * ddlog_get_stats_buffer_id() are not cleared.
  */
 int ddlog_reset_buffer_id(ddlog_buffer_id_t buffer_id){
     int res = DDLOG_RET_ERR;
@@ -163,6 +215,38 @@ int ddlog_reset_buffer_id(ddlog_buffer_id_t buffer_id){
     return res;
 }
 
+/**
+ * \brief Prints and consumes the events of a buffer
+ *
+ * \param buffer_id The id of the buffer to be drained
+ * \param stream The stream the events are printed into
+ * \return The number of consumed events or DDLOG_RET_ERR in case of error
+ *
+ * Every event is consumed only once, the next call continues with the
+ * events logged since. The consumed events make room in the buffers
+ * with a non overwriting overflow policy. A buffer can be drained by
+ * one caller at a time, DDLOG_RET_ERR is returned if it is being drained.
+ */
+int ddlog_drain_buffer_id(ddlog_buffer_id_t buffer_id, FILE* stream){
+    ddlog_record_t record;
+    ddlog_buffer_t* buffer = NULL;
+    int num = 0;
+
+    if (!ddlog_lib_inited || stream == NULL || buffer_id >= DDLOG_MAX_BUF_NUM){
+        return DDLOG_RET_ERR;
+    }
+    buffer = ddlog_buffers[buffer_id];
+    if (buffer == NULL || __sync_lock_test_and_set(&buffer->draining, 1)){
+        return DDLOG_RET_ERR;
+    }
+    while (ddlog_drain_next_internal(buffer, &record) == DDLOG_RET_OK){
+        ddlog_display_event(stream, &record);
+        num++;
+    }
+    __sync_lock_release(&buffer->draining);
+    return num;
+}
+
 
 /**
  * \brief Library cleanup function
@@ -174,6 +258,9 @@ int ddlog_reset_buffer_id(ddlog_buffer_id_t buffer_id){
 void ddlog_cleanup(void){
     int i = 0, lock_res = 0;
     if (ddlog_lib_inited){
+        /* the background writer reads the buffers */
+        ddlog_stop_writer();
+
         lock_res = ddlog_lock_global(0);
         if (lock_res != DDLOG_RET_OK){
             return;
@@ -218,42 +305,50 @@ void ddlog_cleanup(void){
  * newly created buffer.
  */
 ddlog_buffer_id_t ddlog_create_buffer(size_t size){
-    int buffer_index = -1;
-    int i = 0;
-    int lock_res = DDLOG_RET_ERR;
-
-    if (ddlog_lib_inited){
-        lock_res = ddlog_lock_global(0);
-        if (lock_res != DDLOG_RET_OK){
-            return DDLOG_RET_ERR;
-        }
-
-        /* search for the first free buffer id */
-        for (i = 0; i < DDLOG_MAX_BUF_NUM; i++){
-            if (ddlog_buffers[i] == NULL){
-                buffer_index = i;
-                break;
-            }
-        }
+    ddlog_buffer_opt_t opt = {size, 0, DDLOG_OVERFLOW_OVERWRITE, 0, NULL};
+    return ddlog_create_buffer_internal(&opt);
+}
 
-        /* there is a free buffer, initialize it */
-        if (buffer_index >= 0) {
-            if (size == 0 || size > DDLOG_MAX_EVENT_NUM) {
-                size = DDLOG_MAX_EVENT_NUM;
-            }
-            ddlog_buffers[buffer_index] = ddlog_init_buffer_internal(size);
-            if (ddlog_default_buf == NULL){
-                ddlog_default_buf = ddlog_buffers[buffer_index];
-                ddlog_default_buf_id = buffer_index;
-            }
-        }
+/**
+ * \brief Create a new per thread ddlog log buffer
+ *
+ * \param size The maximum number of log messages in the log buffer
+ *             and in every private thread ring of it.
+ * \return the index of the new buffer or DDLOG_RET_ERR
+ *         in case of any error
+ *
+ * Same as ddlog_create_buffer() but the threads calling ddlog_thread_init()
+ * after the buffer creation get a private ring in this buffer.
+ */
+ddlog_buffer_id_t ddlog_create_buffer_per_thread(size_t size){
+    ddlog_buffer_opt_t opt = {size, 1, DDLOG_OVERFLOW_OVERWRITE, 0, NULL};
+    return ddlog_create_buffer_internal(&opt);
+}
 
-        lock_res = ddlog_unlock_global();
-        if ( buffer_index >= 0 && ddlog_buffers[buffer_index] != NULL && lock_res == DDLOG_RET_OK){
-            return buffer_index;
-        }
+/**
+ * \brief Create a new ddlog log buffer with options
+ *
+ * \param opt The buffer options
+ * \return the index of the new buffer or DDLOG_RET_ERR
+ *         in case of any error
+ *
+ * Same as ddlog_create_buffer() but the overflow policy of the buffer
+ * can be selected. The events of a DDLOG_OVERFLOW_DROP_NEW or
+ * DDLOG_OVERFLOW_BLOCK buffer are kept until they are consumed by
+ * ddlog_drain_buffer_id(), the logging functions return with
+ * DDLOG_RET_BUF_FULL if a new event is dropped.
+ *
+ * If a path is provided, the rings of the buffer are placed in a memory
+ * mapped file (flight recorder), the events survive a crash of the
+ * process and can be printed with the ddlog_dump tool. The function
+ * names, the thread names and the formatted messages are copied into
+ * the events of such a buffer, nothing refers to the process memory.
+ */
+ddlog_buffer_id_t ddlog_create_buffer_opt(const ddlog_buffer_opt_t* opt){
+    if (opt == NULL || opt->overflow < DDLOG_OVERFLOW_OVERWRITE || opt->overflow > DDLOG_OVERFLOW_BLOCK){
+        return DDLOG_RET_ERR;
     }
-    return DDLOG_RET_ERR;
+    return ddlog_create_buffer_internal(opt);
 }
 
 /**
@@ -267,12 +362,8 @@ ddlog_buffer_id_t ddlog_create_buffer(size_t size){
  */
 int ddlog_log(const char* message){
     int res = DDLOG_RET_ERR;
-    char* thread_name = NULL;
     if (ddlog_lib_inited && ddlog_default_buf && ddlog_enabled && message) {
-        if (ddlog_thread_name[0] != '0'){
-            thread_name = ddlog_thread_name;
-        }
-        res = ddlog_log_internal(ddlog_default_buf, thread_name, NULL, 0, message, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
+        res = ddlog_log_internal(ddlog_default_buf, NULL, NULL, 0, message, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
     }
     return res;
 }
@@ -322,12 +413,8 @@ int ddlog_log_long(const char* thread,
         const char* message)
 {
     int res = DDLOG_RET_ERR;
-    const char * thread_name = thread;
     if (ddlog_lib_inited && ddlog_default_buf && ddlog_enabled && message) {
-        if (thread == NULL && ddlog_thread_name[0] != '\0'){
-            thread_name = ddlog_thread_name;
-        }
-        res = ddlog_log_internal(ddlog_default_buf, thread_name, function, line_num, message, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
+        res = ddlog_log_internal(ddlog_default_buf, thread, function, line_num, message, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
     }
     return res;
 }
@@ -360,13 +447,143 @@ int ddlog_log_long_id(
         const char* message)
 {
     int res = DDLOG_RET_ERR;
-    const char* thread_name = thread;
     if (ddlog_lib_inited && ddlog_enabled && message){
         if (buffer_id < DDLOG_MAX_BUF_NUM && ddlog_buffers[buffer_id]){
-            if (thread == NULL && ddlog_thread_name[0] != '\0'){
-                thread_name = ddlog_thread_name;
-            }
-            res = ddlog_log_internal(ddlog_buffers[buffer_id], thread_name, function, line_num, message, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
+            res = ddlog_log_internal(ddlog_buffers[buffer_id], thread, function, line_num, message, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
+        }
+    }
+    return res;
+}
+
+/**
+ * \brief Logs a new event with deferred formatting to the default log buffer
+ *
+ * \param function The name of the function generating the log message (optional)
+ * \param line_num The line number in the source file of the log message (optional)
+ * \param format The printf style format string, it has to be a string literal
+ * \return DDLOG_RET_OK if success, DDLOG_RET_ERR in case of any error
+ *
+ * The message is not formatted here: the format string pointer and the
+ * raw values of the arguments are stored in the event. The message is
+ * formatted only when the event is printed. The thread name set with
+ * ddlog_thread_init(char*) is added to the event.
+ */
+int ddlog_log_fmt(const char* function, unsigned int line_num, const char* format, ...){
+    int res = DDLOG_RET_ERR;
+    va_list args;
+    if (ddlog_lib_inited && ddlog_default_buf && ddlog_enabled && format) {
+        va_start(args, format);
+        res = ddlog_log_fmt_internal(ddlog_default_buf, NULL, function, line_num, format, args);
+        va_end(args);
+    }
+    return res;
+}
+
+/**
+ * \brief Logs a new event with deferred formatting to a buffer with a specified id
+ *
+ * \param buffer_id the id of the buffer into the message will be put
+ * \param function The name of the function generating the log message (optional)
+ * \param line_num The line number in the source file of the log message (optional)
+ * \param format The printf style format string, it has to be a string literal
+ * \return DDLOG_RET_OK if success, DDLOG_RET_ERR in case of any error
+ *
+ * Same as ddlog_log_fmt(), but the event is placed into the buffer with id
+ * of buffer_id.
+ */
+int ddlog_log_fmt_id(ddlog_buffer_id_t buffer_id, const char* function, unsigned int line_num, const char* format, ...){
+    int res = DDLOG_RET_ERR;
+    va_list args;
+    if (ddlog_lib_inited && ddlog_enabled && format){
+        if (buffer_id < DDLOG_MAX_BUF_NUM && ddlog_buffers[buffer_id]){
+            va_start(args, format);
+            res = ddlog_log_fmt_internal(ddlog_buffers[buffer_id], NULL, function, line_num, format, args);
+            va_end(args);
+        }
+    }
+    return res;
+}
+
+/**
+ * \brief Logs a new event of a logging macro to the default log buffer
+ *
+ * \param callsite The static callsite descriptor of the macro expansion
+ * \param message The log message string
+ * \return DDLOG_RET_OK if success, DDLOG_RET_ERR in case of any error
+ *
+ * The event refers to the callsite descriptor instead of storing
+ * the function name, the function and file names are taken from the
+ * descriptor when the event is displayed. The thread name set with
+ * ddlog_thread_init(char*) is added to the event.
+ * The hit counter of the callsite is incremented if the event has been stored.
+ */
+int ddlog_log_cs(ddlog_callsite_t* callsite, const char* message){
+    int res = DDLOG_RET_ERR;
+    if (ddlog_lib_inited && ddlog_default_buf && ddlog_enabled && callsite && message) {
+        res = ddlog_log_raw_internal(ddlog_default_buf, callsite, NULL, NULL, 0,
+                message, strlen(message), 0, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
+        if (res == DDLOG_RET_OK){
+            __atomic_fetch_add(&callsite->hits, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return res;
+}
+
+/**
+ * \brief Logs a new event with deferred formatting of a logging macro to the default log buffer
+ *
+ * \param callsite The static callsite descriptor of the macro expansion,
+ *                 it holds the format string
+ * \return DDLOG_RET_OK if success, DDLOG_RET_ERR in case of any error
+ *
+ * Same as ddlog_log_fmt(), but the function name, the line number and the
+ * format string are taken from the callsite descriptor.
+ * The hit counter of the callsite is incremented if the event has been stored.
+ */
+int ddlog_log_fmt_cs(ddlog_callsite_t* callsite, ...){
+    int res = DDLOG_RET_ERR;
+    va_list args;
+    if (ddlog_lib_inited && ddlog_default_buf && ddlog_enabled && callsite && callsite->format) {
+        va_start(args, callsite);
+        res = ddlog_log_fmt_internal(ddlog_default_buf, callsite, NULL, 0, callsite->format, args);
+        va_end(args);
+        if (res == DDLOG_RET_OK){
+            __atomic_fetch_add(&callsite->hits, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return res;
+}
+
+/**
+ * \brief Logs a new formatted event of a logging macro to the default log buffer
+ *
+ * \param callsite The static callsite descriptor of the macro expansion
+ * \param format The printf style format string
+ * \return DDLOG_RET_OK if success, DDLOG_RET_ERR in case of any error
+ *
+ * Same as ddlog_log_cs(), but the message is formatted on the logging path.
+ * The message is truncated only at the maximum record size.
+ * The hit counter of the callsite is incremented if the event has been stored.
+ */
+int ddlog_log_va_cs(ddlog_callsite_t* callsite, const char* format, ...){
+    char message[DDLOG_MAX_RECORD_SIZE];
+    int res = DDLOG_RET_ERR;
+    int len = 0;
+    va_list args;
+    if (ddlog_lib_inited && ddlog_default_buf && ddlog_enabled && callsite && format) {
+        va_start(args, format);
+        len = vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        if (len < 0){
+            return DDLOG_RET_ERR;
+        }
+        if ((size_t) len >= sizeof(message)){
+            len = sizeof(message) - 1;
+        }
+        res = ddlog_log_raw_internal(ddlog_default_buf, callsite, NULL, NULL, 0,
+                message, len, 0, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
+        if (res == DDLOG_RET_OK){
+            __atomic_fetch_add(&callsite->hits, 1, __ATOMIC_RELAXED);
         }
     }
     return res;
@@ -396,6 +613,34 @@ int ddlog_get_status(void){
     return ddlog_enabled;
 }
 
+/**
+ * \brief Sets the runtime severity level
+ *
+ * \param level The most verbose level logged (DDLOG_LEVEL_*)
+ *
+ * The log statements of a less severe level are skipped by the
+ * logging macros before their arguments are evaluated. The levels
+ * compiled out with DDLOG_COMPILE_LEVEL can not be enabled.
+ */
+void ddlog_set_level(int level){
+    if (level < DDLOG_LEVEL_NONE){
+        level = DDLOG_LEVEL_NONE;
+    }
+    if (level > DDLOG_LEVEL_TRACE){
+        level = DDLOG_LEVEL_TRACE;
+    }
+    ddlog_level = level;
+    ddlog_active_level = ddlog_enabled ? ddlog_level : DDLOG_LEVEL_NONE;
+}
+
+/**
+ * \brief Returns with the runtime severity level
+ * \return The most verbose level logged (DDLOG_LEVEL_*)
+ */
+int ddlog_get_level(void){
+    return ddlog_level;
+}
+
 /**
  * \brief Increases the thread-specific indention level.
  *
@@ -427,148 +672,370 @@ void ddlog_dec_indent(void){
  ******************************************************************************/
 
 /**
- * \brief Internal buffer initialization function
- *
- * \param size The maximum number of log messages in the log buffer.
- * \return Pointer to the allocated log buffer or NULL in case of error.
+ * \brief Internal library initialization function
  *
- * By design the library is capable of creating and using multiple log buffers.
- * For the first time only one default log buffer will be used/available for the library
- * user, and the user does not have to provide the log buffer when using the libtrary.
- * The internal functions are capable of working with log buffers other than the default one.
- * Because of this all public library function is a wrapper in which
- * the internal function is called with the default log buffer.
+ * \param opt The options of the default log buffer. If the size is 0,
+ *            no default buffer is allocated
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
  */
-ddlog_buffer_t* ddlog_init_buffer_internal(size_t size){
-    ddlog_buffer_t* buffer = 0;
-    ddlog_event_t* event = NULL, *prev_event = NULL;
-    unsigned int i = 0;
-    int res = 0;
+int ddlog_init_internal(const ddlog_buffer_opt_t* opt){
+    size_t size = opt->size;
+    int spin_res = 0;
+    int ext_init_res = DDLOG_RET_ERR;
 
-    /* Allocate the log buffer */
-    buffer = (ddlog_buffer_t*) malloc(sizeof(ddlog_buffer_t));
-    if (buffer == NULL){
-        return NULL;
+    if (ddlog_lib_inited == 1) {
+        return DDLOG_RET_ALREADY_INITED;
     }
-    memset(buffer, 0, sizeof(ddlog_buffer_t));
 
-    /* Allocate all log event structures */
-    for (i = 0; i < size; i++){
-        event = (ddlog_event_t*) malloc(sizeof(ddlog_event_t));
-        if (event == NULL) {
-            ddlog_cleanup_buffer_internal(buffer);
-            return NULL;
-        }
-        memset(event, 0, sizeof(ddlog_event_t));
-        if (buffer->head == NULL) {
-            buffer->head = event;
-        } else {
-            prev_event->next = event;
-        }
-        prev_event = event;
+    if (size > DDLOG_MAX_EVENT_NUM) {
+        size = DDLOG_MAX_EVENT_NUM;
     }
 
-    /* Set the defaults, initialize lock */
-    event->next = buffer->head;
-    buffer->next_write = buffer->head;
-    buffer->buffer_size = size;
-    res = pthread_spin_init(&buffer->lock, PTHREAD_PROCESS_PRIVATE);
-    if (res) {
-        ddlog_cleanup_buffer_internal(buffer);
-        return NULL;
+    /* init the global lock */
+    spin_res = pthread_spin_init(&ddlog_global_lock, PTHREAD_PROCESS_PRIVATE);
+    if (spin_res) {
+        return DDLOG_RET_ERR;
     }
+    ddlog_global_lock_state = DDLOG_LOCK_UNLOCKED;
 
-    return buffer;
-}
+    /* the event timestamps are converted to wall clock time
+     * by this calibration record */
+    ddlog_clock_calibrate_internal();
 
+    /* the private thread rings are released when the owner thread exits */
+    if (ddlog_thread_key_created == 0){
+        if (pthread_key_create(&ddlog_thread_key, ddlog_release_thread_buffers_internal)){
+            return DDLOG_RET_ERR;
+        }
+        ddlog_thread_key_created = 1;
+    }
 
-/**
- * \brief Internal library reset function
- *
- * \param log_buffer The log buffer to be reset
- * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of any error
- *
- * Resets the log buffer provided as a parameter.
- */
-int ddlog_reset_buffer_internal(ddlog_buffer_t* log_buffer) {
-    int res = DDLOG_RET_ERR, start = 1;
-    ddlog_event_t *event = NULL;
+    /* set up the buffer pointer array and allocate the default
+     * log buffer
+     */
+    memset(ddlog_buffers, 0, sizeof(ddlog_buffers));
 
-    if (log_buffer){
-        res = ddlog_lock_buffer_internal(log_buffer);
-        if (res){
-            return res;
+    if (size != 0) {
+        ddlog_buffers[0] = ddlog_new_buffer_internal(opt, size, 0);
+        if (ddlog_buffers[0]) {
+            ddlog_default_buf = ddlog_buffers[0];
+            ddlog_default_buf_id = 0;
         }
+    }
 
-        event = log_buffer->head;
-        while (event){
-            if (event == log_buffer->head){
-                if (start == 1){    /* check if we have reached back to the head again or just starting to delete*/
-                    start = 0;
-                    ddlog_reset_event_internal(event);
-                    event = event->next;
-                } else {
-                    event = NULL;
-                }
-            } else {
-                ddlog_reset_event_internal(event);
-                event = event->next;
+    ext_init_res = ddlog_ext_init();
+    if (ext_init_res == DDLOG_RET_OK){
+        ddlog_enable_internal();
+        ddlog_lib_inited = 1;
+        return DDLOG_RET_OK;
+    }
+
+    return DDLOG_RET_ERR;
+}
+
+/**
+ * \brief Internal buffer creation function
+ *
+ * \param opt The buffer options (size, per thread flag, overflow policy)
+ * \return the index of the new buffer or DDLOG_RET_ERR
+ *         in case of any error
+ */
+ddlog_buffer_id_t ddlog_create_buffer_internal(const ddlog_buffer_opt_t* opt){
+    size_t size = opt->size;
+    int buffer_index = -1;
+    int i = 0;
+    int lock_res = DDLOG_RET_ERR;
+    ddlog_buffer_t* buffer = NULL;
+
+    if (ddlog_lib_inited){
+        lock_res = ddlog_lock_global(0);
+        if (lock_res != DDLOG_RET_OK){
+            return DDLOG_RET_ERR;
+        }
+
+        /* search for the first free buffer id */
+        for (i = 0; i < DDLOG_MAX_BUF_NUM; i++){
+            if (ddlog_buffers[i] == NULL){
+                buffer_index = i;
+                break;
             }
         }
-        log_buffer->wrapped = 0;
-        log_buffer->event_locked = 0;
-        log_buffer->next_write = log_buffer->head;
-        res = ddlog_unlock_buffer_internal(log_buffer);
+
+        /* there is a free buffer, initialize it */
+        if (buffer_index >= 0) {
+            if (size == 0 || size > DDLOG_MAX_EVENT_NUM) {
+                size = DDLOG_MAX_EVENT_NUM;
+            }
+            buffer = ddlog_new_buffer_internal(opt, size, buffer_index);
+            ddlog_buffers[buffer_index] = buffer;
+            if (ddlog_default_buf == NULL){
+                ddlog_default_buf = ddlog_buffers[buffer_index];
+                ddlog_default_buf_id = buffer_index;
+            }
+        }
+
+        lock_res = ddlog_unlock_global();
+        if ( buffer_index >= 0 && ddlog_buffers[buffer_index] != NULL && lock_res == DDLOG_RET_OK){
+            return buffer_index;
+        }
     }
-    return res;
+    return DDLOG_RET_ERR;
+}
+
+/**
+ * \brief Allocates and sets up a new log buffer
+ *
+ * \param opt The buffer options
+ * \param size The maximum number of log messages in the log buffer
+ * \param buffer_id The id of the new buffer
+ * \return Pointer to the new log buffer or NULL in case of error.
+ */
+ddlog_buffer_t* ddlog_new_buffer_internal(const ddlog_buffer_opt_t* opt, size_t size, ddlog_buffer_id_t buffer_id){
+    ddlog_buffer_t* buffer = NULL;
+
+    if (opt->path){
+        buffer = ddlog_recorder_create_internal(opt->path, size, opt->per_thread, buffer_id);
+    } else {
+        buffer = ddlog_init_buffer_internal(ddlog_ring_slots_internal(size));
+    }
+    if (buffer){
+        buffer->id = buffer_id;
+        buffer->per_thread = opt->per_thread;
+        buffer->overflow = opt->overflow;
+        buffer->block_timeout_ns = opt->block_timeout_ns;
+    }
+    return buffer;
 }
 
 /**
- * \brief Internal event reset function
+ * \brief Internal buffer initialization function
+ *
+ * \param slots The number of event slots, power of two (see ddlog_ring_slots_internal())
+ * \return Pointer to the allocated log buffer or NULL in case of error.
  *
- * \param event The event to be cleared/reset
+ * By design the library is capable of creating and using multiple log buffers.
+ * For the first time only one default log buffer will be used/available for the library
+ * user, and the user does not have to provide the log buffer when using the libtrary.
+ * The internal functions are capable of working with log buffers other than the default one.
+ * Because of this all public library function is a wrapper in which
+ * the internal function is called with the default log buffer.
  *
- * Deletes all the fields in the event structure provided as a parameter
+ * The events are allocated in one contiguous, cache line aligned array.
+ * The slot count is a power of two so the slot index can be wrapped with
+ * a simple mask. The data ring holding the variable length
+ * event records and the ext arena holding the large extended payloads are
+ * placed right after the slot array in the same allocation, nothing is
+ * allocated on the logging path.
  */
-void ddlog_reset_event_internal(ddlog_event_t* event){
-    if (event){
-        memset(event->function_name, 0, DDLOG_FNAME_BUF_SIZE);
-        memset(event->thread_name, 0, DDLOG_TNAME_BUF_SIZE);
-        memset(event->message, 0, DDLOG_MSG_BUF_SIZE);
-        event->line_number = 0;
-        event->indent_level = 0;
-        memset(&event->timestamp, 0, sizeof(struct timeval));
-        event->lock = 0;
-        event->used = 0;
-        if (event->ext_data){
-            free(event->ext_data);
-            event->ext_data = NULL;
-        }
-        event->ext_data_size = 0;
-        event->ext_event_type = DDLOG_EXT_EVENT_TYPE_NONE;
-        event->ext_print_cb = NULL;
+ddlog_buffer_t* ddlog_init_buffer_internal(size_t slots){
+    ddlog_buffer_t* buffer = 0;
+    void* events = NULL;
+    size_t data_size = 0;
+    size_t ext_size = 0;
+    int res = 0;
+
+    if (slots == 0){
+        return NULL;
+    }
+
+    data_size = ddlog_ring_data_size_internal(slots);
+    ext_size = ddlog_ring_ext_size_internal(slots);
+
+    /* Allocate the log buffer, cache line aligned for the counter shards */
+    res = posix_memalign((void**) &buffer, DDLOG_CACHE_LINE_SIZE, sizeof(ddlog_buffer_t));
+    if (res){
+        return NULL;
+    }
+    memset(buffer, 0, sizeof(ddlog_buffer_t));
+
+    /* Allocate all log event structures and the data ring in one step */
+    res = posix_memalign(&events, DDLOG_CACHE_LINE_SIZE,
+            slots * sizeof(ddlog_event_t) + data_size + ext_size);
+    if (res) {
+        free(buffer);
+        return NULL;
+    }
+    memset(events, 0, slots * sizeof(ddlog_event_t));
+
+    res = ddlog_setup_buffer_internal(buffer, events, slots, data_size, ext_size);
+    if (res) {
+        free(events);
+        free(buffer);
+        return NULL;
     }
+
+    return buffer;
 }
 
 /**
- * \brief Internal event cleanup function
+ * \brief Returns with the number of event slots of a ring
  *
- * \param event The event to be cleaned up
+ * \param size The requested size of the buffer in log messages
+ * \return The number of slots, power of two
  *
- * Generic event cleanup routine.
- * Free the extended data if allocated for the event.
+ * The size is a memory budget: the ring takes about the memory of size
+ * fixed size events (DDLOG_EVENT_BUDGET_SIZE bytes each). The budget is
+ * spent on slots and on DDLOG_RECORD_AVG_SIZE bytes of data ring per slot,
+ * so a ring of short messages holds up to about 2.6 times as many events
+ * as requested. The slot count is rounded down to a power of two, it is
+ * never below the requested size.
  */
-void ddlog_cleanup_event_internal(ddlog_event_t* event){
-    if (event){
-        if (event->ext_data){
-            free(event->ext_data);
-            event->ext_data = NULL;
-        }
-        free(event);
+size_t ddlog_ring_slots_internal(size_t size){
+    size_t events = size * DDLOG_EVENT_BUDGET_SIZE / (sizeof(ddlog_event_t) + DDLOG_RECORD_AVG_SIZE);
+    size_t slots = 1;
+    while (slots * 2 <= events){
+        slots <<= 1;
+    }
+    return slots;
+}
+
+/**
+ * \brief Returns with the data ring size of a ring
+ *
+ * \param slots The number of event slots of the ring
+ * \return The size of the data ring in bytes, power of two
+ *
+ * The data ring holds DDLOG_RECORD_AVG_SIZE bytes per slot, and at least
+ * two records of the maximum size. The records longer than the average
+ * evict the older events before the slots wrap.
+ */
+size_t ddlog_ring_data_size_internal(size_t slots){
+    size_t data_size = DDLOG_DATA_RING_MIN_SIZE;
+    while (data_size < slots * DDLOG_RECORD_AVG_SIZE){
+        data_size <<= 1;
+    }
+    return data_size;
+}
+
+/**
+ * \brief Returns with the ext arena size of a ring
+ *
+ * \param slots The number of event slots of the ring
+ * \return The size of the ext arena in bytes, power of two
+ *
+ * The arena holds only the payloads not fitting into the event records,
+ * it can always hold two payloads of the maximum size.
+ */
+size_t ddlog_ring_ext_size_internal(size_t slots){
+    size_t ext_size = DDLOG_EXT_ARENA_MIN_SIZE;
+    while (ext_size < slots * DDLOG_EXT_SLOT_SIZE){
+        ext_size <<= 1;
+    }
+    return ext_size;
+}
+
+/**
+ * \brief Returns with the consumer position of a ring
+ *
+ * \param ring The ring
+ * \return The sequence number of the next event to be consumed, not below
+ *         the generation floor set by ddlog_reset()
+ */
+static uint64_t ddlog_ring_read_seq_internal(ddlog_buffer_t* ring){
+    uint64_t reset_seq = __atomic_load_n(&ring->reset_seq, __ATOMIC_ACQUIRE);
+    uint64_t read_seq = __atomic_load_n(&ring->read_seq, __ATOMIC_ACQUIRE);
+    return read_seq > reset_seq ? read_seq : reset_seq;
+}
+
+/**
+ * \brief Returns with the data ring position released by the consumer of a ring
+ */
+static uint64_t ddlog_ring_data_tail_internal(ddlog_buffer_t* ring){
+    uint64_t reset_head = 0, tail = 0;
+
+    reset_head = __atomic_load_n(&ring->reset_data_head, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&ring->data_tail, __ATOMIC_ACQUIRE);
+    return tail > reset_head ? tail : reset_head;
+}
+
+/**
+ * \brief Returns with the ext arena position released by the consumer of a ring
+ */
+static uint64_t ddlog_ring_ext_tail_internal(ddlog_buffer_t* ring){
+    uint64_t reset_head = 0, tail = 0;
+
+    reset_head = __atomic_load_n(&ring->reset_ext_head, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&ring->ext_tail, __ATOMIC_ACQUIRE);
+    return tail > reset_head ? tail : reset_head;
+}
+
+/**
+ * \brief Sets up a zeroed ring structure over the ring memory
+ *
+ * \param buffer The ring structure (zeroed)
+ * \param memory The memory of the slot array, the data ring and the ext arena
+ *               (the slot array zeroed)
+ * \param slots The number of event slots, power of two
+ * \param data_size The size of the data ring, power of two
+ * \param ext_size The size of the ext arena, power of two
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the lock could not be initialized
+ */
+int ddlog_setup_buffer_internal(ddlog_buffer_t* buffer, void* memory, size_t slots, size_t data_size, size_t ext_size){
+    /* Set the defaults, initialize lock */
+    buffer->events = (ddlog_event_t*) memory;
+    buffer->write_seq = 0;
+    buffer->buffer_size = slots;
+    buffer->mask = slots - 1;
+    buffer->data = (char*) memory + slots * sizeof(ddlog_event_t);
+    buffer->data_size = data_size;
+    buffer->data_mask = data_size - 1;
+    buffer->data_head = 0;
+    buffer->ext_arena = buffer->data + data_size;
+    buffer->ext_size = ext_size;
+    buffer->ext_head = 0;
+    buffer->instance = __sync_add_and_fetch(&ddlog_buffer_instance, 1);
+    if (pthread_spin_init(&buffer->lock, PTHREAD_PROCESS_PRIVATE)){
+        return DDLOG_RET_ERR;
     }
+    return DDLOG_RET_OK;
 }
 
 
+/**
+ * \brief Internal library reset function
+ *
+ * \param log_buffer The log buffer to be reset
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of any error
+ *
+ * Resets the log buffer provided as a parameter.
+ * The sequence counter is not reset, the event numbers keep increasing
+ * monotonically over the lifetime of the buffer. The reset only moves the
+ * reset sequence number (the generation floor) of the rings to the sequence
+ * counter, the slots below it are treated as empty by the readers and are
+ * recycled by the producers as usual. The cost does not depend on the
+ * buffer size, the event slots are not touched.
+ *
+ * The positions of the drainer (read_seq, data_tail, ext_tail) are owned
+ * by the drainer and are not written here: the drainer and the producers
+ * of a non overwriting ring take the generation floor as the lower bound
+ * of them. The floor positions of the data ring and the ext arena are
+ * read before the sequence counter, a record being written meanwhile is
+ * never released. The performance counters are not cleared.
+ */
+int ddlog_reset_buffer_internal(ddlog_buffer_t* log_buffer) {
+    int res = DDLOG_RET_ERR;
+    uint64_t data_head = 0, ext_head = 0;
+    size_t i = 0;
+
+    if (log_buffer){
+        res = ddlog_lock_buffer_internal(log_buffer);
+        if (res){
+            return res;
+        }
+
+        data_head = __atomic_load_n(&log_buffer->data_head, __ATOMIC_ACQUIRE);
+        ext_head = __atomic_load_n(&log_buffer->ext_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&log_buffer->reset_data_head, data_head, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_buffer->reset_ext_head, ext_head, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_buffer->reset_seq, __atomic_load_n(&log_buffer->write_seq, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        for (i = 0; i < log_buffer->thread_buffer_num; i++){
+            ddlog_reset_buffer_internal(log_buffer->thread_buffers[i]);
+        }
+        res = ddlog_unlock_buffer_internal(log_buffer);
+    }
+    return res;
+}
+
 /**
  * \brief Internal library cleanup function
  *
@@ -578,31 +1045,23 @@ void ddlog_cleanup_event_internal(ddlog_event_t* event){
  */
 /* TODO: free spinlock of the buffer */
 void ddlog_cleanup_buffer_internal(ddlog_buffer_t* buffer){
-    ddlog_event_t *event, *tmp = 0;
+    size_t i = 0;
     int res = 0;
-    int start = 1;
     if (buffer){
         res = ddlog_lock_buffer_internal(buffer); /* lock the buffer so no other thread will try to log a new event */
         if (res == -1) {
             return;
         }
-        event = buffer->head;
-        while (event){
-            tmp = event;
-            if (event == buffer->head){
-                if (start == 1){    /* check if we have reached back to the head again or just starting to delete*/
-                    start = 0;
-                    event = event->next;
-                    ddlog_cleanup_event_internal(tmp);
-                } else {
-                    event = NULL;
-                }
-            } else {
-                event = event->next;
-                ddlog_cleanup_event_internal(tmp);
-            }
+        for (i = 0; i < buffer->thread_buffer_num; i++){
+            ddlog_cleanup_buffer_internal(buffer->thread_buffers[i]);
+        }
+        if (buffer->persistent){
+            /* the rings are in the file mapping, the file is kept */
+            ddlog_recorder_close_internal(buffer);
+        } else {
+            free(buffer->events);
+            free(buffer);
         }
-        free(buffer);
     }
 }
 
@@ -615,132 +1074,1115 @@ void ddlog_cleanup_buffer_internal(ddlog_buffer_t* buffer){
  * \param line_num The source code line number of the log message (optional)
  * \param message The log message string
  * \return 0 on success, -1 in case of error
+ */
+int ddlog_log_internal(
+        ddlog_buffer_t* log_buffer,
+        const char* thread,
+        const char* function,
+        unsigned int line_num,
+        const char* message,
+        void* ext_data,
+        size_t ext_data_size,
+        ddlog_ext_event_type_t ext_event_type)
+{
+    return ddlog_log_raw_internal(log_buffer, NULL, thread, function, line_num,
+            message, message ? strlen(message) : 0, 0,
+            ext_data, ext_data_size, ext_event_type);
+}
+
+/**
+ * \brief Internal function for saving a deferred log message in the buffer
+ *
+ * \param log_buffer The buffer into the new message will be placed
+ * \param callsite The callsite descriptor of the logging macro (optional)
+ * \param function The name of the function from where the message is logged (optional)
+ * \param line_num The source code line number of the log message (optional)
+ * \param format The format string (string literal)
+ * \param args The arguments of the format string
+ * \return 0 on success, -1 in case of error
+ *
+ * The format string pointer and the packed arguments are stored as the
+ * message of the event. The message of a file backed buffer is formatted
+ * right away, the format string is not available after the process exited.
+ */
+int ddlog_log_fmt_internal(
+        ddlog_buffer_t* log_buffer,
+        const ddlog_callsite_t* callsite,
+        const char* function,
+        unsigned int line_num,
+        const char* format,
+        va_list args)
+{
+    char message[DDLOG_MAX_DEFERRED_SIZE];
+    size_t message_len = sizeof(format);
+
+    if (log_buffer->persistent){
+        vsnprintf(message, sizeof(message), format, args);
+        return ddlog_log_raw_internal(log_buffer, callsite, NULL, function, line_num,
+                message, strlen(message), 0, NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
+    }
+
+    memcpy(message, &format, sizeof(format));
+    message_len += ddlog_fmt_pack(message + message_len, sizeof(message) - message_len, format, args);
+
+    return ddlog_log_raw_internal(log_buffer, callsite, NULL, function, line_num,
+            message, message_len, DDLOG_EVENT_FLAG_DEFERRED,
+            NULL, 0, DDLOG_EXT_EVENT_TYPE_NONE);
+}
+
+/**
+ * \brief Publishes the stamp of a locked event slot and releases the slot
+ *
+ * \param ring The ring owning the slot
+ * \param event The event slot locked by the caller
+ * \param stamp The stamp to be published
+ *
+ * If a producer dropped its event on the slot meanwhile (see
+ * ddlog_log_raw_internal()), a tombstone of the newest reservation of
+ * the slot is published instead of the stamp. The readers skip the
+ * tombstone like an overwritten event, the drainer and the follow
+ * cursors do not stall on the event never published.
+ */
+static void ddlog_event_release_internal(ddlog_buffer_t* ring, ddlog_event_t* event, uint64_t stamp){
+    uint64_t slot = event - ring->events;
+    uint64_t end = 0, dropped = 0;
+    unsigned char state = 0;
+
+    while (1){
+        state = event->lock;
+        if (state & DDLOG_EVENT_LOCK_DROPPED){
+            end = __atomic_load_n(&ring->write_seq, __ATOMIC_ACQUIRE);
+            dropped = end - 1 - ((end - 1 - slot) & ring->mask);
+            if (dropped + 1 > (stamp & ~DDLOG_EVENT_SEQ_DROPPED)){
+                stamp = (dropped + 1) | DDLOG_EVENT_SEQ_DROPPED;
+            }
+        }
+        __sync_synchronize();
+        event->seq = stamp;
+        if (__sync_bool_compare_and_swap(&event->lock, state, 0)){
+            return;
+        }
+    }
+}
+
+/**
+ * \brief Internal function for saving a new log event in the buffer
+ *
+ * \param log_buffer The buffer into the new message will be placed
+ * \param callsite The callsite descriptor of the logging macro (optional)
+ * \param thread The thread name from where the message is logged (optional)
+ * \param function The name of the function from where the message is logged (optional)
+ * \param line_num The source code line number of the log message (optional)
+ * \param message The log message (string or deferred message data)
+ * \param message_len The length of the message (without terminating zero)
+ * \param flags The event flags (DDLOG_EVENT_FLAG_*)
+ * \param ext_data The extended event data (optional)
+ * \param ext_data_size The size of the extended event data
+ * \param ext_event_type The extended event type
+ * \return 0 on success, -1 in case of error
  *
  * This function is the workhorse of the log message handling.
- * Gets the next free log buffer position and copies the message into the buffer
- * The buffer is locked only for the pointer handling. As soon as the log message
- * structure for the new message is secured, a temporary pointer is provided, and the
- * buffer lock is released.
+ * The event slot is reserved with a single atomic increment of the buffer
+ * sequence counter, no buffer lock is taken on the logging path.
+ * The slot index is the sequence number masked with the buffer size.
+ * While the event is written, its sequence stamp is 0. As soon as all
+ * the data is stored, the stamp is set to the sequence number + 1, this
+ * is how the readers can tell the complete events from the ones in progress.
+ *
+ * If the calling thread owns a private ring in a per thread buffer,
+ * the event is stored there. The thread is the only writer of the
+ * ring so no atomic operation is needed, only the store ordering
+ * towards the readers has to be kept.
+ *
+ * The buffers with a non overwriting overflow policy are written by
+ * ddlog_log_bounded_internal().
  */
-int ddlog_log_internal(
+int ddlog_log_raw_internal(
         ddlog_buffer_t* log_buffer,
+        const ddlog_callsite_t* callsite,
         const char* thread,
         const char* function,
         unsigned int line_num,
         const char* message,
+        size_t message_len,
+        uint8_t flags,
         void* ext_data,
         size_t ext_data_size,
         ddlog_ext_event_type_t ext_event_type)
 {
     ddlog_event_t* event = NULL;
-    int res = 0;
+    ddlog_buffer_t* ring = NULL;
+    uint64_t seq = 0, bytes = 0;
     unsigned char lock_state = 0;
 
-    /* grab the buffer lock
-     * get the next free slot and release the lock as soon as possible
-     * if the lock cannot be aquired, return with error
-     */
-    res = ddlog_lock_buffer_internal(log_buffer);
-    if (res == 0){
-        event = log_buffer -> next_write;
-        log_buffer -> next_write = event->next;
-        if (log_buffer->next_write == log_buffer->head){
-            log_buffer->wrapped++;
-        }
-        res = ddlog_unlock_buffer_internal(log_buffer);
-        if (res) {
-            return DDLOG_RET_ERR;
-        }
-    } else {
-        return DDLOG_RET_ERR;
+    ring = ddlog_get_thread_buffer_internal(log_buffer);
+    if (ring && ring->overflow == DDLOG_OVERFLOW_OVERWRITE){
+        return ddlog_log_ordered_internal(ring, callsite, thread, function, line_num,
+                message, message_len, flags, ext_data, ext_data_size, ext_event_type);
+    }
+    if (ring || log_buffer->overflow != DDLOG_OVERFLOW_OVERWRITE){
+        return ddlog_log_bounded_internal(ring ? ring : log_buffer, callsite, thread, function, line_num,
+                message, message_len, flags, ext_data, ext_data_size, ext_event_type);
     }
 
+    /* reserve the next sequence number, it selects the event slot */
+    seq = __sync_fetch_and_add(&log_buffer->write_seq, 1);
+    event = &log_buffer->events[seq & log_buffer->mask];
+
     /* Check if the event is not locked, i.e. other thread is not
      * filling the event structure. This could happen if the buffer
-     * is wrapped since the event structure is provided to another
-     * thread but that one has not been finished updating the event
+     * wraps very often and the slot is provided to another thread
+     * while the previous owner has not been finished updating the event
      * structure.
      *
-     * The buffer lock is placed to the buffer only during the
-     * next write pointer is selected. If the buffer wraps very
-     * often, the same events could be used by multiple threads
-     * so we have to lock the event structure as well.
-     *
      * After the event is filled with the data, we release the
      * event structure lock.
      *
      * If we happen to get a event which is currently locked,
-     * we return with -1 and do not store the event.
+     * we return with DDLOG_RET_EVNT_LOCKED and do not store the event.
+     * The lock is flagged, so the holder leaves a tombstone of the
+     * dropped event in the slot: the readers waiting for it must not stall.
      */
-    lock_state = __sync_lock_test_and_set(&event->lock, 1);
-    if (lock_state != 0) {
-        /*
-         * This event is still in use from another thread.
-         * We have to leave now, this event is getting dropped.
-         */
-        return DDLOG_RET_EVNT_LOCKED;
-    }
-
-    gettimeofday(&(event->timestamp), NULL);
-
-    event->thread_name[0] = '\0';
-    event->function_name[0] = '\0';
-    event->message[0] = '\0';
-    /* store thread name if it is provided */
-    if (thread){
-        strncpy(event->thread_name, thread, DDLOG_TNAME_BUF_SIZE - 1);
-    }
-
-    /* store the function name if it is provided */
-    if (function){
-        strncpy(event->function_name, function, DDLOG_FNAME_BUF_SIZE - 1);
-    }
-
-    /* store or clear the line number */
-    event->line_number = line_num;
-
-    /* store the log message */
-    if (message) {
-        strncpy(event->message, message, DDLOG_MSG_BUF_SIZE - 1);
+    while ((lock_state = __sync_fetch_and_or(&event->lock, DDLOG_EVENT_LOCKED)) & DDLOG_EVENT_LOCKED){
+        if (__sync_bool_compare_and_swap(&event->lock, lock_state, lock_state | DDLOG_EVENT_LOCK_DROPPED)){
+            /*
+             * This event is still in use from another thread.
+             * We have to leave now, this event is getting dropped.
+             */
+            ddlog_stats_add_internal(log_buffer, &ddlog_stats_shard_internal(log_buffer)->events_dropped, 1);
+            return DDLOG_RET_EVNT_LOCKED;
+        }
     }
 
-    /* clean up external event data */
-    if (event->ext_data != NULL){
-        free(event->ext_data);
-        event->ext_data = NULL;
-        event->ext_data_size = 0;
-        event->ext_event_type = DDLOG_EXT_EVENT_TYPE_NONE;
+    /* A newer event already took over the slot while this thread was
+     * delayed between the reservation and the slot locking. Keep the
+     * newer one. */
+    if ((event->seq & ~DDLOG_EVENT_SEQ_DROPPED) > seq + 1){
+        ddlog_event_release_internal(log_buffer, event, event->seq);
+        ddlog_stats_add_internal(log_buffer, &ddlog_stats_shard_internal(log_buffer)->events_dropped, 1);
+        return DDLOG_RET_EVNT_LOCKED;
     }
 
-    /* if external log data has been provided, store it in the event */
-    if (ext_event_type != DDLOG_EXT_EVENT_TYPE_NONE && ext_data && ext_data_size > 0) {
-        event->ext_data = malloc(ext_data_size);
-        memcpy(event->ext_data, ext_data, ext_data_size);
-        event->ext_event_type = ext_event_type;
-        event->ext_print_cb = ddlog_ext_get_print_cb(ext_event_type);
-        event->ext_data_size = ext_data_size;
-    }
+    ddlog_fill_event_internal(log_buffer, event, callsite, thread, function, line_num,
+            message, message_len, flags, ext_data, ext_data_size, ext_event_type);
+    bytes = ddlog_stats_event_bytes_internal(event);
 
-    event->indent_level = ddlog_thread_indent_level;
-    event->used = 1;
-    __sync_and_and_fetch(&event->lock, 0);
+    /* publish the event, then release the slot */
+    ddlog_event_release_internal(log_buffer, event, seq + 1);
+    ddlog_stats_event_written_internal(log_buffer, seq, bytes);
 
     return DDLOG_RET_OK;
 }
 
-
 /**
- * \brief Internal buffer locking function. Aquire buffer lock.
+ * \brief Internal function storing a new log event in sequence order
  *
- * \param buffer Pointer to the buffer to be locked
- * \return DDLOG_RET_OK in case the lock is aquired, DDLOG_RET_ERR otherwise.
+ * \param ring The ring into the new event will be placed
+ * \return DDLOG_RET_OK on success, DDLOG_RET_BUF_FULL if the ring has no
+ *         room for the event (only with a non overwriting overflow policy)
  *
- * Tries to lock the buffer.
+ * The rest of the parameters are the same as of ddlog_log_raw_internal().
+ * The caller has to be the only writer of the ring: the owner thread of a
+ * private ring, or the holder of the buffer lock. The sequence counter is
+ * moved after the event has been published, so the drainer never finds a
+ * slot in progress below the sequence counter.
  */
-int ddlog_lock_buffer_internal(ddlog_buffer_t* buffer){
-    int res = 0;
-    if (ddlog_lib_inited && buffer) {
+int ddlog_log_ordered_internal(
+        ddlog_buffer_t* ring,
+        const ddlog_callsite_t* callsite,
+        const char* thread,
+        const char* function,
+        unsigned int line_num,
+        const char* message,
+        size_t message_len,
+        uint8_t flags,
+        void* ext_data,
+        size_t ext_data_size,
+        ddlog_ext_event_type_t ext_event_type)
+{
+    ddlog_event_t* event = NULL;
+    uint64_t seq = ring->write_seq;
+    int res = 0;
+
+    if (ring->overflow != DDLOG_OVERFLOW_OVERWRITE &&
+            seq - ddlog_ring_read_seq_internal(ring) >= ring->buffer_size){
+        return DDLOG_RET_BUF_FULL;
+    }
+    event = &ring->events[seq & ring->mask];
+
+    res = ddlog_fill_event_internal(ring, event, callsite, thread, function, line_num,
+            message, message_len, flags, ext_data, ext_data_size, ext_event_type);
+    if (res != DDLOG_RET_OK){
+        return res;
+    }
+    __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->write_seq, seq + 1, __ATOMIC_RELEASE);
+    ddlog_stats_event_written_internal(ring, seq, ddlog_stats_event_bytes_internal(event));
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Internal function storing a new log event into a non overwriting ring
+ *
+ * \param ring The ring into the new event will be placed
+ * \return DDLOG_RET_OK on success, DDLOG_RET_BUF_FULL if the event has
+ *         been dropped, DDLOG_RET_ERR in case of error
+ *
+ * The rest of the parameters are the same as of ddlog_log_raw_internal().
+ * The shared rings are written under the buffer lock. If the ring is full,
+ * a DDLOG_OVERFLOW_DROP_NEW ring drops the event, a DDLOG_OVERFLOW_BLOCK
+ * ring retries until the drainer makes room or the timeout of the ring expires.
+ * The lock is not held while waiting.
+ */
+int ddlog_log_bounded_internal(
+        ddlog_buffer_t* ring,
+        const ddlog_callsite_t* callsite,
+        const char* thread,
+        const char* function,
+        unsigned int line_num,
+        const char* message,
+        size_t message_len,
+        uint8_t flags,
+        void* ext_data,
+        size_t ext_data_size,
+        ddlog_ext_event_type_t ext_event_type)
+{
+    uint64_t start = 0, now = 0;
+    int res = 0;
+
+    while (1){
+        if (!ring->single_producer && ddlog_lock_buffer_internal(ring) != DDLOG_RET_OK){
+            return DDLOG_RET_ERR;
+        }
+        res = ddlog_log_ordered_internal(ring, callsite, thread, function, line_num,
+                message, message_len, flags, ext_data, ext_data_size, ext_event_type);
+        if (!ring->single_producer){
+            ddlog_unlock_buffer_internal(ring);
+        }
+        if (res != DDLOG_RET_BUF_FULL || ring->overflow != DDLOG_OVERFLOW_BLOCK){
+            break;
+        }
+
+        now = ddlog_clock_read_ns_internal(CLOCK_MONOTONIC);
+        if (start == 0){
+            start = now;
+        } else if (now - start >= ring->block_timeout_ns){
+            break;
+        }
+        sched_yield();
+    }
+
+    if (res == DDLOG_RET_BUF_FULL){
+        ddlog_stats_add_internal(ring, &ddlog_stats_shard_internal(ring)->events_dropped, 1);
+    }
+    return res;
+}
+
+/**
+ * \brief Internal function storing the log data into a reserved event slot
+ *
+ * \param ring The ring owning the event slot
+ * \param event The event slot reserved for the caller
+ * \param callsite The callsite descriptor of the logging macro (optional)
+ * \param thread The thread name from where the message is logged (optional)
+ * \param function The name of the function from where the message is logged (optional)
+ * \param line_num The source code line number of the log message (optional)
+ * \param message The log message (string or deferred message data)
+ * \param message_len The length of the message (without terminating zero)
+ * \param flags The event flags (DDLOG_EVENT_FLAG_*)
+ * \param ext_data The extended event data (optional)
+ * \param ext_data_size The size of the extended event data
+ * \param ext_event_type The extended event type
+ *
+ * The strings are stored as one length prefixed record in the data ring
+ * of the ring, only the actual string lengths are copied. The message is
+ * truncated only if the record would not fit into DDLOG_MAX_RECORD_SIZE.
+ * If the event has a callsite descriptor, the function name and the line
+ * number are taken from the descriptor and not copied into the record.
+ * If no thread name is provided, only the registry id of the calling thread
+ * is stored. The thread name is copied only if the thread could not be
+ * registered. The rings of a file backed buffer do not refer to the process
+ * memory: the function and thread names are always copied and the callsite
+ * is not stored.
+ *
+ * A small extended payload is stored inline in the record. The larger ones
+ * (up to DDLOG_MAX_EXT_SIZE) are copied into the ext arena of the ring,
+ * which is reserved and recycled the same way as the data ring.
+ *
+ * The slot is invalidated for the readers before it is written. The ring
+ * of a non overwriting overflow policy is checked first: if the data ring
+ * or the ext arena has no room next to the records not yet consumed, the
+ * slot is left untouched and DDLOG_RET_BUF_FULL is returned.
+ */
+int ddlog_fill_event_internal(
+        ddlog_buffer_t* ring,
+        ddlog_event_t* event,
+        const ddlog_callsite_t* callsite,
+        const char* thread,
+        const char* function,
+        unsigned int line_num,
+        const char* message,
+        size_t message_len,
+        uint8_t flags,
+        void* ext_data,
+        size_t ext_data_size,
+        ddlog_ext_event_type_t ext_event_type)
+{
+    ddlog_record_hdr_t hdr;
+    size_t thread_len = 0, function_len = 0;
+    size_t record_size = 0, ext_offset = 0, ext_reserved = 0;
+    uint64_t pos = 0;
+
+    if (thread == NULL && (ddlog_thread_id == DDLOG_THREAD_ID_NONE || ring->persistent) &&
+            ddlog_thread_name[0] != '\0'){
+        thread = ddlog_thread_name;
+    }
+    if (callsite){
+        function = ring->persistent ? callsite->function : NULL;
+        line_num = callsite->line;
+    }
+
+    /* calculate the record layout, the strings are stored with the
+     * terminating zero */
+    if (thread){
+        thread_len = strnlen(thread, DDLOG_MAX_NAME_LEN - 1) + 1;
+        if (thread_len > 1){
+            flags |= DDLOG_EVENT_FLAG_THREAD_NAME;
+        }
+    }
+    if (function){
+        function_len = strnlen(function, DDLOG_MAX_NAME_LEN - 1) + 1;
+    }
+    if (message == NULL){
+        message_len = 0;
+    } else if ((flags & DDLOG_EVENT_FLAG_DEFERRED) == 0){
+        message_len++;
+    }
+    record_size = sizeof(hdr) + thread_len + function_len + message_len;
+    if (record_size > DDLOG_MAX_RECORD_SIZE){
+        message_len -= record_size - DDLOG_MAX_RECORD_SIZE;
+        record_size = DDLOG_MAX_RECORD_SIZE;
+    }
+    if (ext_event_type == DDLOG_EXT_EVENT_TYPE_NONE || ext_data == NULL){
+        ext_data_size = 0;
+    }
+    if (ext_data_size > DDLOG_MAX_EXT_SIZE){
+        ext_data_size = DDLOG_MAX_EXT_SIZE;
+    }
+    ext_offset = (record_size + 7) & ~((size_t) 7);
+    if (ext_data_size > 0 && ext_data_size <= DDLOG_EXT_INLINE_SIZE &&
+            ext_offset + ext_data_size <= DDLOG_MAX_RECORD_SIZE){
+        flags |= DDLOG_EVENT_FLAG_EXT_INLINE;
+        record_size = ext_offset + ext_data_size;
+    }
+    record_size = (record_size + 7) & ~((size_t) 7);
+    if (ext_data_size > 0 && (flags & DDLOG_EVENT_FLAG_EXT_INLINE) == 0){
+        ext_reserved = (ext_data_size + 7) & ~((size_t) 7);
+    }
+
+    /* the non overwriting rings must keep the records not yet consumed */
+    if (ring->overflow != DDLOG_OVERFLOW_OVERWRITE &&
+            (ring->data_head + record_size - ddlog_ring_data_tail_internal(ring) > ring->data_size ||
+             ring->ext_head + ext_reserved - ddlog_ring_ext_tail_internal(ring) > ring->ext_size)){
+        return DDLOG_RET_BUF_FULL;
+    }
+
+    /* invalidate the slot for the readers while it is being written */
+    event->seq = 0;
+    if (ring->single_producer){
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    } else {
+        __sync_synchronize();
+    }
+    event->timestamp = ddlog_clock_now_internal();
+    event->callsite = ring->persistent ? NULL : callsite;
+    event->thread_id = ddlog_thread_id;
+
+    /* reserve the record in the data ring. The head is moved before the
+     * data is written, this is how the readers detect the overwritten records */
+    if (ring->single_producer){
+        pos = ring->data_head;
+        __atomic_store_n(&ring->data_head, pos + record_size, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    } else {
+        pos = __sync_fetch_and_add(&ring->data_head, record_size);
+    }
+    event->data_pos = pos;
+    event->data_size = record_size;
+
+    hdr.size = record_size;
+    hdr.thread_len = thread_len;
+    hdr.function_len = function_len;
+    hdr.message_len = message_len;
+    hdr.reserved = 0;
+    ddlog_data_write_internal(ring, pos, &hdr, sizeof(hdr));
+    pos += sizeof(hdr);
+    ddlog_data_write_str_internal(ring, pos, thread, thread_len);
+    pos += thread_len;
+    ddlog_data_write_str_internal(ring, pos, function, function_len);
+    pos += function_len;
+    if (flags & DDLOG_EVENT_FLAG_DEFERRED){
+        ddlog_data_write_internal(ring, pos, message, message_len);
+    } else {
+        ddlog_data_write_str_internal(ring, pos, message, message_len);
+    }
+    event->flags = flags;
+
+    /* store or clear the line number */
+    event->line_number = line_num;
+
+    /* store the external log data inline or in the ext arena */
+    event->ext_pos = 0;
+    event->ext_data_size = ext_data_size;
+    event->ext_event_type = ext_data_size > 0 ? ext_event_type : DDLOG_EXT_EVENT_TYPE_NONE;
+    if (flags & DDLOG_EVENT_FLAG_EXT_INLINE){
+        ddlog_data_write_internal(ring, event->data_pos + ext_offset, ext_data, ext_data_size);
+    } else if (ext_data_size > 0){
+        if (ring->single_producer){
+            pos = ring->ext_head;
+            __atomic_store_n(&ring->ext_head, pos + ext_reserved, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+        } else {
+            pos = __sync_fetch_and_add(&ring->ext_head, ext_reserved);
+        }
+        event->ext_pos = pos;
+        ddlog_ext_write_internal(ring, pos, ext_data, ext_data_size);
+    }
+
+    event->indent_level = ddlog_thread_indent_level;
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Copies data into the data ring of a ring
+ *
+ * \param ring The ring owning the data ring
+ * \param pos The position in the data ring (not wrapped)
+ * \param src The data to be copied
+ * \param size The size of the data
+ *
+ * The data is split into two parts if it wraps at the end of the data ring.
+ */
+void ddlog_data_write_internal(ddlog_buffer_t* ring, uint64_t pos, const void* src, size_t size){
+    size_t offset = pos & ring->data_mask;
+    size_t first = ring->data_size - offset;
+
+    if (size == 0){
+        return;
+    }
+    if (size <= first){
+        memcpy(ring->data + offset, src, size);
+    } else {
+        memcpy(ring->data + offset, src, first);
+        memcpy(ring->data, (const char*) src + first, size - first);
+    }
+}
+
+/**
+ * \brief Copies a (possibly truncated) string into the data ring of a ring
+ *
+ * \param ring The ring owning the data ring
+ * \param pos The position in the data ring (not wrapped)
+ * \param str The string to be copied
+ * \param len The length of the field including the terminating zero
+ */
+void ddlog_data_write_str_internal(ddlog_buffer_t* ring, uint64_t pos, const char* str, size_t len){
+    if (str && len > 0){
+        ddlog_data_write_internal(ring, pos, str, len - 1);
+        ddlog_data_write_internal(ring, pos + len - 1, "", 1);
+    }
+}
+
+/**
+ * \brief Copies data out of the data ring of a ring
+ *
+ * \param ring The ring owning the data ring
+ * \param pos The position in the data ring (not wrapped)
+ * \param dst The destination buffer
+ * \param size The size of the data
+ */
+void ddlog_data_read_internal(const ddlog_buffer_t* ring, uint64_t pos, void* dst, size_t size){
+    size_t offset = pos & ring->data_mask;
+    size_t first = ring->data_size - offset;
+
+    if (size <= first){
+        memcpy(dst, ring->data + offset, size);
+    } else {
+        memcpy(dst, ring->data + offset, first);
+        memcpy((char*) dst + first, ring->data, size - first);
+    }
+}
+
+/**
+ * \brief Copies an extended payload into the ext arena of a ring
+ *
+ * \param ring The ring owning the ext arena
+ * \param pos The position in the ext arena (not wrapped)
+ * \param src The data to be copied
+ * \param size The size of the data
+ */
+void ddlog_ext_write_internal(ddlog_buffer_t* ring, uint64_t pos, const void* src, size_t size){
+    size_t offset = pos & (ring->ext_size - 1);
+    size_t first = ring->ext_size - offset;
+
+    if (size <= first){
+        memcpy(ring->ext_arena + offset, src, size);
+    } else {
+        memcpy(ring->ext_arena + offset, src, first);
+        memcpy(ring->ext_arena, (const char*) src + first, size - first);
+    }
+}
+
+/**
+ * \brief Copies an extended payload out of the ext arena of a ring
+ *
+ * \param ring The ring owning the ext arena
+ * \param pos The position in the ext arena (not wrapped)
+ * \param dst The destination buffer
+ * \param size The size of the data
+ */
+void ddlog_ext_read_internal(const ddlog_buffer_t* ring, uint64_t pos, void* dst, size_t size){
+    size_t offset = pos & (ring->ext_size - 1);
+    size_t first = ring->ext_size - offset;
+
+    if (size <= first){
+        memcpy(dst, ring->ext_arena + offset, size);
+    } else {
+        memcpy(dst, ring->ext_arena + offset, first);
+        memcpy((char*) dst + first, ring->ext_arena, size - first);
+    }
+}
+
+/**
+ * \brief Copies an event and its record out of a ring
+ *
+ * \param ring The ring to read from
+ * \param seq The sequence number of the event
+ * \param record The event copy is stored here
+ * \return DDLOG_RET_OK if the copy is complete and consistent, DDLOG_RET_ERR
+ *         if the event is not in the ring (anymore), has been reset, is
+ *         being written or its record or ext payload has been overwritten.
+ */
+int ddlog_read_event_internal(ddlog_buffer_t* ring, uint64_t seq, ddlog_record_t* record){
+    ddlog_event_t* event = &ring->events[seq & ring->mask];
+    const ddlog_record_hdr_t* hdr = (const ddlog_record_hdr_t*) record->data;
+    size_t offset = 0;
+    int ext_in_arena = 0;
+
+    if (seq + 1 >= DDLOG_EVENT_SEQ_DROPPED || event->seq != seq + 1 || seq < ring->reset_seq){
+        return DDLOG_RET_ERR;
+    }
+    __sync_synchronize();
+    memcpy(&record->event, event, sizeof(ddlog_event_t));
+    if (record->event.data_size < sizeof(ddlog_record_hdr_t) || record->event.data_size > DDLOG_MAX_RECORD_SIZE){
+        return DDLOG_RET_ERR;
+    }
+    if (record->event.ext_data_size > DDLOG_MAX_EXT_SIZE){
+        return DDLOG_RET_ERR;
+    }
+    ddlog_data_read_internal(ring, record->event.data_pos, record->data, record->event.data_size);
+    if (record->event.ext_data_size > 0 && (record->event.flags & DDLOG_EVENT_FLAG_EXT_INLINE) == 0){
+        ddlog_ext_read_internal(ring, record->event.ext_pos, record->ext, record->event.ext_data_size);
+        ext_in_arena = 1;
+    }
+    __sync_synchronize();
+
+    /* the slot has been reused, reset or the record has been overwritten while copying */
+    if (event->seq != seq + 1 || seq < ring->reset_seq ||
+            ring->data_head - record->event.data_pos > ring->data_size){
+        return DDLOG_RET_ERR;
+    }
+    if (ext_in_arena && ring->ext_head - record->event.ext_pos > ring->ext_size){
+        return DDLOG_RET_ERR;
+    }
+    if (hdr->size != record->event.data_size ||
+            sizeof(ddlog_record_hdr_t) + hdr->thread_len + hdr->function_len + hdr->message_len > hdr->size){
+        return DDLOG_RET_ERR;
+    }
+
+    offset = sizeof(ddlog_record_hdr_t);
+    record->thread_name = hdr->thread_len ? record->data + offset : NULL;
+    offset += hdr->thread_len;
+    record->function_name = hdr->function_len ? record->data + offset : NULL;
+    record->file_name = NULL;
+    if (record->event.callsite){
+        record->function_name = record->event.callsite->function;
+        record->file_name = record->event.callsite->file;
+    }
+    offset += hdr->function_len;
+    record->message = hdr->message_len ? record->data + offset : NULL;
+    offset += hdr->message_len;
+    record->ext_data = NULL;
+    if (record->event.ext_data_size > 0){
+        if (ext_in_arena){
+            record->ext_data = record->ext;
+        } else {
+            offset = (offset + 7) & ~((size_t) 7);
+            if (offset + record->event.ext_data_size > hdr->size){
+                return DDLOG_RET_ERR;
+            }
+            record->ext_data = record->data + offset;
+        }
+    }
+    record->format = NULL;
+    record->args = NULL;
+    record->args_size = 0;
+    if (record->event.flags & DDLOG_EVENT_FLAG_DEFERRED){
+        if (hdr->message_len < sizeof(record->format)){
+            return DDLOG_RET_ERR;
+        }
+        memcpy(&record->format, record->message, sizeof(record->format));
+        record->args = record->message + sizeof(record->format);
+        record->args_size = hdr->message_len - sizeof(record->format);
+        record->message = NULL;
+    }
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Returns with the private ring of the calling thread in a buffer
+ *
+ * \param buffer The log buffer
+ * \return The private ring of the thread or NULL if the buffer is not
+ *         a per thread buffer or the thread does not own a ring in it.
+ */
+ddlog_buffer_t* ddlog_get_thread_buffer_internal(ddlog_buffer_t* buffer){
+    ddlog_thread_buffer_ref_t* ref = NULL;
+    if (buffer->per_thread){
+        ref = &ddlog_thread_buffers[buffer->id];
+        if (ref->instance == buffer->instance){
+            return ref->ring;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Assigns a private ring of a per thread buffer to the calling thread
+ *
+ * \param buffer The per thread log buffer
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if no ring could be assigned
+ *
+ * A ring released by an exited thread is reused if there is any, otherwise
+ * a new ring is allocated. The rings keep their events after the owner
+ * thread exited.
+ */
+int ddlog_attach_thread_buffer_internal(ddlog_buffer_t* buffer){
+    ddlog_thread_buffer_ref_t* ref = &ddlog_thread_buffers[buffer->id];
+    ddlog_buffer_t* ring = NULL;
+    unsigned int i = 0;
+    int res = 0;
+
+    if (ref->instance == buffer->instance && ref->ring){
+        return DDLOG_RET_OK;
+    }
+
+    res = ddlog_lock_buffer_internal(buffer);
+    if (res){
+        return DDLOG_RET_ERR;
+    }
+
+    for (i = 0; i < buffer->thread_buffer_num; i++){
+        if (__atomic_load_n(&buffer->thread_buffers[i]->owned, __ATOMIC_ACQUIRE) == 0){
+            ring = buffer->thread_buffers[i];
+            break;
+        }
+    }
+
+    if (ring == NULL && buffer->thread_buffer_num < DDLOG_MAX_THREAD_BUF_NUM){
+        if (buffer->persistent){
+            ring = ddlog_recorder_add_ring_internal(buffer);
+        } else {
+            ring = ddlog_init_buffer_internal(buffer->buffer_size);
+        }
+        if (ring){
+            ring->id = buffer->id;
+            ring->single_producer = 1;
+            ring->overflow = buffer->overflow;
+            ring->block_timeout_ns = buffer->block_timeout_ns;
+            buffer->thread_buffers[buffer->thread_buffer_num] = ring;
+            __sync_synchronize();
+            buffer->thread_buffer_num++;
+        }
+    }
+
+    if (ring){
+        ring->owned = 1;
+        ref->instance = buffer->instance;
+        ref->ring = ring;
+        pthread_setspecific(ddlog_thread_key, ddlog_thread_buffers);
+    }
+
+    ddlog_unlock_buffer_internal(buffer);
+    return ring ? DDLOG_RET_OK : DDLOG_RET_ERR;
+}
+
+/**
+ * \brief Releases the private rings of the exiting thread
+ *
+ * \param data Thread specific data of the key (unused)
+ *
+ * Called as the thread specific data destructor when a thread exits.
+ * The released rings can be reused by new threads.
+ */
+void ddlog_release_thread_buffers_internal(void* data UNUSED){
+    ddlog_thread_buffer_ref_t* ref = NULL;
+    int i = 0;
+    for (i = 0; i < DDLOG_MAX_BUF_NUM; i++){
+        ref = &ddlog_thread_buffers[i];
+        if (ref->ring && ddlog_buffers[i] && ddlog_buffers[i]->instance == ref->instance){
+            /* the last writes of the thread happen before the ring is reused */
+            __atomic_store_n(&ref->ring->owned, 0, __ATOMIC_RELEASE);
+        }
+        ref->ring = NULL;
+        ref->instance = 0;
+    }
+}
+
+/**
+ * \brief Initializes a reader cursor for a buffer
+ *
+ * \param iter The cursor to be initialized
+ * \param buffer The log buffer to be read
+ *
+ * The cursor covers the events written into the shared ring and the
+ * private thread rings of the buffer up to the time of the call.
+ *
+ * The readers never take the buffer lock. The slot sequence stamps work
+ * as per slot seqlocks: an event is copied only if its stamp is the same
+ * before and after the copy, the torn or overwritten events are skipped.
+ * The private rings are only appended to the buffer and never freed
+ * before the buffer itself, so the ring list can be read without locking.
+ */
+void ddlog_iter_init_internal(ddlog_buffer_iter_t* iter, ddlog_buffer_t* buffer){
+    ddlog_buffer_t* ring = NULL;
+    unsigned int i = 0, ring_num = 0;
+    uint64_t end = 0;
+
+    iter->ring_num = 0;
+    iter->lost = 0;
+    iter->follow = 0;
+    iter->filter = NULL;
+    iter->filter_arg = NULL;
+    if (buffer == NULL){
+        return;
+    }
+    iter->instance = buffer->instance;
+
+    ring_num = buffer->thread_buffer_num + 1;
+    __sync_synchronize();
+    for (i = 0; i < ring_num; i++){
+        ring = (i == 0) ? buffer : buffer->thread_buffers[i - 1];
+        end = ring->write_seq;
+        iter->rings[i] = ring;
+        iter->end_seq[i] = end;
+        iter->next_seq[i] = end > ring->buffer_size ? end - ring->buffer_size : 0;
+        if (iter->next_seq[i] < ring->reset_seq){
+            iter->next_seq[i] = ring->reset_seq;
+        }
+    }
+    iter->ring_num = ring_num;
+}
+
+/**
+ * \brief Returns with the next event of the buffer in timestamp order
+ *
+ * \param iter The reader cursor
+ * \param record The copy of the next event is stored here
+ * \return DDLOG_RET_OK if an event has been copied, DDLOG_RET_ERR if
+ *         there are no more events.
+ *
+ * The oldest event of the rings is returned. The slots being
+ * written, already reset or overwritten are skipped. The slots rejected
+ * by the filter of the cursor are skipped without copying the record.
+ */
+int ddlog_iter_next_internal(ddlog_buffer_iter_t* iter, ddlog_record_t* record){
+    ddlog_event_t* event = NULL, *oldest = NULL;
+    ddlog_buffer_t* ring = NULL;
+    unsigned int i = 0, oldest_idx = 0;
+    uint64_t stamp = 0;
+
+    while (1){
+        oldest = NULL;
+        for (i = 0; i < iter->ring_num; i++){
+            ring = iter->rings[i];
+            event = NULL;
+            while (iter->next_seq[i] < iter->end_seq[i]){
+                event = &ring->events[iter->next_seq[i] & ring->mask];
+                stamp = event->seq;
+                if (stamp == iter->next_seq[i] + 1){
+                    break;
+                }
+                event = NULL;
+                if (iter->follow){
+                    if ((stamp & ~DDLOG_EVENT_SEQ_DROPPED) <= iter->next_seq[i]){
+                        /* still being written, read after the next refresh */
+                        break;
+                    }
+                    iter->lost++;
+                }
+                iter->next_seq[i]++;
+            }
+            if (event == NULL){
+                continue;
+            }
+            if (oldest == NULL || event->timestamp < oldest->timestamp){
+                oldest = event;
+                oldest_idx = i;
+            }
+        }
+
+        if (oldest == NULL){
+            return DDLOG_RET_ERR;
+        }
+        iter->next_seq[oldest_idx]++;
+        if (iter->filter && !iter->filter(oldest, iter->filter_arg)){
+            continue;
+        }
+        if (ddlog_read_event_internal(iter->rings[oldest_idx], iter->next_seq[oldest_idx] - 1, record) == DDLOG_RET_OK){
+            return DDLOG_RET_OK;
+        }
+        if (iter->follow){
+            iter->lost++;
+        }
+    }
+}
+
+/**
+ * \brief Initializes a follow cursor for a buffer
+ *
+ * \param iter The cursor to be initialized
+ * \param buffer The log buffer to be followed
+ *
+ * The cursor starts at the current end of the rings, it returns the
+ * events written after the subsequent ddlog_iter_follow_internal() calls.
+ */
+void ddlog_iter_follow_init_internal(ddlog_buffer_iter_t* iter, ddlog_buffer_t* buffer){
+    unsigned int i = 0;
+
+    ddlog_iter_init_internal(iter, buffer);
+    for (i = 0; i < iter->ring_num; i++){
+        iter->next_seq[i] = iter->end_seq[i];
+        iter->stall_seq[i] = UINT64_MAX;
+    }
+    iter->follow = 1;
+}
+
+/**
+ * \brief Extends a follow cursor to the events written since the last call
+ *
+ * \param iter The follow cursor
+ * \param buffer The log buffer being followed
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the buffer does not
+ *         exist or has been replaced (the cursor is restarted at its end)
+ *
+ * The cursor is an ordinary lock-free reader, the producers are not aware
+ * of it. The events overwritten before the cursor reached them are skipped
+ * and added to iter->lost. Unlike the snapshot readers, the cursor stops
+ * at an event still being written and returns it after a later refresh.
+ * The events dropped on a locked slot are skipped by their tombstone. An
+ * event reserved but still not published at the next refresh is skipped.
+ */
+int ddlog_iter_follow_internal(ddlog_buffer_iter_t* iter, ddlog_buffer_t* buffer){
+    ddlog_buffer_t* ring = NULL;
+    ddlog_event_t* event = NULL;
+    unsigned int i = 0, ring_num = 0;
+    uint64_t end = 0, seq = 0;
+
+    if (buffer == NULL){
+        iter->ring_num = 0;
+        return DDLOG_RET_ERR;
+    }
+    if (iter->ring_num == 0 || iter->rings[0] != buffer || iter->instance != buffer->instance){
+        ddlog_iter_follow_init_internal(iter, buffer);
+        return DDLOG_RET_ERR;
+    }
+
+    ring_num = buffer->thread_buffer_num + 1;
+    __sync_synchronize();
+    for (i = 0; i < ring_num; i++){
+        ring = (i == 0) ? buffer : buffer->thread_buffers[i - 1];
+        if (i >= iter->ring_num){
+            /* a thread ring added since the last refresh */
+            iter->rings[i] = ring;
+            iter->next_seq[i] = 0;
+            iter->stall_seq[i] = UINT64_MAX;
+        }
+        end = ring->write_seq;
+        seq = iter->next_seq[i];
+        if (end > ring->buffer_size && seq < end - ring->buffer_size){
+            iter->lost += end - ring->buffer_size - seq;
+            seq = end - ring->buffer_size;
+        }
+        if (seq < ring->reset_seq){
+            seq = ring->reset_seq;
+        }
+        event = &ring->events[seq & ring->mask];
+        if (seq < end && seq == iter->stall_seq[i] && (event->seq & ~DDLOG_EVENT_SEQ_DROPPED) <= seq){
+            seq++;
+        }
+        iter->next_seq[i] = seq;
+        iter->stall_seq[i] = seq;
+        iter->end_seq[i] = end;
+    }
+    iter->ring_num = ring_num;
+    return DDLOG_RET_OK;
+}
+
+
+/**
+ * \brief Returns with the next event of a ring to be consumed
+ *
+ * \param ring The ring
+ * \return The event slot or NULL if there is no complete event to be consumed
+ *
+ * The events overwritten before they could be consumed are skipped,
+ * this happens only in the rings with the DDLOG_OVERFLOW_OVERWRITE policy.
+ * The events dropped on a locked slot are skipped by their tombstone.
+ * The events below the generation floor set by ddlog_reset() are skipped
+ * and their positions in the data ring and the ext arena are released.
+ */
+static ddlog_event_t* ddlog_consume_peek_internal(ddlog_buffer_t* ring){
+    ddlog_event_t* event = NULL;
+    uint64_t seq = ddlog_ring_read_seq_internal(ring);
+    uint64_t end = 0, stamp = 0;
+
+    /* skip the events discarded by ddlog_reset() */
+    end = ddlog_ring_data_tail_internal(ring);
+    if (end != ring->data_tail){
+        __atomic_store_n(&ring->data_tail, end, __ATOMIC_RELEASE);
+    }
+    end = ddlog_ring_ext_tail_internal(ring);
+    if (end != ring->ext_tail){
+        __atomic_store_n(&ring->ext_tail, end, __ATOMIC_RELEASE);
+    }
+
+    while (1){
+        end = __atomic_load_n(&ring->write_seq, __ATOMIC_ACQUIRE);
+        if (seq >= end){
+            event = NULL;
+            break;
+        }
+        if (end - seq > ring->buffer_size){
+            seq = end - ring->buffer_size;
+            continue;
+        }
+        event = &ring->events[seq & ring->mask];
+        stamp = event->seq;
+        if (stamp == seq + 1){
+            break;
+        }
+        event = NULL;
+        if ((stamp & ~DDLOG_EVENT_SEQ_DROPPED) <= seq){
+            /* still being written */
+            break;
+        }
+        /* overwritten, or dropped (tombstone) */
+        seq++;
+    }
+    if (seq != ring->read_seq){
+        __atomic_store_n(&ring->read_seq, seq, __ATOMIC_RELEASE);
+    }
+    return event;
+}
+
+/**
+ * \brief Consumes the next event of a ring
+ *
+ * \param ring The ring
+ * \param record The copy of the consumed event is stored here
+ * \return DDLOG_RET_OK if an event has been consumed, DDLOG_RET_ERR if
+ *         there is no complete event to be consumed
+ *
+ * A ring can have only one consumer at a time. The positions of the
+ * consumed event are released only after the event has been copied,
+ * so the producers of a non overwriting ring never overwrite an event
+ * being consumed.
+ */
+int ddlog_consume_event_internal(ddlog_buffer_t* ring, ddlog_record_t* record){
+    uint64_t seq = 0, end = 0;
+
+    while (ddlog_consume_peek_internal(ring)){
+        seq = ring->read_seq;
+        if (ddlog_read_event_internal(ring, seq, record) == DDLOG_RET_OK){
+            end = record->event.data_pos + record->event.data_size;
+            if (end > ring->data_tail){
+                __atomic_store_n(&ring->data_tail, end, __ATOMIC_RELEASE);
+            }
+            if (record->event.ext_data_size > 0 && (record->event.flags & DDLOG_EVENT_FLAG_EXT_INLINE) == 0){
+                end = record->event.ext_pos + ((record->event.ext_data_size + 7) & ~((uint64_t) 7));
+                if (end > ring->ext_tail){
+                    __atomic_store_n(&ring->ext_tail, end, __ATOMIC_RELEASE);
+                }
+            }
+            __atomic_store_n(&ring->read_seq, seq + 1, __ATOMIC_RELEASE);
+            return DDLOG_RET_OK;
+        }
+        /* overwritten while being copied */
+        __atomic_store_n(&ring->read_seq, seq + 1, __ATOMIC_RELEASE);
+    }
+    return DDLOG_RET_ERR;
+}
+
+/**
+ * \brief Consumes the next event of a buffer in timestamp order
+ *
+ * \param buffer The buffer
+ * \param record The copy of the consumed event is stored here
+ * \return DDLOG_RET_OK if an event has been consumed, DDLOG_RET_ERR if
+ *         there is no complete event to be consumed
+ *
+ * The oldest event of the shared ring and the private thread rings is consumed.
+ */
+int ddlog_drain_next_internal(ddlog_buffer_t* buffer, ddlog_record_t* record){
+    ddlog_buffer_t* ring = NULL, *oldest_ring = NULL;
+    ddlog_event_t* event = NULL, *oldest = NULL;
+    unsigned int i = 0, ring_num = 0;
+
+    ring_num = buffer->thread_buffer_num + 1;
+    __sync_synchronize();
+    while (1){
+        oldest = NULL;
+        for (i = 0; i < ring_num; i++){
+            ring = (i == 0) ? buffer : buffer->thread_buffers[i - 1];
+            event = ddlog_consume_peek_internal(ring);
+            if (event && (oldest == NULL || event->timestamp < oldest->timestamp)){
+                oldest = event;
+                oldest_ring = ring;
+            }
+        }
+        if (oldest == NULL){
+            return DDLOG_RET_ERR;
+        }
+        if (ddlog_consume_event_internal(oldest_ring, record) == DDLOG_RET_OK){
+            return DDLOG_RET_OK;
+        }
+    }
+}
+
+/**
+ * \brief Internal buffer locking function. Aquire buffer lock.
+ *
+ * \param buffer Pointer to the buffer to be locked
+ * \return DDLOG_RET_OK in case the lock is aquired, DDLOG_RET_ERR otherwise.
+ *
+ * Tries to lock the buffer. The contended acquisitions and the time
+ * spent spinning are counted in the buffer statistics.
+ */
+int ddlog_lock_buffer_internal(ddlog_buffer_t* buffer){
+    ddlog_stats_shard_t* shard = NULL;
+    uint64_t start = 0;
+    int res = 0;
+    if (ddlog_lib_inited && buffer) {
+        if (pthread_spin_trylock(&buffer->lock) == 0){
+            return DDLOG_RET_OK;
+        }
+        /* contended, account the time spent spinning */
+        start = ddlog_clock_now_internal();
         res = pthread_spin_lock(&buffer->lock);
+        shard = ddlog_stats_shard_internal(buffer);
+        ddlog_stats_add_internal(buffer, &shard->lock_contended, 1);
+        ddlog_stats_add_internal(buffer, &shard->lock_spin_ticks, ddlog_clock_now_internal() - start);
         return res  == 0 ? DDLOG_RET_OK : DDLOG_RET_ERR;
     }
     return DDLOG_RET_ERR;
@@ -772,6 +2214,7 @@ void ddlog_disable_internal(void){
     if (ddlog_enabled == 1){
         __sync_fetch_and_sub(&ddlog_enabled, 1);
     }
+    ddlog_active_level = DDLOG_LEVEL_NONE;
 }
 
 /**
@@ -783,6 +2226,7 @@ void ddlog_enable_internal(void){
     if (ddlog_enabled == 0){
         __sync_fetch_and_add(&ddlog_enabled, 1);
     }
+    ddlog_active_level = ddlog_level;
 }
 
 /**
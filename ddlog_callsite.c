@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_callsite.c
+ * \brief Callsite registry implementation
+ *
+ * This file contains the registry of the callsite descriptors emitted
+ * by the logging macros. Every module defined by DDLOG_DEFINE_MODULE()
+ * registers its callsite section at load time and unregisters it when
+ * it is unloaded. The callsites can be listed, enabled
+ * and disabled by pattern.
+ *
+ * A pattern is a shell wildcard pattern (see fnmatch(3)) matched against
+ * the function name, the source file name (with and without the directory)
+ * and the "file:line" string of the callsite. NULL or an empty pattern
+ * matches all the callsites.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fnmatch.h>
+
+#include "ddlog.h"
+#include "private/ddlog_callsite.h"
+
+static ddlog_callsite_section_t ddlog_callsite_sections[DDLOG_MAX_CALLSITE_SECTIONS];
+static unsigned int ddlog_callsite_section_num = 0;
+static pthread_mutex_t ddlog_callsite_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \brief Registers the callsite section of a module
+ *
+ * \param start The first callsite of the module
+ * \param stop Points after the last callsite of the module
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the section is empty
+ *         or there are too many modules
+ *
+ * Called from the constructor emitted by DDLOG_DEFINE_MODULE(),
+ * the same section is registered only once.
+ */
+int ddlog_register_callsites(ddlog_callsite_t* start, ddlog_callsite_t* stop){
+    unsigned int i = 0;
+    int res = DDLOG_RET_ERR;
+
+    if (start == NULL || stop == NULL || start >= stop){
+        return DDLOG_RET_ERR;
+    }
+
+    pthread_mutex_lock(&ddlog_callsite_lock);
+    for (i = 0; i < ddlog_callsite_section_num; i++){
+        if (ddlog_callsite_sections[i].start == start){
+            res = DDLOG_RET_OK;
+            break;
+        }
+    }
+    if (res != DDLOG_RET_OK && ddlog_callsite_section_num < DDLOG_MAX_CALLSITE_SECTIONS){
+        ddlog_callsite_sections[ddlog_callsite_section_num].start = start;
+        ddlog_callsite_sections[ddlog_callsite_section_num].stop = stop;
+        ddlog_callsite_section_num++;
+        res = DDLOG_RET_OK;
+    }
+    pthread_mutex_unlock(&ddlog_callsite_lock);
+    return res;
+}
+
+/**
+ * \brief Unregisters the callsite section of a module
+ *
+ * \param start The first callsite of the module
+ * \param stop Points after the last callsite of the module
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the section is not registered
+ *
+ * Called from the destructor emitted by DDLOG_DEFINE_MODULE() when the
+ * module is unloaded. The callsites are not listed any more. The events
+ * already logged by the module still refer to them, the buffers have to
+ * be reset before the module is unloaded (see DDLOG_DEFINE_MODULE()).
+ */
+int ddlog_unregister_callsites(ddlog_callsite_t* start, ddlog_callsite_t* stop){
+    unsigned int i = 0;
+    int res = DDLOG_RET_ERR;
+
+    if (start == NULL || stop == NULL || start >= stop){
+        return DDLOG_RET_ERR;
+    }
+
+    pthread_mutex_lock(&ddlog_callsite_lock);
+    for (i = 0; i < ddlog_callsite_section_num; i++){
+        if (ddlog_callsite_sections[i].start == start){
+            ddlog_callsite_section_num--;
+            ddlog_callsite_sections[i] = ddlog_callsite_sections[ddlog_callsite_section_num];
+            res = DDLOG_RET_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ddlog_callsite_lock);
+    return res;
+}
+
+/**
+ * \brief Sets the enable bit of a callsite, used with ddlog_callsite_foreach_internal()
+ */
+static void ddlog_callsite_set_enabled(ddlog_callsite_t* callsite, void* data){
+    callsite->enabled = *(int*) data;
+}
+
+/**
+ * \brief Enables the callsites matching a pattern
+ *
+ * \param pattern The callsite pattern, NULL matches all callsites
+ * \return The number of the enabled callsites
+ */
+int ddlog_callsite_enable(const char* pattern){
+    int enabled = 1;
+    return ddlog_callsite_foreach_internal(pattern, ddlog_callsite_set_enabled, &enabled);
+}
+
+/**
+ * \brief Disables the callsites matching a pattern
+ *
+ * \param pattern The callsite pattern, NULL matches all callsites
+ * \return The number of the disabled callsites
+ *
+ * The disabled callsites skip the logging before their arguments
+ * are evaluated.
+ */
+int ddlog_callsite_disable(const char* pattern){
+    int enabled = 0;
+    return ddlog_callsite_foreach_internal(pattern, ddlog_callsite_set_enabled, &enabled);
+}
+
+/**
+ * \brief Checks if a callsite matches a pattern
+ *
+ * \param callsite The callsite
+ * \param pattern The callsite pattern, NULL or empty matches all callsites
+ * \return 1 if the callsite matches, 0 otherwise
+ */
+int ddlog_callsite_match_internal(const ddlog_callsite_t* callsite, const char* pattern){
+    const char* base = NULL;
+    char file_line[512];
+
+    if (pattern == NULL || pattern[0] == '\0'){
+        return 1;
+    }
+    if (callsite->function && fnmatch(pattern, callsite->function, 0) == 0){
+        return 1;
+    }
+    if (callsite->file){
+        base = strrchr(callsite->file, '/');
+        base = base ? base + 1 : callsite->file;
+        if (fnmatch(pattern, callsite->file, 0) == 0 || fnmatch(pattern, base, 0) == 0){
+            return 1;
+        }
+        snprintf(file_line, sizeof(file_line), "%s:%u", base, callsite->line);
+        if (fnmatch(pattern, file_line, 0) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Calls a function for every callsite matching a pattern
+ *
+ * \param pattern The callsite pattern, NULL matches all callsites
+ * \param callback The function to be called
+ * \param data Passed to the callback
+ * \return The number of the matching callsites
+ */
+unsigned int ddlog_callsite_foreach_internal(const char* pattern, ddlog_callsite_cb_t callback, void* data){
+    ddlog_callsite_t* callsite = NULL;
+    unsigned int num = 0;
+    unsigned int i = 0;
+
+    pthread_mutex_lock(&ddlog_callsite_lock);
+    for (i = 0; i < ddlog_callsite_section_num; i++){
+        for (callsite = ddlog_callsite_sections[i].start; callsite < ddlog_callsite_sections[i].stop; callsite++){
+            if (ddlog_callsite_match_internal(callsite, pattern)){
+                if (callback){
+                    callback(callsite, data);
+                }
+                num++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ddlog_callsite_lock);
+    return num;
+}
+
+/**
+ * \brief Returns the printable name of a severity level
+ */
+const char* ddlog_callsite_level_name_internal(unsigned int level){
+    switch (level){
+        case DDLOG_LEVEL_ERROR:
+            return "ERROR";
+        case DDLOG_LEVEL_WARN:
+            return "WARN";
+        case DDLOG_LEVEL_INFO:
+            return "INFO";
+        case DDLOG_LEVEL_DEBUG:
+            return "DEBUG";
+        case DDLOG_LEVEL_TRACE:
+            return "TRACE";
+        default:
+            return "-";
+    }
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_clock.c
+ * \brief Event timestamp sources implementation
+ *
+ * This file contains the calibration of the clock sources and the
+ * conversion of the event timestamps to wall clock time.
+ */
+#include <stdint.h>
+#include <time.h>
+
+#include "ddlog.h"
+#include "private/ddlog_clock.h"
+#if DDLOG_CLOCK_HAVE_TSC
+#include <cpuid.h>
+#endif
+
+ddlog_clock_calibration_t ddlog_clock_calibration = {
+    DDLOG_CLOCK_MONOTONIC_RAW, 0, 0, 1.0
+};
+
+/**
+ * \brief Checks whether the CPU has an invariant TSC
+ *
+ * \return 1 if the TSC runs at a constant rate in all the power states
+ *         (CPUID 0x80000007 EDX bit 8), 0 otherwise
+ *
+ * Without it the tick length changes with the CPU frequency and the
+ * counter may stop in deep sleep states, the calibration is not valid.
+ */
+int ddlog_clock_tsc_invariant_internal(void){
+#if DDLOG_CLOCK_HAVE_TSC
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0){
+        return 0;
+    }
+    return (edx & DDLOG_CLOCK_CPUID_INVARIANT_TSC) != 0;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * \brief Selects the clock source of the event timestamps
+ *
+ * \param source The new clock source
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the source is not
+ *         available on this platform or the TSC is not invariant
+ */
+int ddlog_clock_set_source_internal(ddlog_clock_source_t source){
+    switch (source){
+        case DDLOG_CLOCK_TSC:
+            if (!ddlog_clock_tsc_invariant_internal()){
+                return DDLOG_RET_ERR;
+            }
+            break;
+        case DDLOG_CLOCK_MONOTONIC_RAW:
+        case DDLOG_CLOCK_MONOTONIC_COARSE:
+            break;
+        default:
+            return DDLOG_RET_ERR;
+    }
+    ddlog_clock_calibration.source = source;
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Takes the calibration record of the selected clock source
+ *
+ * Measures the tick length of the TSC against CLOCK_MONOTONIC_RAW (the
+ * posix clocks are already in nanoseconds) and pairs a clock reading
+ * with the wall clock time. The wall clock is read between two clock
+ * readings, the middle of them is used as the base.
+ */
+void ddlog_clock_calibrate_internal(void){
+    uint64_t ticks_start = 0, ticks_end = 0;
+    uint64_t ns_start = 0, ns_end = 0;
+    uint64_t before = 0, after = 0, wall_ns = 0;
+
+    ddlog_clock_calibration.ns_per_tick = 1.0;
+    if (ddlog_clock_calibration.source == DDLOG_CLOCK_TSC){
+        ns_start = ddlog_clock_read_ns_internal(CLOCK_MONOTONIC_RAW);
+        ticks_start = ddlog_clock_read_tsc_internal();
+        do {
+            ns_end = ddlog_clock_read_ns_internal(CLOCK_MONOTONIC_RAW);
+        } while (ns_end - ns_start < DDLOG_CLOCK_CALIBRATION_NS);
+        ticks_end = ddlog_clock_read_tsc_internal();
+        if (ticks_end > ticks_start){
+            ddlog_clock_calibration.ns_per_tick = (double) (ns_end - ns_start) / (double) (ticks_end - ticks_start);
+        }
+    }
+
+    before = ddlog_clock_now_internal();
+    wall_ns = ddlog_clock_read_ns_internal(CLOCK_REALTIME);
+    after = ddlog_clock_now_internal();
+
+    ddlog_clock_calibration.base_ticks = before + (after - before) / 2;
+    ddlog_clock_calibration.base_wall_ns = wall_ns;
+}
+
+/**
+ * \brief Converts an event timestamp to wall clock time
+ *
+ * \param ticks The event timestamp in clock ticks
+ * \param wall The wall clock time is returned here
+ */
+void ddlog_clock_to_wall_internal(uint64_t ticks, struct timespec* wall){
+    int64_t delta_ticks = (int64_t) (ticks - ddlog_clock_calibration.base_ticks);
+    uint64_t wall_ns = ddlog_clock_calibration.base_wall_ns +
+        (int64_t) ((double) delta_ticks * ddlog_clock_calibration.ns_per_tick);
+
+    wall->tv_sec = (time_t) (wall_ns / 1000000000ULL);
+    wall->tv_nsec = (long) (wall_ns % 1000000000ULL);
+}
+
+/**
+ * \brief Converts a wall clock time to clock ticks
+ *
+ * \param wall_ns The wall clock time in nanoseconds since the epoch
+ * \return The clock reading at that time, clamped to the range of the clock
+ */
+uint64_t ddlog_clock_from_wall_internal(uint64_t wall_ns){
+    double ticks = 0;
+
+    if (ddlog_clock_calibration.ns_per_tick <= 0){
+        return 0;
+    }
+    /* the difference is converted, the absolute times do not fit into a double exactly */
+    ticks = (double) ddlog_clock_calibration.base_ticks +
+        (double) (int64_t) (wall_ns - ddlog_clock_calibration.base_wall_ns) / ddlog_clock_calibration.ns_per_tick;
+    if (ticks <= 0){
+        return 0;
+    }
+    if (ticks >= 18446744073709551615.0){
+        return UINT64_MAX;
+    }
+    return (uint64_t) ticks;
+}
+
+/**
+ * \brief Returns the printable name of a clock source
+ */
+const char* ddlog_clock_source_name_internal(ddlog_clock_source_t source){
+    switch (source){
+        case DDLOG_CLOCK_TSC:
+            return "tsc";
+        case DDLOG_CLOCK_MONOTONIC_RAW:
+            return "monotonic_raw";
+        case DDLOG_CLOCK_MONOTONIC_COARSE:
+            return "monotonic_coarse";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_crash.c
+ * \brief Crash dump of the log buffers on fatal signals
+ *
+ * This file contains the optional SIGSEGV, SIGBUS, SIGABRT and SIGFPE
+ * handler writing the backtrace of the faulting thread and the events of
+ * all the buffers to a file descriptor opened in advance.
+ *
+ * Only async-signal-safe calls are made from the handler: the buffers
+ * are read with the lock-free reader (ddlog_iter_*_internal()), the text
+ * is formatted by the integer formatters of this file into static
+ * buffers and written with write(). The timestamps are printed in UTC,
+ * localtime_r() can not be used from a signal handler.
+ */
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_crash.h"
+#include "private/ddlog_fmt.h"
+#include "private/ddlog_clock.h"
+#include "private/ddlog_thread.h"
+
+#define DDLOG_CRASH_STACK_SIZE  (64 * 1024)
+#define DDLOG_CRASH_FRAME_NUM   64
+#define DDLOG_CRASH_SIGNAL_NUM  4
+
+/**
+ * \struct ddlog_crash_out_t
+ * \brief Output cursor of the signal safe formatters.
+ *
+ * The output is truncated at the end of the buffer and always kept
+ * zero terminated.
+ */
+typedef struct ddlog_crash_out_t {
+    char* buffer;               /*!< The output buffer */
+    size_t size;                /*!< The size of the output buffer */
+    size_t pos;                 /*!< The length of the output */
+} ddlog_crash_out_t;
+
+static const int ddlog_crash_signals[DDLOG_CRASH_SIGNAL_NUM] = { SIGSEGV, SIGBUS, SIGABRT, SIGFPE };
+static const char* ddlog_crash_signal_names[DDLOG_CRASH_SIGNAL_NUM] = { "SIGSEGV", "SIGBUS", "SIGABRT", "SIGFPE" };
+static struct sigaction ddlog_crash_old_actions[DDLOG_CRASH_SIGNAL_NUM];
+static int ddlog_crash_installed = 0;
+static volatile int ddlog_crash_fd = -1;
+static volatile int ddlog_crash_in_progress = 0;
+
+/* the handler state is preallocated, the handler runs only once */
+static char ddlog_crash_stack[DDLOG_CRASH_STACK_SIZE] __attribute__ ((aligned (16)));
+static ddlog_record_t ddlog_crash_record;
+static char ddlog_crash_line[DDLOG_MAX_RECORD_SIZE + 256];
+
+static void ddlog_crash_put_char(ddlog_crash_out_t* out, char c){
+    if (out->pos + 1 < out->size){
+        out->buffer[out->pos++] = c;
+        out->buffer[out->pos] = '\0';
+    }
+}
+
+static void ddlog_crash_put_str(ddlog_crash_out_t* out, const char* str){
+    while (*str){
+        ddlog_crash_put_char(out, *str++);
+    }
+}
+
+/**
+ * \brief Prints an unsigned integer
+ *
+ * \param out The output cursor
+ * \param value The value
+ * \param base The base (8, 10 or 16)
+ * \param upper (flag) if not 0 the hex digits are printed in upper case
+ * \param min_digits The value is zero padded to this number of digits
+ */
+static void ddlog_crash_put_uint(ddlog_crash_out_t* out, uint64_t value, unsigned int base, int upper, int min_digits){
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char temp[24];
+    int len = 0;
+
+    do {
+        temp[len++] = digits[value % base];
+        value /= base;
+    } while (value > 0 && len < (int) sizeof(temp));
+    while (len < min_digits && len < (int) sizeof(temp)){
+        temp[len++] = '0';
+    }
+    while (len > 0){
+        ddlog_crash_put_char(out, temp[--len]);
+    }
+}
+
+static void ddlog_crash_put_int(ddlog_crash_out_t* out, int64_t value){
+    if (value < 0){
+        ddlog_crash_put_char(out, '-');
+        ddlog_crash_put_uint(out, -(uint64_t) value, 10, 0, 1);
+    } else {
+        ddlog_crash_put_uint(out, (uint64_t) value, 10, 0, 1);
+    }
+}
+
+/**
+ * \brief Prints a floating point value with 6 decimals
+ *
+ * The large values are printed with an exponent. The
+ * result is not rounded as precisely as by printf.
+ */
+static void ddlog_crash_put_double(ddlog_crash_out_t* out, double value){
+    uint64_t int_part = 0, frac_part = 0;
+    int exponent = 0;
+
+    if (value != value){
+        ddlog_crash_put_str(out, "nan");
+        return;
+    }
+    if (value < 0){
+        ddlog_crash_put_char(out, '-');
+        value = -value;
+    }
+    if (value >= 1e18){
+        while (value >= 10 && exponent <= 310){
+            value /= 10;
+            exponent++;
+        }
+    }
+    if (exponent > 310){
+        ddlog_crash_put_str(out, "inf");
+        return;
+    }
+    int_part = (uint64_t) value;
+    frac_part = (uint64_t) ((value - (double) int_part) * 1e6 + 0.5);
+    if (frac_part >= 1000000){
+        int_part++;
+        frac_part -= 1000000;
+    }
+    ddlog_crash_put_uint(out, int_part, 10, 0, 1);
+    ddlog_crash_put_char(out, '.');
+    ddlog_crash_put_uint(out, frac_part, 10, 0, 6);
+    if (exponent > 0){
+        ddlog_crash_put_str(out, "e+");
+        ddlog_crash_put_uint(out, exponent, 10, 0, 2);
+    }
+}
+
+/**
+ * \brief Prints a timestamp as an UTC date and time
+ *
+ * The civil date is computed from the day number with integer arithmetic
+ * (days from 1970-01-01, proleptic Gregorian calendar).
+ */
+static void ddlog_crash_put_timestamp(ddlog_crash_out_t* out, uint64_t timestamp){
+    struct timespec t;
+    int64_t days = 0, era = 0, secs = 0;
+    unsigned int doe = 0, yoe = 0, doy = 0, mp = 0, day = 0, month = 0;
+    int64_t year = 0;
+
+    ddlog_clock_to_wall_internal(timestamp, &t);
+    days = t.tv_sec / 86400;
+    secs = t.tv_sec % 86400;
+    if (secs < 0){
+        secs += 86400;
+        days--;
+    }
+
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = (unsigned int) (days - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    day = doy - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = (int64_t) yoe + era * 400 + (month <= 2);
+
+    ddlog_crash_put_int(out, year);
+    ddlog_crash_put_char(out, '-');
+    ddlog_crash_put_uint(out, month, 10, 0, 2);
+    ddlog_crash_put_char(out, '-');
+    ddlog_crash_put_uint(out, day, 10, 0, 2);
+    ddlog_crash_put_char(out, ' ');
+    ddlog_crash_put_uint(out, secs / 3600, 10, 0, 2);
+    ddlog_crash_put_char(out, ':');
+    ddlog_crash_put_uint(out, (secs / 60) % 60, 10, 0, 2);
+    ddlog_crash_put_char(out, ':');
+    ddlog_crash_put_uint(out, secs % 60, 10, 0, 2);
+    ddlog_crash_put_char(out, '.');
+    ddlog_crash_put_uint(out, t.tv_nsec, 10, 0, 9);
+}
+
+#define DDLOG_CRASH_UNPACK(type, value)                                 \
+    do {                                                                \
+        if (used + sizeof(type) > args_size) {                          \
+            return out.pos;                                             \
+        }                                                               \
+        memcpy(&(value), args + used, sizeof(type));                    \
+        used += sizeof(type);                                           \
+    } while (0)
+
+#define DDLOG_CRASH_UNPACK_INT(type)                                    \
+    do {                                                                \
+        type temp_value;                                                \
+        DDLOG_CRASH_UNPACK(type, temp_value);                           \
+        int_value = (int64_t) temp_value;                               \
+    } while (0)
+
+#define DDLOG_CRASH_UNPACK_UINT(type)                                   \
+    do {                                                                \
+        type temp_value;                                                \
+        DDLOG_CRASH_UNPACK(type, temp_value);                           \
+        uint_value = (uint64_t) temp_value;                             \
+    } while (0)
+
+/**
+ * \brief Formats a deferred message in a signal handler
+ *
+ * \param buffer The output buffer
+ * \param size The size of the output buffer
+ * \param format The printf style format string
+ * \param args The argument values packed by ddlog_fmt_pack()
+ * \param args_size The size of the packed arguments
+ * \return The length of the formatted message
+ *
+ * The signal safe counterpart of ddlog_fmt_format(). The packed values
+ * are consumed the same way, but the flags, the width and the precision
+ * are ignored and the floating point values are always printed with 6
+ * decimals.
+ */
+size_t ddlog_crash_format_message_internal(char* buffer, size_t size, const char* format, const char* args, size_t args_size){
+    ddlog_crash_out_t out = { buffer, size, 0 };
+    ddlog_fmt_spec_t spec;
+    const char* p = format;
+    size_t used = 0, len = 0;
+    int64_t int_value = 0;
+    uint64_t uint_value = 0;
+    long double ld_value = 0;
+    double d_value = 0;
+    void* ptr_value = NULL;
+    int star_value = 0;
+
+    if (buffer == NULL || size == 0){
+        return 0;
+    }
+    buffer[0] = '\0';
+    if (format == NULL){
+        return 0;
+    }
+
+    while (*p && out.pos + 1 < out.size){
+        if (*p != '%'){
+            ddlog_crash_put_char(&out, *p++);
+            continue;
+        }
+        p = ddlog_fmt_parse_spec(p, &spec);
+        if (spec.conversion == 0){
+            return out.pos;
+        }
+        if (spec.conversion == '%'){
+            ddlog_crash_put_char(&out, '%');
+            continue;
+        }
+        if (spec.width_arg){
+            DDLOG_CRASH_UNPACK(int, star_value);
+        }
+        if (spec.precision_arg){
+            DDLOG_CRASH_UNPACK(int, star_value);
+        }
+
+        switch (spec.conversion){
+            case 'd':
+            case 'i':
+                switch (spec.length){
+                    case DDLOG_FMT_LEN_L:  DDLOG_CRASH_UNPACK_INT(long); break;
+                    case DDLOG_FMT_LEN_LL: DDLOG_CRASH_UNPACK_INT(long long); break;
+                    case DDLOG_FMT_LEN_J:  DDLOG_CRASH_UNPACK_INT(intmax_t); break;
+                    case DDLOG_FMT_LEN_Z:  DDLOG_CRASH_UNPACK_INT(ssize_t); break;
+                    case DDLOG_FMT_LEN_T:  DDLOG_CRASH_UNPACK_INT(ptrdiff_t); break;
+                    case DDLOG_FMT_LEN_HH: DDLOG_CRASH_UNPACK_INT(int); int_value = (signed char) int_value; break;
+                    case DDLOG_FMT_LEN_H:  DDLOG_CRASH_UNPACK_INT(int); int_value = (short) int_value; break;
+                    default:               DDLOG_CRASH_UNPACK_INT(int); break;
+                }
+                ddlog_crash_put_int(&out, int_value);
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                switch (spec.length){
+                    case DDLOG_FMT_LEN_L:  DDLOG_CRASH_UNPACK_UINT(unsigned long); break;
+                    case DDLOG_FMT_LEN_LL: DDLOG_CRASH_UNPACK_UINT(unsigned long long); break;
+                    case DDLOG_FMT_LEN_J:  DDLOG_CRASH_UNPACK_UINT(uintmax_t); break;
+                    case DDLOG_FMT_LEN_Z:  DDLOG_CRASH_UNPACK_UINT(size_t); break;
+                    case DDLOG_FMT_LEN_T:  DDLOG_CRASH_UNPACK_UINT(ptrdiff_t); break;
+                    case DDLOG_FMT_LEN_HH: DDLOG_CRASH_UNPACK_UINT(unsigned int); uint_value = (unsigned char) uint_value; break;
+                    case DDLOG_FMT_LEN_H:  DDLOG_CRASH_UNPACK_UINT(unsigned int); uint_value = (unsigned short) uint_value; break;
+                    default:               DDLOG_CRASH_UNPACK_UINT(unsigned int); break;
+                }
+                ddlog_crash_put_uint(&out, uint_value,
+                        spec.conversion == 'o' ? 8 : (spec.conversion == 'u' ? 10 : 16),
+                        spec.conversion == 'X', 1);
+                break;
+            case 'c':
+                DDLOG_CRASH_UNPACK_INT(int);
+                ddlog_crash_put_char(&out, (char) int_value);
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                if (spec.length == DDLOG_FMT_LEN_LD){
+                    DDLOG_CRASH_UNPACK(long double, ld_value);
+                    d_value = (double) ld_value;
+                } else {
+                    DDLOG_CRASH_UNPACK(double, d_value);
+                }
+                ddlog_crash_put_double(&out, d_value);
+                break;
+            case 'p':
+                DDLOG_CRASH_UNPACK(void*, ptr_value);
+                if (ptr_value == NULL){
+                    ddlog_crash_put_str(&out, "(nil)");
+                } else {
+                    ddlog_crash_put_str(&out, "0x");
+                    ddlog_crash_put_uint(&out, (uintptr_t) ptr_value, 16, 0, 1);
+                }
+                break;
+            case 's':
+                if (used >= args_size){
+                    return out.pos;
+                }
+                len = strnlen(args + used, args_size - used);
+                if (used + len >= args_size){
+                    return out.pos;
+                }
+                ddlog_crash_put_str(&out, args + used);
+                used += len + 1;
+                break;
+            default:
+                break;
+        }
+    }
+    return out.pos;
+}
+
+/**
+ * \brief Formats an event in a signal handler
+ *
+ * \param record The event
+ * \param buffer The output buffer
+ * \param size The size of the output buffer
+ * \return The length of the formatted line
+ *
+ * Same layout as ddlog_display_format_event_str(), with UTC timestamps
+ * and without the indention.
+ */
+size_t ddlog_crash_format_event_internal(const ddlog_record_t* record, char* buffer, size_t size){
+    ddlog_crash_out_t out = { buffer, size, 0 };
+    const ddlog_thread_info_t* info = NULL;
+
+    if (buffer == NULL || size == 0){
+        return 0;
+    }
+    buffer[0] = '\0';
+
+    ddlog_crash_put_timestamp(&out, record->event.timestamp);
+    ddlog_crash_put_str(&out, " [");
+    if (record->thread_name){
+        ddlog_crash_put_str(&out, record->thread_name);
+    } else if ((info = ddlog_thread_get_info_internal(record->event.thread_id)) != NULL){
+        ddlog_crash_put_str(&out, info->name);
+        ddlog_crash_put_char(&out, '/');
+        ddlog_crash_put_int(&out, info->tid);
+    } else {
+        ddlog_crash_put_char(&out, '-');
+    }
+    ddlog_crash_put_char(&out, ':');
+    ddlog_crash_put_str(&out, record->function_name ? record->function_name : "-");
+    ddlog_crash_put_char(&out, ':');
+    ddlog_crash_put_uint(&out, record->event.line_number, 10, 0, 1);
+    ddlog_crash_put_str(&out, "]: ");
+    if (record->event.flags & DDLOG_EVENT_FLAG_DEFERRED){
+        out.pos += ddlog_crash_format_message_internal(out.buffer + out.pos, out.size - out.pos,
+                record->format, record->args, record->args_size);
+    } else if (record->message){
+        ddlog_crash_put_str(&out, record->message);
+    }
+    return out.pos;
+}
+
+static void ddlog_crash_write_internal(int fd, const char* data, size_t size){
+    ssize_t res = 0;
+
+    while (size > 0){
+        res = write(fd, data, size);
+        if (res < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        data += res;
+        size -= res;
+    }
+}
+
+static void ddlog_crash_write_str_internal(int fd, const char* str){
+    ddlog_crash_write_internal(fd, str, strlen(str));
+}
+
+/**
+ * \brief Writes the crash dump
+ *
+ * \param fd The output file descriptor
+ * \param sig The signal number
+ * \param info The signal information
+ */
+static void ddlog_crash_dump_internal(int fd, int sig, const siginfo_t* info){
+    ddlog_crash_out_t out = { ddlog_crash_line, sizeof(ddlog_crash_line), 0 };
+    ddlog_buffer_iter_t iter;
+    ddlog_buffer_t* buffer = NULL;
+    void* frames[DDLOG_CRASH_FRAME_NUM];
+    ddlog_buffer_id_t id = 0;
+    int frame_num = 0, i = 0;
+
+    ddlog_crash_put_str(&out, "*** ddlog crash dump: signal ");
+    ddlog_crash_put_int(&out, sig);
+    for (i = 0; i < DDLOG_CRASH_SIGNAL_NUM; i++){
+        if (ddlog_crash_signals[i] == sig){
+            ddlog_crash_put_str(&out, " (");
+            ddlog_crash_put_str(&out, ddlog_crash_signal_names[i]);
+            ddlog_crash_put_char(&out, ')');
+        }
+    }
+    /* the fault address is set for the signals raised by the kernel only */
+    if (info && info->si_code > 0){
+        ddlog_crash_put_str(&out, ", address 0x");
+        ddlog_crash_put_uint(&out, (uintptr_t) info->si_addr, 16, 0, 1);
+    }
+    ddlog_crash_put_str(&out, ", pid ");
+    ddlog_crash_put_int(&out, getpid());
+    ddlog_crash_put_str(&out, ", tid ");
+    ddlog_crash_put_int(&out, syscall(SYS_gettid));
+    ddlog_crash_put_str(&out, " ***\nBacktrace:\n");
+    ddlog_crash_write_internal(fd, out.buffer, out.pos);
+
+    frame_num = backtrace(frames, DDLOG_CRASH_FRAME_NUM);
+    backtrace_symbols_fd(frames, frame_num, fd);
+
+    if (ddlog_internal_is_lib_inited()){
+        for (id = 0; id < DDLOG_MAX_BUF_NUM; id++){
+            buffer = ddlog_internal_get_buffer_by_id(id);
+            if (buffer == NULL){
+                continue;
+            }
+            out.pos = 0;
+            ddlog_crash_put_str(&out, "Buffer id: ");
+            ddlog_crash_put_uint(&out, id, 10, 0, 1);
+            ddlog_crash_put_str(&out, " (UTC timestamps):\n");
+            ddlog_crash_write_internal(fd, out.buffer, out.pos);
+
+            ddlog_iter_init_internal(&iter, buffer);
+            while (ddlog_iter_next_internal(&iter, &ddlog_crash_record) == DDLOG_RET_OK){
+                out.pos = ddlog_crash_format_event_internal(&ddlog_crash_record, out.buffer, out.size - 1);
+                out.buffer[out.pos++] = '\n';
+                ddlog_crash_write_internal(fd, out.buffer, out.pos);
+            }
+        }
+    }
+    ddlog_crash_write_str_internal(fd, "*** end of ddlog crash dump ***\n");
+}
+
+/**
+ * \brief The fatal signal handler
+ *
+ * The first crashing thread writes the dump, the others wait for it to
+ * terminate the process. The previous handler of the signal is restored
+ * and the signal is raised again, it is delivered when this handler returns.
+ */
+static void ddlog_crash_handler(int sig, siginfo_t* info, void* context){
+    int saved_errno = errno;
+    int i = 0;
+
+    (void) context;
+    if (__sync_lock_test_and_set(&ddlog_crash_in_progress, 1)){
+        while (1){
+            pause();
+        }
+    }
+
+    if (ddlog_crash_fd >= 0){
+        ddlog_crash_dump_internal(ddlog_crash_fd, sig, info);
+    }
+
+    for (i = 0; i < DDLOG_CRASH_SIGNAL_NUM; i++){
+        if (ddlog_crash_signals[i] == sig){
+            sigaction(sig, &ddlog_crash_old_actions[i], NULL);
+        }
+    }
+    raise(sig);
+    errno = saved_errno;
+}
+
+/**
+ * \brief Installs the crash dump handler
+ *
+ * \param fd The file descriptor the dump is written to, it has to be
+ *           kept open by the application
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
+ *
+ * On SIGSEGV, SIGBUS, SIGABRT and SIGFPE the backtrace of the faulting
+ * thread and the events of all the buffers are written to fd, then the
+ * signal is passed to the handler installed before. Calling it again
+ * only changes the file descriptor.
+ *
+ * The handler runs on an alternate signal stack in the calling thread,
+ * so a stack overflow of this thread is dumped as well. The other threads
+ * run it on their own stack.
+ */
+int ddlog_install_crash_handler(int fd){
+    struct sigaction action;
+    stack_t stack;
+    void* frame = NULL;
+    int i = 0;
+
+    if (fd < 0){
+        return DDLOG_RET_ERR;
+    }
+    ddlog_crash_fd = fd;
+    if (ddlog_crash_installed){
+        return DDLOG_RET_OK;
+    }
+
+    /* backtrace() loads libgcc on the first call, it must not happen in the handler */
+    backtrace(&frame, 1);
+
+    memset(&stack, 0, sizeof(stack));
+    stack.ss_sp = ddlog_crash_stack;
+    stack.ss_size = sizeof(ddlog_crash_stack);
+    if (sigaltstack(&stack, NULL) != 0){
+        return DDLOG_RET_ERR;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = ddlog_crash_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (i = 0; i < DDLOG_CRASH_SIGNAL_NUM; i++){
+        if (sigaction(ddlog_crash_signals[i], &action, &ddlog_crash_old_actions[i]) != 0){
+            while (--i >= 0){
+                sigaction(ddlog_crash_signals[i], &ddlog_crash_old_actions[i], NULL);
+            }
+            return DDLOG_RET_ERR;
+        }
+    }
+    ddlog_crash_installed = 1;
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Removes the crash dump handler
+ *
+ * The signal handlers installed before ddlog_install_crash_handler()
+ * are restored.
+ */
+void ddlog_uninstall_crash_handler(void){
+    int i = 0;
+
+    if (!ddlog_crash_installed){
+        return;
+    }
+    for (i = 0; i < DDLOG_CRASH_SIGNAL_NUM; i++){
+        sigaction(ddlog_crash_signals[i], &ddlog_crash_old_actions[i], NULL);
+    }
+    ddlog_crash_installed = 0;
+    ddlog_crash_fd = -1;
+}
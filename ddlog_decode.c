@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_decode.c
+ * \brief Prints binary log files
+ *
+ * Decodes the binary log files of the background writer (see
+ * ddlog_start_writer() and ddlog_logfile.h) and prints the events in the
+ * format of the ddlog console or as JSON lines. The file is mapped, the
+ * blocks are decoded and formatted in parallel by worker threads and
+ * printed in file order. The time range filter selects the blocks from
+ * the block index, the blocks outside of the range are not decoded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_display.h"
+#include "private/ddlog_logfile.h"
+#include "private/ddlog_clock.h"
+
+#define DDLOG_DECODE_WINDOW     64      /* blocks decoded ahead of the output */
+#define DDLOG_DECODE_MAX_JOBS   64
+
+/**
+ * \struct ddlog_decode_out_t
+ * \brief The formatted text of a block.
+ */
+typedef struct ddlog_decode_out_t {
+    char* data;
+    size_t len;
+    size_t capacity;
+    int done;                       /*!< (flag) the block has been formatted */
+} ddlog_decode_out_t;
+
+/**
+ * \struct ddlog_decode_t
+ * \brief The state shared by the decoder threads.
+ */
+typedef struct ddlog_decode_t {
+    const ddlog_logfile_t* file;    /*!< The file being decoded */
+    int json;                       /*!< (flag) print JSON lines */
+    uint64_t from;                  /*!< The oldest timestamp printed (clock ticks) */
+    uint64_t to;                    /*!< The newest timestamp printed (clock ticks) */
+    const char* thread;             /*!< Print the events of this thread only or NULL */
+    size_t next_block;              /*!< The next block to be decoded */
+    size_t written_block;           /*!< The next block to be printed */
+    size_t end_block;               /*!< The end of the blocks to be decoded */
+    int error;                      /*!< (flag) a block could not be decoded */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    ddlog_decode_out_t out[DDLOG_DECODE_WINDOW];
+} ddlog_decode_t;
+
+static void usage(const char* name){
+    fprintf(stderr,
+            "Usage: %s [-j jobs] [-J] [-s start] [-e end] [-t thread] <log file>...\n"
+            "  -j jobs    number of decoder threads (default: number of CPUs)\n"
+            "  -J         print JSON lines\n"
+            "  -s start   print the events logged at or after start (seconds since the epoch)\n"
+            "  -e end     print the events logged at or before end (seconds since the epoch)\n"
+            "  -t thread  print the events of this thread (name or name/tid)\n"
+            "The rotated files are printed in the order given.\n", name);
+}
+
+static int ddlog_decode_reserve(ddlog_decode_out_t* out, size_t len){
+    char* data = NULL;
+    size_t capacity = out->capacity ? out->capacity : 65536;
+
+    if (out->len + len <= out->capacity){
+        return 0;
+    }
+    while (capacity < out->len + len){
+        capacity *= 2;
+    }
+    data = realloc(out->data, capacity);
+    if (data == NULL){
+        return -1;
+    }
+    out->data = data;
+    out->capacity = capacity;
+    return 0;
+}
+
+static void ddlog_decode_append(ddlog_decode_out_t* out, const char* str, size_t len){
+    if (ddlog_decode_reserve(out, len) == 0){
+        memcpy(out->data + out->len, str, len);
+        out->len += len;
+    }
+}
+
+static void ddlog_decode_append_str(ddlog_decode_out_t* out, const char* str){
+    ddlog_decode_append(out, str, strlen(str));
+}
+
+/**
+ * \brief Appends a JSON string value (with the quotes)
+ */
+static void ddlog_decode_append_json_str(ddlog_decode_out_t* out, const char* str){
+    char escape[8];
+    const char* p = NULL;
+
+    if (str == NULL){
+        ddlog_decode_append_str(out, "null");
+        return;
+    }
+    ddlog_decode_append(out, "\"", 1);
+    for (p = str; *p; p++){
+        switch (*p){
+            case '"':  ddlog_decode_append(out, "\\\"", 2); break;
+            case '\\': ddlog_decode_append(out, "\\\\", 2); break;
+            case '\n': ddlog_decode_append(out, "\\n", 2); break;
+            case '\r': ddlog_decode_append(out, "\\r", 2); break;
+            case '\t': ddlog_decode_append(out, "\\t", 2); break;
+            default:
+                if ((unsigned char) *p < 0x20){
+                    snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char) *p);
+                    ddlog_decode_append_str(out, escape);
+                } else {
+                    ddlog_decode_append(out, p, 1);
+                }
+                break;
+        }
+    }
+    ddlog_decode_append(out, "\"", 1);
+}
+
+/**
+ * \brief Checks the thread filter
+ *
+ * The thread names are stored as "name" or "name/tid", the filter
+ * matches the full name or the name part.
+ */
+static int ddlog_decode_thread_match(const char* filter, const char* thread_name){
+    size_t len = 0;
+
+    if (filter == NULL){
+        return 1;
+    }
+    if (thread_name == NULL){
+        return 0;
+    }
+    len = strlen(filter);
+    return strncmp(thread_name, filter, len) == 0 && (thread_name[len] == '\0' || thread_name[len] == '/');
+}
+
+/**
+ * \brief Formats an event in the ddlog console format
+ */
+static void ddlog_decode_format_text(ddlog_decode_out_t* out, const ddlog_logfile_event_t* event,
+        ddlog_record_t* record, char* line, size_t line_size){
+    memset(&record->event, 0, sizeof(record->event));
+    record->event.timestamp = event->timestamp;
+    record->event.line_number = event->line_number;
+    record->event.indent_level = event->indent_level;
+    record->event.flags = event->flags;
+    record->event.thread_id = event->thread_id;
+    record->thread_name = event->thread_name;
+    record->function_name = event->function_name;
+    record->file_name = event->file_name;
+    record->message = event->message;
+    record->format = NULL;
+    record->args = NULL;
+    record->args_size = 0;
+    record->ext_data = NULL;
+
+    ddlog_display_format_event_str(record, line, line_size);
+    ddlog_decode_append_str(out, line);
+    ddlog_decode_append(out, "\n", 1);
+}
+
+/**
+ * \brief Formats an event as a JSON line
+ */
+static void ddlog_decode_format_json(ddlog_decode_out_t* out, const ddlog_logfile_event_t* event, char* line, size_t line_size){
+    struct timespec wall;
+
+    ddlog_clock_to_wall_internal(event->timestamp, &wall);
+    snprintf(line, line_size, "{\"seq\":%llu,\"time\":%lld.%09ld,\"buffer\":%u,\"thread_id\":%u,\"thread\":",
+            (unsigned long long) event->seq, (long long) wall.tv_sec, wall.tv_nsec, event->buffer_id, event->thread_id);
+    ddlog_decode_append_str(out, line);
+    ddlog_decode_append_json_str(out, event->thread_name);
+    ddlog_decode_append_str(out, ",\"function\":");
+    ddlog_decode_append_json_str(out, event->function_name);
+    ddlog_decode_append_str(out, ",\"file\":");
+    ddlog_decode_append_json_str(out, event->file_name);
+    snprintf(line, line_size, ",\"line\":%u,\"indent\":%u,\"message\":", event->line_number, event->indent_level);
+    ddlog_decode_append_str(out, line);
+    ddlog_decode_append_json_str(out, event->message);
+    snprintf(line, line_size, ",\"ext_type\":%u,\"ext_size\":%u}\n", event->ext_event_type, event->ext_data_size);
+    ddlog_decode_append_str(out, line);
+}
+
+/**
+ * \brief Decodes and formats a block
+ *
+ * \return 0 on success, -1 if the block is corrupt
+ */
+static int ddlog_decode_block(ddlog_decode_t* decode, ddlog_logfile_cursor_t* cursor, size_t block,
+        ddlog_decode_out_t* out, ddlog_record_t* record, char* line, size_t line_size){
+    ddlog_logfile_event_t event;
+
+    if (ddlog_logfile_cursor_seek_internal(cursor, block) != DDLOG_RET_OK){
+        return -1;
+    }
+    while (cursor->event_idx < cursor->hdr.event_num){
+        if (ddlog_logfile_cursor_next_internal(cursor, &event) != DDLOG_RET_OK){
+            return -1;
+        }
+        if (event.timestamp < decode->from || event.timestamp > decode->to ||
+                !ddlog_decode_thread_match(decode->thread, event.thread_name)){
+            continue;
+        }
+        if (decode->json){
+            ddlog_decode_format_json(out, &event, line, line_size);
+        } else {
+            ddlog_decode_format_text(out, &event, record, line, line_size);
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief The decoder thread
+ *
+ * Takes the next block not further than DDLOG_DECODE_WINDOW blocks ahead
+ * of the output, so the memory use does not depend on the file size.
+ */
+static void* ddlog_decode_worker(void* arg){
+    ddlog_decode_t* decode = (ddlog_decode_t*) arg;
+    ddlog_logfile_cursor_t cursor;
+    ddlog_record_t* record = NULL;
+    ddlog_decode_out_t* out = NULL;
+    char* line = NULL;
+    size_t line_size = DDLOG_MAX_RECORD_SIZE + 4 * DDLOG_MAX_NAME_LEN;
+    size_t block = 0;
+    int res = 0;
+
+    record = malloc(sizeof(ddlog_record_t));
+    line = malloc(line_size);
+    if (record == NULL || line == NULL || ddlog_logfile_cursor_init_internal(&cursor, decode->file) != DDLOG_RET_OK){
+        free(record);
+        free(line);
+        pthread_mutex_lock(&decode->mutex);
+        decode->error = 1;
+        pthread_cond_broadcast(&decode->cond);
+        pthread_mutex_unlock(&decode->mutex);
+        return NULL;
+    }
+
+    while (1){
+        pthread_mutex_lock(&decode->mutex);
+        while (decode->next_block < decode->end_block &&
+                decode->next_block >= decode->written_block + DDLOG_DECODE_WINDOW){
+            pthread_cond_wait(&decode->cond, &decode->mutex);
+        }
+        if (decode->next_block >= decode->end_block){
+            pthread_mutex_unlock(&decode->mutex);
+            break;
+        }
+        block = decode->next_block++;
+        out = &decode->out[block % DDLOG_DECODE_WINDOW];
+        pthread_mutex_unlock(&decode->mutex);
+
+        res = ddlog_decode_block(decode, &cursor, block, out, record, line, line_size);
+
+        pthread_mutex_lock(&decode->mutex);
+        if (res != 0){
+            decode->error = 1;
+        }
+        out->done = 1;
+        pthread_cond_broadcast(&decode->cond);
+        pthread_mutex_unlock(&decode->mutex);
+    }
+
+    ddlog_logfile_cursor_free_internal(&cursor);
+    free(record);
+    free(line);
+    return NULL;
+}
+
+/**
+ * \brief Parses a "seconds[.fraction]" time to nanoseconds since the epoch
+ */
+static uint64_t ddlog_decode_parse_time(const char* str){
+    char* end = NULL;
+    uint64_t ns = strtoull(str, &end, 10) * 1000000000ULL;
+    uint64_t unit = 100000000ULL;
+
+    if (*end == '.'){
+        for (end++; *end >= '0' && *end <= '9' && unit > 0; end++, unit /= 10){
+            ns += (uint64_t) (*end - '0') * unit;
+        }
+    }
+    return ns;
+}
+
+/**
+ * \brief Prints a binary log file
+ *
+ * \return 0 on success, -1 in case of error
+ */
+static int ddlog_decode_file(const char* name, const char* path, int jobs, int json,
+        uint64_t start, uint64_t end, const char* thread){
+    ddlog_logfile_t file;
+    ddlog_decode_t* decode = NULL;
+    pthread_t threads[DDLOG_DECODE_MAX_JOBS];
+    ddlog_decode_out_t* out = NULL;
+    size_t block = 0;
+    int i = 0, started = 0, error = 0;
+
+    if (ddlog_logfile_open_internal(path, &file) != DDLOG_RET_OK){
+        fprintf(stderr, "%s: %s is not a valid ddlog binary log file\n", name, path);
+        return -1;
+    }
+    decode = calloc(1, sizeof(ddlog_decode_t));
+    if (decode == NULL){
+        ddlog_logfile_close_internal(&file);
+        return -1;
+    }
+
+    /* the timestamps are converted with the calibration of the writer */
+    ddlog_clock_calibration = file.hdr->clock;
+
+    decode->file = &file;
+    decode->json = json;
+    decode->thread = thread;
+    decode->from = start > 0 ? ddlog_clock_from_wall_internal(start) : 0;
+    decode->to = end > 0 ? ddlog_clock_from_wall_internal(end) : UINT64_MAX;
+    decode->next_block = ddlog_logfile_find_time_internal(&file, decode->from);
+    decode->written_block = decode->next_block;
+    decode->end_block = file.index_num;
+    while (decode->end_block > decode->next_block && file.index[decode->end_block - 1].min_timestamp > decode->to){
+        decode->end_block--;
+    }
+    pthread_mutex_init(&decode->mutex, NULL);
+    pthread_cond_init(&decode->cond, NULL);
+
+    for (i = 0; i < jobs; i++){
+        if (pthread_create(&threads[i], NULL, ddlog_decode_worker, decode) != 0){
+            break;
+        }
+        started++;
+    }
+    if (started == 0){
+        error = 1;
+    }
+
+    /* print the blocks in file order */
+    for (block = decode->written_block; started > 0 && block < decode->end_block; block++){
+        out = &decode->out[block % DDLOG_DECODE_WINDOW];
+        pthread_mutex_lock(&decode->mutex);
+        while (!out->done){
+            pthread_cond_wait(&decode->cond, &decode->mutex);
+        }
+        pthread_mutex_unlock(&decode->mutex);
+
+        if (out->len){
+            fwrite(out->data, 1, out->len, stdout);
+        }
+
+        pthread_mutex_lock(&decode->mutex);
+        out->len = 0;
+        out->done = 0;
+        decode->written_block++;
+        pthread_cond_broadcast(&decode->cond);
+        pthread_mutex_unlock(&decode->mutex);
+    }
+
+    for (i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+    if (decode->error){
+        fprintf(stderr, "%s: %s: corrupt block skipped\n", name, path);
+        error = 1;
+    }
+    if (!file.complete){
+        fprintf(stderr, "%s: %s: no block index, the file was not closed by the writer\n", name, path);
+    }
+
+    for (i = 0; i < DDLOG_DECODE_WINDOW; i++){
+        free(decode->out[i].data);
+    }
+    pthread_cond_destroy(&decode->cond);
+    pthread_mutex_destroy(&decode->mutex);
+    free(decode);
+    ddlog_logfile_close_internal(&file);
+    return error ? -1 : 0;
+}
+
+int main(int argc, char** argv){
+    static char out_buffer[1 << 20];
+    const char* thread = NULL;
+    uint64_t start = 0, end = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int jobs = cpus > 0 ? (int) cpus : 1;
+    int json = 0, res = 0, opt = 0;
+
+    while ((opt = getopt(argc, argv, "j:Js:e:t:h")) != -1){
+        switch (opt){
+            case 'j': jobs = atoi(optarg); break;
+            case 'J': json = 1; break;
+            case 's': start = ddlog_decode_parse_time(optarg); break;
+            case 'e': end = ddlog_decode_parse_time(optarg); break;
+            case 't': thread = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || jobs < 1){
+        usage(argv[0]);
+        return 1;
+    }
+    if (jobs > DDLOG_DECODE_MAX_JOBS){
+        jobs = DDLOG_DECODE_MAX_JOBS;
+    }
+
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    for (; optind < argc; optind++){
+        if (ddlog_decode_file(argv[0], argv[optind], jobs, json, start, end, thread) != 0){
+            res = 1;
+        }
+    }
+    fflush(stdout);
+    return res;
+}
@@ -11,6 +11,7 @@
  * event formatting and printout.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
@@ -19,6 +20,13 @@
 #include "ddlog.h"
 #include "private/ddlog_internal.h"
 #include "private/ddlog_display.h"
+#include "private/ddlog_fmt.h"
+#include "private/ddlog_clock.h"
+#include "private/ddlog_thread.h"
+#include "private/ddlog_callsite.h"
+#include "private/ddlog_snapshot.h"
+#include "private/ddlog_stats.h"
+#include "private/ddlog_query.h"
 
 int ddlog_display_indention_enabled = 0;
 
@@ -26,21 +34,24 @@ int ddlog_display_indention_enabled = 0;
  * \brief Format a timestamp string
  * \param buffer The timestamp string is printed into this buffer
  * \param size The buffer size
- * \param t The timeval structure containing the time information
+ * \param timestamp The event timestamp in clock ticks
  *
- * Generates a timestamp string from a timeval structure.
+ * Generates a wall clock timestamp string with nanosecond resolution
+ * from an event timestamp.
  */
-void ddlog_display_format_timestamp(char* buffer, size_t size, const struct timeval* t){
+void ddlog_display_format_timestamp(char* buffer, size_t size, uint64_t timestamp){
     struct tm bdt;
+    struct timespec t;
     size_t len = 0;
 
     memset(&bdt, 0, sizeof(bdt));
     memset(buffer, 0, size);
 
-    localtime_r(&t->tv_sec, &bdt);
+    ddlog_clock_to_wall_internal(timestamp, &t);
+    localtime_r(&t.tv_sec, &bdt);
     strftime(buffer, size - 1, "%m/%d/%y %H:%M:%S", &bdt);
     len = strlen(buffer);
-    snprintf(buffer + len, size - len - 1, ".%-6ld", t->tv_usec);
+    snprintf(buffer + len, size - len - 1, ".%09ld", t.tv_nsec);
 }
 /**
  * \brief Formats an indent string
@@ -58,56 +69,90 @@ void ddlog_display_format_indent(char* buffer, size_t size, uint8_t indent_level
     }
 }
 
+/**
+ * \brief Formats the thread name of an event
+ * \param buffer The buffer into which the thread name is printed
+ * \param size The size of the buffer
+ * \param record The event
+ *
+ * The thread name provided at the log call is printed as is. Otherwise
+ * the thread id of the event is resolved from the thread registry and
+ * the name is printed together with the kernel thread id, so the
+ * threads sharing a name can be told apart.
+ */
+void ddlog_display_format_thread(char* buffer, size_t size, const ddlog_record_t* record){
+    const ddlog_thread_info_t* info = NULL;
+
+    if (record->thread_name && record->thread_name[0] != '\0'){
+        snprintf(buffer, size, "%s", record->thread_name);
+        return;
+    }
+    info = ddlog_thread_get_info_internal(record->event.thread_id);
+    if (info){
+        snprintf(buffer, size, "%s/%d", info->name[0] != '\0' ? info->name : "-", (int) info->tid);
+    } else {
+        snprintf(buffer, size, "-");
+    }
+}
+
 /**
  * \brief Generates the event string for a specific event.
- * \param event The event to be printed
+ * \param record The event to be printed
  * \param buffer The output buffer
  * \param buffer_size The size of the output buffer
  *
  * Formats the event string and print it into the provided buffer.
  */
-void ddlog_display_format_event_str(const ddlog_event_t* event, char* buffer, size_t buffer_size){
+void ddlog_display_format_event_str(const ddlog_record_t* record, char* buffer, size_t buffer_size){
     char timestamp_str[30];
     char indent_str[30];
+    char thread_str[DDLOG_MAX_NAME_LEN];
+    char message_str[DDLOG_MAX_RECORD_SIZE];
+    const char* message = NULL;
 
-    if (event == NULL || buffer == NULL || buffer_size == 0){
+    if (record == NULL || buffer == NULL || buffer_size == 0){
         return;
     }
 
-    memset(buffer, 0, buffer_size);
-    ddlog_display_format_timestamp(timestamp_str, sizeof(timestamp_str), &event->timestamp);
-    ddlog_display_format_indent(indent_str, sizeof(indent_str), event->indent_level);
+    buffer[0] = '\0';
+    ddlog_display_format_timestamp(timestamp_str, sizeof(timestamp_str), record->event.timestamp);
+    ddlog_display_format_indent(indent_str, sizeof(indent_str), record->event.indent_level);
+    ddlog_display_format_thread(thread_str, sizeof(thread_str), record);
+    message = ddlog_fmt_record_message(record, message_str, sizeof(message_str));
 
     snprintf(buffer, buffer_size - 1,
             "%s%s[%s:%s:%u]: %s",
             timestamp_str,
             indent_str,
-            event->thread_name[0] != '\0' ? event->thread_name : "-",
-            event->function_name[0] != '\0' ? event->function_name : "-",
-            event->line_number,
-            event->message[0] != '\0' ? event->message : "-");
+            thread_str,
+            record->function_name && record->function_name[0] != '\0' ? record->function_name : "-",
+            record->event.line_number,
+            message && message[0] != '\0' ? message : "-");
 }
 
 /**
  * \brief Prints out a specific event into a stream.
  * \param stream The stream into which the event is printed
- * \param event The event to be printed
+ * \param record The event to be printed
  *
  * Prints out the event into a specified stream. If the event is
  * an extended one, the print callback is also called to generate the
  * event body from the event data.
  */
-void ddlog_display_event(FILE* stream, const ddlog_event_t* event){
-    char buffer[256];
+void ddlog_display_event(FILE* stream, const ddlog_record_t* record){
+    char buffer[DDLOG_MAX_RECORD_SIZE + 128];
+    ddlog_ext_print_cb_t print_cb = NULL;
 
-    memset(buffer, 0, sizeof(buffer));
-    ddlog_display_format_event_str(event, buffer, sizeof(buffer));
+    ddlog_display_format_event_str(record, buffer, sizeof(buffer));
     fprintf(stream, "%s\n", buffer);
-    if (event->ext_event_type != DDLOG_EXT_EVENT_TYPE_NONE && event->ext_data &&
-            event->ext_data_size > 0 && event->ext_print_cb){
-        fprintf(stream, "\n");
-        event->ext_print_cb(stream, event->ext_data, event->ext_data_size);
-        fprintf(stream, "\n");
+    if (record->event.ext_event_type != DDLOG_EXT_EVENT_TYPE_NONE && record->ext_data &&
+            record->event.ext_data_size > 0){
+        print_cb = ddlog_ext_get_print_cb(record->event.ext_event_type);
+        if (print_cb){
+            fprintf(stream, "\n");
+            print_cb(stream, (void*) record->ext_data, record->event.ext_data_size);
+            fprintf(stream, "\n");
+        }
     }
 }
 
@@ -123,18 +168,19 @@ void ddlog_display_print_buffer(FILE* stream){
  * \brief Prints the content of all the buffers into the stream
  * \param stream The output stream
  *
- * Prints all the log buffers into the stream.
+ * Prints all the log buffers into the stream. The buffers are copied
+ * together into one snapshot before printing.
  */
 void ddlog_display_print_all_buffers(FILE* stream){
-    int max_buf_num = ddlog_internal_get_max_buf_num();
-    ddlog_buffer_id_t buffer_id = 0;
-    for (buffer_id = 0; buffer_id < max_buf_num; buffer_id++){
-        if (ddlog_internal_get_buffer_by_id(buffer_id)){
-            fprintf(stream, "Buffer id: %d:\n", buffer_id);
-            ddlog_display_print_buffer_id(stream, buffer_id);
-        } else {
-            fprintf(stream, "Buffer id: %d is not in use.\n", buffer_id);
-        }
+    ddlog_snapshot_t* snapshot = NULL;
+
+    if (stream == NULL){
+        return;
+    }
+    snapshot = ddlog_snapshot_all();
+    if (snapshot){
+        ddlog_display_print_snapshot(stream, snapshot);
+        ddlog_snapshot_free(snapshot);
     }
 }
 
@@ -142,49 +188,63 @@ void ddlog_display_print_all_buffers(FILE* stream){
  * \brief Prints a buffer specified by the buffer id into a stream.
  * \param stream The stream into which the log buffer is printed
  * \param buffer_id The id of the buffer to be printed.
+ *
+ * A snapshot of the buffer is taken first and the events are formatted
+ * from the snapshot. The producers are never blocked by a slow stream
+ * and the printed events do not change while being printed.
  */
 void ddlog_display_print_buffer_id(FILE* stream, ddlog_buffer_id_t buffer_id){
-    ddlog_event_t* event = NULL, *start = NULL;
-    int res = 0;
-    int first = 1;
-
-    ddlog_buffer_t* buffer = ddlog_internal_get_buffer_by_id(buffer_id);
-    if (stream && buffer){
-        res = ddlog_lock_buffer_internal(buffer);
-        if (res){
-            return;
-        }
+    ddlog_snapshot_t* snapshot = NULL;
 
-        if (buffer->wrapped != 0){
-            event = start = buffer->next_write;
-        } else {
-            event = start = buffer->head;
+    if (stream == NULL){
+        return;
+    }
+    snapshot = ddlog_snapshot_buffer(buffer_id);
+    if (snapshot){
+        ddlog_display_print_snapshot_buffer(stream, snapshot, buffer_id);
+        ddlog_snapshot_free(snapshot);
+    }
+}
+
+/**
+ * \brief Prints one buffer of a snapshot into a stream.
+ * \param stream The output stream
+ * \param snapshot The snapshot
+ * \param buffer_id The id of the buffer to be printed
+ *
+ * The shared ring and the private thread rings are merged in timestamp order.
+ */
+void ddlog_display_print_snapshot_buffer(FILE* stream, const ddlog_snapshot_t* snapshot, ddlog_buffer_id_t buffer_id){
+    ddlog_record_t record;
+    ddlog_buffer_iter_t iter;
+
+    if (stream && snapshot && buffer_id < DDLOG_MAX_BUF_NUM && snapshot->buffers[buffer_id]){
+        ddlog_iter_init_internal(&iter, snapshot->buffers[buffer_id]);
+        while (ddlog_iter_next_internal(&iter, &record) == DDLOG_RET_OK){
+            ddlog_display_event(stream, &record);
         }
+    }
+}
 
-        while (event){
-            if (event == start){
-                if (first == 1){
-                    first = 0;
-                    if (event->used == 1){
-                        ddlog_display_event(stream, event);
-                        event = event->next;
-                    } else {
-                        event = NULL;
-                    }
-                } else {
-                    event = NULL;
-                }
-            } else {
-                if (event->used){
-
-                    ddlog_display_event(stream, event);
-                    event=event->next;
-                } else {
-                    event = NULL;
-                }
-            }
+/**
+ * \brief Prints all the buffers of a snapshot into a stream.
+ * \param stream The output stream
+ * \param snapshot The snapshot
+ */
+void ddlog_display_print_snapshot(FILE* stream, const ddlog_snapshot_t* snapshot){
+    int max_buf_num = ddlog_internal_get_max_buf_num();
+    ddlog_buffer_id_t buffer_id = 0;
+
+    if (stream == NULL || snapshot == NULL){
+        return;
+    }
+    for (buffer_id = 0; buffer_id < max_buf_num; buffer_id++){
+        if (snapshot->buffers[buffer_id]){
+            fprintf(stream, "Buffer id: %d:\n", buffer_id);
+            ddlog_display_print_snapshot_buffer(stream, snapshot, buffer_id);
+        } else {
+            fprintf(stream, "Buffer id: %d is not in use.\n", buffer_id);
         }
-        res = ddlog_unlock_buffer_internal(buffer);
     }
 }
 
@@ -204,6 +264,155 @@ void ddlog_display_print_buffer_list(FILE* stream){
     }
 }
 
+/**
+ * \brief Print the registered threads
+ * \param stream The stream to print the thread list into
+ *
+ * Prints the id, the kernel thread id, the start time and the name
+ * of every registered thread.
+ */
+void ddlog_display_print_thread_list(FILE* stream){
+    const ddlog_thread_info_t* info = NULL;
+    char timestamp_str[30];
+    unsigned int i = 0;
+    if (stream){
+        for (i = 0; i < ddlog_thread_get_num_internal(); i++){
+            info = ddlog_thread_get_info_internal(i);
+            if (info){
+                ddlog_display_format_timestamp(timestamp_str, sizeof(timestamp_str), info->start_time);
+                fprintf(stream, "Thread #%u: tid %d, started %s, name: %s\n",
+                        i, (int) info->tid, timestamp_str, info->name[0] != '\0' ? info->name : "-");
+            }
+        }
+    }
+}
+
+/**
+ * \brief Print the performance counters of the buffers
+ * \param stream The stream to print the counters into
+ */
+void ddlog_display_print_stats(FILE* stream){
+    ddlog_buffer_t* buffer = NULL;
+    ddlog_stats_t stats;
+    int i = 0;
+    if (ddlog_internal_is_lib_inited() && stream){
+        for (i = 0; i < ddlog_internal_get_max_buf_num(); i++){
+            buffer = ddlog_internal_get_buffer_by_id(i);
+            if (buffer == NULL){
+                continue;
+            }
+            ddlog_stats_collect_internal(buffer, &stats);
+            fprintf(stream, "Buffer #%d (%u slots, %u thread rings):\n",
+                    i, (unsigned int) buffer->buffer_size, buffer->thread_buffer_num);
+            fprintf(stream, "  Events written : %llu\n", stats.events_written);
+            fprintf(stream, "  Bytes written  : %llu\n", stats.bytes_written);
+            fprintf(stream, "  Wraps          : %llu\n", stats.wraps);
+            fprintf(stream, "  Events dropped : %llu\n", stats.events_dropped);
+            fprintf(stream, "  Lock contended : %llu (%llu ns spinning)\n\n",
+                    stats.lock_contended, stats.lock_spin_ns);
+        }
+    }
+}
+
+/**
+ * \struct ddlog_display_callsite_list_t
+ * \brief Collects the callsites to be listed.
+ */
+typedef struct ddlog_display_callsite_list_t {
+    ddlog_callsite_t** callsites;
+    unsigned int num;
+    unsigned int size;
+} ddlog_display_callsite_list_t;
+
+static void ddlog_display_collect_callsite(ddlog_callsite_t* callsite, void* data){
+    ddlog_display_callsite_list_t* list = (ddlog_display_callsite_list_t*) data;
+    if (list->num < list->size){
+        list->callsites[list->num++] = callsite;
+    }
+}
+
+static int ddlog_display_compare_callsite_hits(const void* a, const void* b){
+    const ddlog_callsite_t* ca = *(const ddlog_callsite_t* const*) a;
+    const ddlog_callsite_t* cb = *(const ddlog_callsite_t* const*) b;
+    if (ca->hits == cb->hits){
+        return 0;
+    }
+    return ca->hits < cb->hits ? 1 : -1;
+}
+
+/**
+ * \brief Prints the events of a buffer matching a query
+ * \param stream The output stream
+ * \param buffer_id The id of the buffer to be queried
+ * \param query The query
+ * \return The number of matching events
+ *
+ * The live buffer is walked, only the matching events are formatted.
+ */
+unsigned int ddlog_display_print_query(FILE* stream, ddlog_buffer_id_t buffer_id, const ddlog_query_t* query){
+    ddlog_record_t record;
+    ddlog_buffer_iter_t iter;
+    unsigned int matches = 0;
+
+    if (stream == NULL || query == NULL){
+        return 0;
+    }
+    ddlog_query_iter_init_internal(query, &iter, ddlog_internal_get_buffer_by_id(buffer_id));
+    while ((query->limit == 0 || matches < query->limit) && ddlog_iter_next_internal(&iter, &record) == DDLOG_RET_OK){
+        if (ddlog_query_match_internal(query, &record)){
+            ddlog_display_event(stream, &record);
+            matches++;
+        }
+    }
+    return matches;
+}
+
+/**
+ * \brief Print the callsites matching a pattern
+ * \param stream The stream to print the callsite list into
+ * \param pattern The callsite pattern, NULL matches all callsites
+ *
+ * The callsites are listed in decreasing hit count order, the noisiest
+ * callsite is the first one.
+ */
+void ddlog_display_print_callsites(FILE* stream, const char* pattern){
+    ddlog_display_callsite_list_t list;
+    const ddlog_callsite_t* callsite = NULL;
+    unsigned int i = 0;
+
+    if (stream == NULL){
+        return;
+    }
+    memset(&list, 0, sizeof(list));
+    list.size = ddlog_callsite_foreach_internal(pattern, NULL, NULL);
+    if (list.size == 0){
+        fprintf(stream, "No callsite found\n");
+        return;
+    }
+    list.callsites = (ddlog_callsite_t**) malloc(list.size * sizeof(ddlog_callsite_t*));
+    if (list.callsites == NULL){
+        return;
+    }
+    ddlog_callsite_foreach_internal(pattern, ddlog_display_collect_callsite, &list);
+    qsort(list.callsites, list.num, sizeof(ddlog_callsite_t*), ddlog_display_compare_callsite_hits);
+
+    fprintf(stream, "%12s %-3s %-5s %s\n", "hits", "on", "level", "callsite");
+    for (i = 0; i < list.num; i++){
+        callsite = list.callsites[i];
+        fprintf(stream, "%12llu %-3s %-5s %s:%u %s()%s%s%s\n",
+                callsite->hits,
+                callsite->enabled ? "on" : "off",
+                ddlog_callsite_level_name_internal(callsite->level),
+                callsite->file ? callsite->file : "-",
+                callsite->line,
+                callsite->function ? callsite->function : "-",
+                callsite->format ? " \"" : "",
+                callsite->format ? callsite->format : "",
+                callsite->format ? "\"" : "");
+    }
+    free(list.callsites);
+}
+
 /**
  * \brief Enables the usage of the event indention during printout.
  */
@@ -18,8 +18,34 @@
 #include "private/ddlog_internal.h"
 #include "private/ddlog_display.h"
 #include "private/ddlog_display_debug.h"
+#include "private/ddlog_clock.h"
+#include "private/ddlog_stats.h"
 
 
+/**
+ * \brief Print all the event slots of a ring to a stream
+ *
+ * \param stream The stream into which the slots are printed
+ * \param buffer The ring to be printed
+ *
+ * Prints the slots in slot index order, the empty slots are also printed.
+ */
+void ddlog_display_debug_print_slots(FILE* stream, ddlog_buffer_t* buffer){
+    ddlog_record_t record;
+    uint64_t stamp = 0;
+    size_t i = 0;
+    for (i = 0; i < buffer->buffer_size; i++){
+        /* the stamp is read once, a producer may clear it meanwhile */
+        stamp = __atomic_load_n(&buffer->events[i].seq, __ATOMIC_ACQUIRE);
+        if (stamp != 0 &&
+                ddlog_read_event_internal(buffer, stamp - 1, &record) == DDLOG_RET_OK){
+            ddlog_display_event(stream, &record);
+        } else {
+            fprintf(stream, "[slot %u]: -\n", (unsigned int) i);
+        }
+    }
+}
+
 /**
  * \brief Print the content of a buffer to a stream
  *
@@ -27,37 +53,15 @@
  * \param buffer_id The id of the buffer to be printed
  *
  * Prints the log buffer contents (the log messages) into the stream.
- * The empty slots are also printed.
+ * The empty slots are also printed. The buffer is not locked, see
+ * ddlog_display_print_buffer_id().
  */
 void ddlog_display_debug_print_buffer_id(FILE* stream, ddlog_buffer_id_t buffer_id){
-    int res = 0;
-    int start = 1;
-    ddlog_event_t* event = NULL;
     ddlog_buffer_t* buffer = NULL;
 
     buffer = ddlog_internal_get_buffer_by_id(buffer_id);
     if (buffer){
-        res = ddlog_lock_buffer_internal(buffer);
-        if (res){
-            return;
-        }
-        event = buffer->head;
-        while(event){
-            if (event == buffer->head){
-                if (start == 1){
-                    start = 0;
-                    ddlog_display_event(stream, event);
-                    event = event->next;
-                } else {
-                    event = NULL;
-                }
-            } else {
-                ddlog_display_event(stream, event);
-                event = event->next;
-            }
-        }
-
-        res = ddlog_unlock_buffer_internal(buffer);
+        ddlog_display_debug_print_slots(stream, buffer);
     } else {
         fprintf(stream, "The buffer is not initialized\n");
     }
@@ -78,45 +82,36 @@ void ddlog_display_debug_print_buffer_id(FILE* stream, ddlog_buffer_id_t buffer_
  */
 void ddlog_display_debug_print_all_buffers(FILE* stream, int print_status, int print_events){
     int i = 0;
-    int start = 1;
-    ddlog_event_t* event = NULL;
     ddlog_buffer_t* buffer = NULL;
+    ddlog_stats_t stats;
     if (ddlog_internal_is_lib_inited()){
+        if (print_status) {
+            fprintf(stream, "Clock source: %s (%.4f ns/tick)\n\n",
+                    ddlog_clock_source_name_internal(ddlog_clock_calibration.source),
+                    ddlog_clock_calibration.ns_per_tick);
+        }
         for (i = 0; i < ddlog_internal_get_max_buf_num(); i++){
             fprintf(stream, "Buffer index: %d\n", i);
             buffer = ddlog_internal_get_buffer_by_id(i);
             if (buffer == NULL){
                 fprintf(stream, "This buffer is not initialized.\n");
             } else {
-                ddlog_lock_buffer_internal(buffer);
                 if (print_status) {
+                    ddlog_stats_collect_internal(buffer, &stats);
                     fprintf(stream, "Buffer status:\n");
-                    fprintf(stream, "  Buffer head         : %p\n", (void*) buffer->head);
-                    fprintf(stream, "  Buffer next         : %p\n", (void*) buffer->next_write);
+                    fprintf(stream, "  Buffer events       : %p\n", (void*) buffer->events);
+                    fprintf(stream, "  Buffer write seq    : %llu\n", (unsigned long long) buffer->write_seq);
                     fprintf(stream, "  Buffer size         : %u\n", (unsigned int) buffer->buffer_size);
-                    fprintf(stream, "  Buffer wrapped      : %d\n", buffer->wrapped);
-                    fprintf(stream, "  Buffer event locked : %d\n\n", buffer->event_locked);
+                    fprintf(stream, "  Buffer wrapped      : %llu\n", stats.wraps);
+                    fprintf(stream, "  Buffer thread rings : %u\n", buffer->thread_buffer_num);
+                    fprintf(stream, "  Buffer data ring    : %u bytes\n", (unsigned int) buffer->data_size);
+                    fprintf(stream, "  Buffer data head    : %llu\n", (unsigned long long) buffer->data_head);
+                    fprintf(stream, "  Buffer event locked : %llu\n\n", stats.events_dropped);
                 }
                 if (print_events) {
                     fprintf(stream, "Log messages:\n");
-                    event = buffer->head;
-                    start = 1;
-                    while(event){
-                        if (event == buffer->head){
-                            if (start == 1){
-                                start = 0;
-                                ddlog_display_event(stream, event);
-                                event = event->next;
-                            } else {
-                                event = NULL;
-                            }
-                        } else {
-                            ddlog_display_event(stream, event);
-                            event = event->next;
-                        }
-                    }
+                    ddlog_display_debug_print_slots(stream, buffer);
                 }
-                ddlog_unlock_buffer_internal(buffer);
             }
         }
     } else {
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_dump.c
+ * \brief Prints a flight recorder file
+ *
+ * Opens the file of a file backed log buffer (see ddlog_create_buffer_opt())
+ * post mortem and prints the recorded events in timestamp order, in the
+ * same format as the ddlog console.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_display.h"
+#include "private/ddlog_recorder.h"
+#include "private/ddlog_clock.h"
+
+static void usage(const char* name){
+    fprintf(stderr, "Usage: %s <recorder file>\n", name);
+}
+
+int main(int argc, char** argv){
+    static ddlog_record_t record;
+    char line[DDLOG_MAX_RECORD_SIZE + 128];
+    ddlog_buffer_iter_t iter;
+    ddlog_recorder_hdr_t* hdr = NULL;
+    ddlog_buffer_t* buffer = NULL;
+    unsigned long long num = 0;
+
+    if (argc != 2 || strcmp(argv[1], "-h") == 0){
+        usage(argv[0]);
+        return 1;
+    }
+
+    buffer = ddlog_recorder_open_internal(argv[1]);
+    if (buffer == NULL){
+        fprintf(stderr, "%s: %s is not a valid ddlog recorder file\n", argv[0], argv[1]);
+        return 1;
+    }
+    hdr = (ddlog_recorder_hdr_t*) buffer->mapping;
+
+    /* the timestamps are converted with the calibration of the writer */
+    ddlog_clock_calibration = hdr->clock;
+
+    printf("# pid %d, buffer %u, %u ring(s) of %llu slots, clock %s\n",
+            (int) hdr->pid, hdr->buffer_id, hdr->ring_num,
+            (unsigned long long) hdr->buffer_size,
+            ddlog_clock_source_name_internal(hdr->clock.source));
+
+    ddlog_iter_init_internal(&iter, buffer);
+    while (ddlog_iter_next_internal(&iter, &record) == DDLOG_RET_OK){
+        ddlog_display_format_event_str(&record, line, sizeof(line));
+        printf("%s\n", line);
+        num++;
+    }
+    printf("# %llu event(s)\n", num);
+
+    ddlog_recorder_close_internal(buffer);
+    return 0;
+}
@@ -178,7 +178,6 @@ int ddlog_ext_log_long_id(ddlog_buffer_id_t buffer_id,
         int line_number,
         const char* message)
 {
-    const char *thread_name_p = NULL;
     int res = DDLOG_RET_ERR;
     ddlog_buffer_t* buffer = ddlog_internal_get_buffer_by_id(buffer_id);
 
@@ -188,15 +187,46 @@ int ddlog_ext_log_long_id(ddlog_buffer_id_t buffer_id,
             && ddlog_ext_event_type_is_valid(event_type)
             && buffer != NULL)
     {
-        if (thread_name == NULL) {
-            if (ddlog_internal_get_thread_name()[0] != '0'){
-                thread_name_p = ddlog_internal_get_thread_name();
-            }
-        } else {
-            thread_name_p = thread_name;
-        }
+        res = ddlog_log_internal(buffer, thread_name, function_name, line_number, message, ext_data, data_size, event_type);
+    }
+    return res;
+}
+
+/**
+ * \brief Logs an extended event of a logging macro to the default log buffer
+ *
+ * \param callsite The static callsite descriptor of the macro expansion
+ * \param event_type The type of the extended event
+ * \param ext_data The extended payload
+ * \param data_size The size of the extended payload
+ * \param message The log message string
+ * \return DDLOG_RET_OK if success, DDLOG_RET_ERR in case of any error
+ *
+ * Same as ddlog_log_cs(), the event refers to the callsite descriptor
+ * instead of storing the function name. The hit counter of the callsite
+ * is incremented if the event has been stored.
+ */
+int ddlog_ext_log_cs(ddlog_callsite_t* callsite,
+        ddlog_ext_event_type_t event_type,
+        void* ext_data,
+        size_t data_size,
+        const char* message)
+{
+    int res = DDLOG_RET_ERR;
+    ddlog_buffer_t* buffer = ddlog_internal_get_default_buf();
 
-        res = ddlog_log_internal(buffer, thread_name_p, function_name, line_number, message, ext_data, data_size, event_type);
+    if (ddlog_internal_is_lib_inited()
+            && ddlog_internal_is_logging_enabled()
+            && ddlog_ext_events.initialized == 1
+            && ddlog_ext_event_type_is_valid(event_type)
+            && buffer != NULL
+            && callsite != NULL)
+    {
+        res = ddlog_log_raw_internal(buffer, callsite, NULL, NULL, 0,
+                message, message ? strlen(message) : 0, 0, ext_data, data_size, event_type);
+        if (res == DDLOG_RET_OK){
+            __atomic_fetch_add(&callsite->hits, 1, __ATOMIC_RELAXED);
+        }
     }
     return res;
 }
@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_fmt.c
+ * \brief ddlog library deferred message formatting
+ *
+ * This file contains the implementation of the binary logging support.
+ * Instead of formatting the message on the logging path, only the format
+ * string pointer and the raw argument values are stored in the event.
+ * The format string has to be a string literal (static storage), the
+ * string arguments are copied since they may not outlive the log call.
+ * The message is formatted only when the event is printed.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_fmt.h"
+
+#define DDLOG_FMT_PACK(type, value)                                     \
+    do {                                                                \
+        type temp_value = (value);                                      \
+        if (used + sizeof(type) > size) {                               \
+            return used;                                                \
+        }                                                               \
+        memcpy(buffer + used, &temp_value, sizeof(type));               \
+        used += sizeof(type);                                           \
+    } while (0)
+
+#define DDLOG_FMT_UNPACK(type, value)                                   \
+    do {                                                                \
+        if (used + sizeof(type) > args_size) {                          \
+            return;                                                     \
+        }                                                               \
+        memcpy(&(value), args + used, sizeof(type));                    \
+        used += sizeof(type);                                           \
+    } while (0)
+
+#define DDLOG_FMT_PRINT(type)                                           \
+    do {                                                                \
+        type temp_value;                                                \
+        DDLOG_FMT_UNPACK(type, temp_value);                             \
+        res = snprintf(buffer + pos, size - pos, spec_str, temp_value); \
+    } while (0)
+
+/**
+ * \brief Parses a printf conversion specification
+ *
+ * \param format Points to the '%' character starting the specification
+ * \param spec The parsed specification
+ * \return Pointer to the character after the specification
+ *
+ * The flags and the width are skipped, the precision, the length modifier
+ * and the conversion character are interpreted. The conversion is set to
+ * 0 if the specification is not valid. The wide character and wide string
+ * conversions (%lc, %ls) are not supported, they are invalid.
+ */
+const char* ddlog_fmt_parse_spec(const char* format, ddlog_fmt_spec_t* spec){
+    const char* p = format + 1;
+
+    memset(spec, 0, sizeof(ddlog_fmt_spec_t));
+    spec->start = format;
+    spec->precision = -1;
+
+    /* flags */
+    while (*p && strchr("-+ #0'", *p)){
+        p++;
+    }
+    /* width */
+    if (*p == '*'){
+        spec->width_arg = 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9'){
+            p++;
+        }
+    }
+    /* precision */
+    if (*p == '.'){
+        p++;
+        if (*p == '*'){
+            spec->precision_arg = 1;
+            p++;
+        } else {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9'){
+                if (spec->precision < DDLOG_MAX_RECORD_SIZE){
+                    spec->precision = spec->precision * 10 + (*p - '0');
+                }
+                p++;
+            }
+        }
+    }
+    /* length modifier */
+    switch (*p){
+        case 'h':
+            p++;
+            spec->length = DDLOG_FMT_LEN_H;
+            if (*p == 'h'){
+                p++;
+                spec->length = DDLOG_FMT_LEN_HH;
+            }
+            break;
+        case 'l':
+            p++;
+            spec->length = DDLOG_FMT_LEN_L;
+            if (*p == 'l'){
+                p++;
+                spec->length = DDLOG_FMT_LEN_LL;
+            }
+            break;
+        case 'q':
+            p++;
+            spec->length = DDLOG_FMT_LEN_LL;
+            break;
+        case 'j':
+            p++;
+            spec->length = DDLOG_FMT_LEN_J;
+            break;
+        case 'z':
+            p++;
+            spec->length = DDLOG_FMT_LEN_Z;
+            break;
+        case 't':
+            p++;
+            spec->length = DDLOG_FMT_LEN_T;
+            break;
+        case 'L':
+            p++;
+            spec->length = DDLOG_FMT_LEN_LD;
+            break;
+        default:
+            break;
+    }
+
+    if (*p && strchr("diouxXcsfFeEgGaApn%", *p)){
+        if ((*p == 'c' || *p == 's') && spec->length == DDLOG_FMT_LEN_L){
+            spec->end = p;
+            return p;
+        }
+        spec->conversion = *p;
+        p++;
+    }
+    spec->end = p;
+    return p;
+}
+
+/**
+ * \brief Stores the raw values of the arguments of a format string
+ *
+ * \param buffer The argument values are packed into this buffer
+ * \param size The size of the buffer
+ * \param format The printf style format string
+ * \param args The arguments of the format string
+ * \return The number of bytes used in the buffer
+ *
+ * The values are packed without alignment, in the order of the conversions.
+ * The strings are copied with the terminating zero (truncated if needed),
+ * at most precision characters are read if the conversion has one: the
+ * argument does not have to be zero terminated then.
+ * Packing stops at the first invalid conversion or if the buffer is full.
+ */
+size_t ddlog_fmt_pack(char* buffer, size_t size, const char* format, va_list args){
+    ddlog_fmt_spec_t spec;
+    const char* p = format;
+    const char* str = NULL;
+    size_t used = 0, len = 0, max_len = 0;
+    int precision = 0;
+
+    while (*p){
+        if (*p != '%'){
+            p++;
+            continue;
+        }
+        p = ddlog_fmt_parse_spec(p, &spec);
+        if (spec.conversion == 0){
+            break;
+        }
+        if (spec.conversion == '%'){
+            continue;
+        }
+        if (spec.width_arg){
+            DDLOG_FMT_PACK(int, va_arg(args, int));
+        }
+        precision = spec.precision;
+        if (spec.precision_arg){
+            /* a negative precision argument is taken as if it was omitted */
+            precision = va_arg(args, int);
+            DDLOG_FMT_PACK(int, precision);
+        }
+
+        switch (spec.conversion){
+            case 'd':
+            case 'i':
+                switch (spec.length){
+                    case DDLOG_FMT_LEN_L:  DDLOG_FMT_PACK(long, va_arg(args, long)); break;
+                    case DDLOG_FMT_LEN_LL: DDLOG_FMT_PACK(long long, va_arg(args, long long)); break;
+                    case DDLOG_FMT_LEN_J:  DDLOG_FMT_PACK(intmax_t, va_arg(args, intmax_t)); break;
+                    case DDLOG_FMT_LEN_Z:  DDLOG_FMT_PACK(ssize_t, va_arg(args, ssize_t)); break;
+                    case DDLOG_FMT_LEN_T:  DDLOG_FMT_PACK(ptrdiff_t, va_arg(args, ptrdiff_t)); break;
+                    default:               DDLOG_FMT_PACK(int, va_arg(args, int)); break;
+                }
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                switch (spec.length){
+                    case DDLOG_FMT_LEN_L:  DDLOG_FMT_PACK(unsigned long, va_arg(args, unsigned long)); break;
+                    case DDLOG_FMT_LEN_LL: DDLOG_FMT_PACK(unsigned long long, va_arg(args, unsigned long long)); break;
+                    case DDLOG_FMT_LEN_J:  DDLOG_FMT_PACK(uintmax_t, va_arg(args, uintmax_t)); break;
+                    case DDLOG_FMT_LEN_Z:  DDLOG_FMT_PACK(size_t, va_arg(args, size_t)); break;
+                    case DDLOG_FMT_LEN_T:  DDLOG_FMT_PACK(ptrdiff_t, va_arg(args, ptrdiff_t)); break;
+                    default:               DDLOG_FMT_PACK(unsigned int, va_arg(args, unsigned int)); break;
+                }
+                break;
+            case 'c':
+                DDLOG_FMT_PACK(int, va_arg(args, int));
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                if (spec.length == DDLOG_FMT_LEN_LD){
+                    DDLOG_FMT_PACK(long double, va_arg(args, long double));
+                } else {
+                    DDLOG_FMT_PACK(double, va_arg(args, double));
+                }
+                break;
+            case 'p':
+                DDLOG_FMT_PACK(void*, va_arg(args, void*));
+                break;
+            case 'n':
+                /* never written back, the pointer is dropped */
+                (void) va_arg(args, void*);
+                break;
+            case 's':
+                str = va_arg(args, const char*);
+                if (str == NULL){
+                    str = "(null)";
+                }
+                if (used >= size){
+                    return used;
+                }
+                max_len = size - used - 1;
+                if (precision >= 0 && (size_t) precision < max_len){
+                    max_len = precision;
+                }
+                len = strnlen(str, max_len);
+                memcpy(buffer + used, str, len);
+                buffer[used + len] = '\0';
+                used += len + 1;
+                break;
+            default:
+                break;
+        }
+    }
+    return used;
+}
+
+/**
+ * \brief Formats a message from a format string and the packed arguments
+ *
+ * \param buffer The output buffer
+ * \param size The size of the output buffer
+ * \param format The printf style format string
+ * \param args The argument values packed by ddlog_fmt_pack()
+ * \param args_size The size of the packed arguments
+ *
+ * Every conversion is printed with snprintf() using the stored value.
+ * The '*' width and precision values are substituted into the conversion
+ * specification. Formatting stops if the packed arguments run out.
+ */
+void ddlog_fmt_format(char* buffer, size_t size, const char* format, const char* args, size_t args_size){
+    ddlog_fmt_spec_t spec;
+    char spec_str[64];
+    const char* p = format;
+    const char* q = NULL;
+    size_t pos = 0, spec_len = 0, used = 0, len = 0;
+    int star_value = 0;
+    int res = 0;
+
+    if (buffer == NULL || size == 0){
+        return;
+    }
+    buffer[0] = '\0';
+    if (format == NULL){
+        return;
+    }
+
+    while (*p && pos < size - 1){
+        if (*p != '%'){
+            buffer[pos++] = *p++;
+            buffer[pos] = '\0';
+            continue;
+        }
+        p = ddlog_fmt_parse_spec(p, &spec);
+        if (spec.conversion == 0){
+            return;
+        }
+        if (spec.conversion == '%'){
+            buffer[pos++] = '%';
+            buffer[pos] = '\0';
+            continue;
+        }
+
+        /* rebuild the specification with the '*' values substituted */
+        spec_len = 0;
+        for (q = spec.start; q < spec.end && spec_len < sizeof(spec_str) - 16; q++){
+            if (*q == '*'){
+                DDLOG_FMT_UNPACK(int, star_value);
+                if (star_value < 0 && spec_str[spec_len - 1] == '.'){
+                    /* a negative precision is taken as if it was omitted */
+                    spec_len--;
+                    continue;
+                }
+                spec_len += snprintf(spec_str + spec_len, sizeof(spec_str) - spec_len, "%d", star_value);
+            } else {
+                spec_str[spec_len++] = *q;
+            }
+        }
+        spec_str[spec_len] = '\0';
+
+        res = 0;
+        switch (spec.conversion){
+            case 'd':
+            case 'i':
+                switch (spec.length){
+                    case DDLOG_FMT_LEN_L:  DDLOG_FMT_PRINT(long); break;
+                    case DDLOG_FMT_LEN_LL: DDLOG_FMT_PRINT(long long); break;
+                    case DDLOG_FMT_LEN_J:  DDLOG_FMT_PRINT(intmax_t); break;
+                    case DDLOG_FMT_LEN_Z:  DDLOG_FMT_PRINT(ssize_t); break;
+                    case DDLOG_FMT_LEN_T:  DDLOG_FMT_PRINT(ptrdiff_t); break;
+                    default:               DDLOG_FMT_PRINT(int); break;
+                }
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                switch (spec.length){
+                    case DDLOG_FMT_LEN_L:  DDLOG_FMT_PRINT(unsigned long); break;
+                    case DDLOG_FMT_LEN_LL: DDLOG_FMT_PRINT(unsigned long long); break;
+                    case DDLOG_FMT_LEN_J:  DDLOG_FMT_PRINT(uintmax_t); break;
+                    case DDLOG_FMT_LEN_Z:  DDLOG_FMT_PRINT(size_t); break;
+                    case DDLOG_FMT_LEN_T:  DDLOG_FMT_PRINT(ptrdiff_t); break;
+                    default:               DDLOG_FMT_PRINT(unsigned int); break;
+                }
+                break;
+            case 'c':
+                DDLOG_FMT_PRINT(int);
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                if (spec.length == DDLOG_FMT_LEN_LD){
+                    DDLOG_FMT_PRINT(long double);
+                } else {
+                    DDLOG_FMT_PRINT(double);
+                }
+                break;
+            case 'p':
+                DDLOG_FMT_PRINT(void*);
+                break;
+            case 's':
+                if (used >= args_size){
+                    return;
+                }
+                len = strnlen(args + used, args_size - used);
+                if (used + len >= args_size){
+                    return;
+                }
+                res = snprintf(buffer + pos, size - pos, spec_str, args + used);
+                used += len + 1;
+                break;
+            default:
+                break;
+        }
+
+        if (res > 0){
+            pos += res;
+            if (pos > size - 1){
+                pos = size - 1;
+            }
+        }
+    }
+}
+
+/**
+ * \brief Returns with the message text of a record
+ *
+ * \param record The event record
+ * \param buffer Buffer used to format a deferred message
+ * \param size The size of the buffer
+ * \return The message text or NULL if the event has no message.
+ *
+ * The plain messages are returned as stored, the deferred messages
+ * are formatted into the buffer provided.
+ */
+const char* ddlog_fmt_record_message(const ddlog_record_t* record, char* buffer, size_t size){
+    if (record->event.flags & DDLOG_EVENT_FLAG_DEFERRED){
+        ddlog_fmt_format(buffer, size, record->format, record->args, record->args_size);
+        return buffer;
+    }
+    return record->message;
+}
@@ -0,0 +1,745 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_logfile.c
+ * \brief Binary log file format implementation
+ *
+ * This file contains the block encoder used by the background writer,
+ * the block compressor and the reader of the binary log files (see
+ * ddlog_logfile.h for the format).
+ *
+ * The compressor is a byte oriented LZ77 coder (LZ4 style sequences:
+ * a token with the literal and match lengths, the literals, a 16 bit
+ * match offset). It is fast enough to run on every block and needs no
+ * external library.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_logfile.h"
+
+#define DDLOG_LZ_MIN_MATCH      4
+#define DDLOG_LZ_HASH_BITS      12
+#define DDLOG_LZ_MAX_OFFSET     65535
+#define DDLOG_LZ_LAST_LITERALS  5       /* the end of the input is always stored as literals */
+
+#define DDLOG_LOGFILE_STRINGS_CAPACITY (DDLOG_LOGFILE_MAX_STRINGS * (DDLOG_MAX_NAME_LEN + 4))
+#define DDLOG_LOGFILE_EVENTS_CAPACITY  (DDLOG_LOGFILE_BLOCK_SIZE + DDLOG_LOGFILE_MAX_EVENT_SIZE)
+
+/******************************************************************************
+ * Block compression
+ ******************************************************************************/
+
+static uint32_t ddlog_lz_read32(const char* p){
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static size_t ddlog_lz_put_length(char* dst, size_t length){
+    size_t len = 0;
+    while (length >= 255){
+        dst[len++] = (char) 255;
+        length -= 255;
+    }
+    dst[len++] = (char) length;
+    return len;
+}
+
+/**
+ * \brief Writes a sequence: the literals and a match (if match_len is not 0)
+ *
+ * \return The number of bytes written or 0 if the output is full
+ */
+static size_t ddlog_lz_put_sequence(char* dst, size_t capacity, const char* literals, size_t literal_len,
+        size_t offset, size_t match_len){
+    size_t pos = 1;
+    unsigned char token = 0;
+
+    /* token, length bytes, literals, offset, length bytes */
+    if (1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1 > capacity){
+        return 0;
+    }
+    token = (literal_len >= 15 ? 15 : literal_len) << 4;
+    if (literal_len >= 15){
+        pos += ddlog_lz_put_length(dst + pos, literal_len - 15);
+    }
+    memcpy(dst + pos, literals, literal_len);
+    pos += literal_len;
+    if (match_len){
+        match_len -= DDLOG_LZ_MIN_MATCH;
+        token |= match_len >= 15 ? 15 : match_len;
+        dst[pos++] = (char) (offset & 0xff);
+        dst[pos++] = (char) (offset >> 8);
+        if (match_len >= 15){
+            pos += ddlog_lz_put_length(dst + pos, match_len - 15);
+        }
+    }
+    dst[0] = (char) token;
+    return pos;
+}
+
+/**
+ * \brief Compresses a block
+ *
+ * \param src The data to be compressed
+ * \param size The size of the data
+ * \param dst The output buffer
+ * \param capacity The size of the output buffer
+ * \return The compressed size or 0 if the data could not be compressed
+ *         into the output buffer
+ */
+size_t ddlog_lz_compress(const char* src, size_t size, char* dst, size_t capacity){
+    uint32_t table[1 << DDLOG_LZ_HASH_BITS];
+    size_t ip = 0, anchor = 0, op = 0, res = 0;
+    size_t match = 0, match_len = 0, limit = 0;
+    uint32_t seq = 0, hash = 0;
+
+    memset(table, 0, sizeof(table));
+    limit = size > DDLOG_LZ_LAST_LITERALS + DDLOG_LZ_MIN_MATCH ? size - DDLOG_LZ_LAST_LITERALS : 0;
+    while (ip + DDLOG_LZ_MIN_MATCH <= limit){
+        seq = ddlog_lz_read32(src + ip);
+        hash = (seq * 2654435761U) >> (32 - DDLOG_LZ_HASH_BITS);
+        match = table[hash];
+        table[hash] = (uint32_t) ip + 1;
+        if (match == 0 || ip - (match - 1) > DDLOG_LZ_MAX_OFFSET || ddlog_lz_read32(src + match - 1) != seq){
+            ip++;
+            continue;
+        }
+        match--;
+        match_len = DDLOG_LZ_MIN_MATCH;
+        while (ip + match_len < limit && src[match + match_len] == src[ip + match_len]){
+            match_len++;
+        }
+        res = ddlog_lz_put_sequence(dst + op, capacity - op, src + anchor, ip - anchor, ip - match, match_len);
+        if (res == 0){
+            return 0;
+        }
+        op += res;
+        ip += match_len;
+        anchor = ip;
+    }
+    res = ddlog_lz_put_sequence(dst + op, capacity - op, src + anchor, size - anchor, 0, 0);
+    if (res == 0){
+        return 0;
+    }
+    return op + res;
+}
+
+/**
+ * \brief Decompresses a block
+ *
+ * \param src The compressed data
+ * \param size The size of the compressed data
+ * \param dst The output buffer
+ * \param capacity The size of the output buffer
+ * \return The decompressed size or 0 if the data is corrupt or does
+ *         not fit into the output buffer
+ */
+size_t ddlog_lz_decompress(const char* src, size_t size, char* dst, size_t capacity){
+    const unsigned char* in = (const unsigned char*) src;
+    size_t ip = 0, op = 0, len = 0, offset = 0;
+    unsigned char token = 0, byte = 0;
+
+    while (ip < size){
+        token = in[ip++];
+        len = token >> 4;
+        if (len == 15){
+            do {
+                if (ip >= size){
+                    return 0;
+                }
+                byte = in[ip++];
+                len += byte;
+            } while (byte == 255);
+        }
+        if (len > size - ip || len > capacity - op){
+            return 0;
+        }
+        memcpy(dst + op, in + ip, len);
+        ip += len;
+        op += len;
+        if (ip == size){
+            break;
+        }
+
+        if (size - ip < 2){
+            return 0;
+        }
+        offset = in[ip] | ((size_t) in[ip + 1] << 8);
+        ip += 2;
+        len = token & 15;
+        if (len == 15){
+            do {
+                if (ip >= size){
+                    return 0;
+                }
+                byte = in[ip++];
+                len += byte;
+            } while (byte == 255);
+        }
+        len += DDLOG_LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || len > capacity - op){
+            return 0;
+        }
+        /* the match can overlap the output */
+        while (len--){
+            dst[op] = dst[op - offset];
+            op++;
+        }
+    }
+    return op;
+}
+
+/******************************************************************************
+ * Block encoder
+ ******************************************************************************/
+
+static size_t ddlog_logfile_put_varint(char* dst, uint64_t value){
+    size_t len = 0;
+    while (value >= 0x80){
+        dst[len++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    dst[len++] = (char) value;
+    return len;
+}
+
+static const char* ddlog_logfile_get_varint(const char* src, const char* end, uint64_t* value){
+    unsigned int shift = 0;
+    unsigned char byte = 0;
+
+    *value = 0;
+    while (src < end && shift < 64){
+        byte = (unsigned char) *src++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0){
+            return src;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+/**
+ * \brief Allocates the memory of a block encoder
+ *
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
+ */
+int ddlog_logfile_block_init_internal(ddlog_logfile_block_t* block){
+    memset(block, 0, sizeof(ddlog_logfile_block_t));
+    block->strings = malloc(DDLOG_LOGFILE_STRINGS_CAPACITY);
+    block->events = malloc(DDLOG_LOGFILE_EVENTS_CAPACITY);
+    block->raw = malloc(DDLOG_LOGFILE_MAX_RAW_SIZE);
+    block->out = malloc(DDLOG_LOGFILE_MAX_RAW_SIZE);
+    if (block->strings == NULL || block->events == NULL || block->raw == NULL || block->out == NULL){
+        ddlog_logfile_block_free_internal(block);
+        return DDLOG_RET_ERR;
+    }
+    ddlog_logfile_block_reset_internal(block, 0);
+    return DDLOG_RET_OK;
+}
+
+void ddlog_logfile_block_free_internal(ddlog_logfile_block_t* block){
+    free(block->strings);
+    free(block->events);
+    free(block->raw);
+    free(block->out);
+    memset(block, 0, sizeof(ddlog_logfile_block_t));
+}
+
+/**
+ * \brief Starts a new empty block
+ *
+ * \param block The block encoder
+ * \param first_seq The sequence number of the first event of the block
+ */
+void ddlog_logfile_block_reset_internal(ddlog_logfile_block_t* block, uint64_t first_seq){
+    memset(&block->hdr, 0, sizeof(block->hdr));
+    block->hdr.magic = DDLOG_LOGFILE_BLOCK_MAGIC;
+    block->hdr.first_seq = first_seq;
+    block->prev_timestamp = 0;
+    block->strings_size = 0;
+    block->events_size = 0;
+    memset(block->string_hash, 0, sizeof(block->string_hash));
+}
+
+/**
+ * \brief Looks up or adds a name in the string table of the block
+ *
+ * \param block The block encoder
+ * \param name The name or NULL
+ * \param ref The string index + 1 is returned here, 0 for NULL
+ * \return DDLOG_RET_OK on success, DDLOG_RET_BUF_FULL if the string table is full
+ */
+static int ddlog_logfile_intern_internal(ddlog_logfile_block_t* block, const char* name, uint64_t* ref){
+    const unsigned int mask = 2 * DDLOG_LOGFILE_MAX_STRINGS - 1;
+    const char* stored = NULL;
+    uint32_t hash = 2166136261U;
+    unsigned int slot = 0, index = 0;
+    size_t len = 0, i = 0;
+
+    *ref = 0;
+    if (name == NULL){
+        return DDLOG_RET_OK;
+    }
+    len = strnlen(name, DDLOG_MAX_NAME_LEN - 1);
+    for (i = 0; i < len; i++){
+        hash = (hash ^ (unsigned char) name[i]) * 16777619U;
+    }
+
+    for (slot = hash & mask; block->string_hash[slot]; slot = (slot + 1) & mask){
+        index = block->string_hash[slot] - 1;
+        stored = block->strings + block->string_offsets[index];
+        if (block->string_lens[index] == len && memcmp(stored, name, len) == 0){
+            *ref = index + 1;
+            return DDLOG_RET_OK;
+        }
+    }
+
+    if (block->hdr.string_num == DDLOG_LOGFILE_MAX_STRINGS){
+        return DDLOG_RET_BUF_FULL;
+    }
+    index = block->hdr.string_num++;
+    block->strings_size += ddlog_logfile_put_varint(block->strings + block->strings_size, len);
+    block->string_offsets[index] = block->strings_size;
+    block->string_lens[index] = len;
+    memcpy(block->strings + block->strings_size, name, len);
+    block->strings[block->strings_size + len] = '\0';
+    block->strings_size += len + 1;
+    block->string_hash[slot] = index + 1;
+    *ref = index + 1;
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Encodes an event into the block
+ *
+ * \param block The block encoder
+ * \param record The event
+ * \param buffer_id The id of the buffer the event was consumed from
+ * \param thread_name The thread name to be stored or NULL
+ * \param message The (formatted) message or NULL
+ * \return DDLOG_RET_OK on success, DDLOG_RET_BUF_FULL if the event does
+ *         not fit into the block, the block has to be sealed and reset.
+ *         An empty block always takes the event.
+ */
+int ddlog_logfile_block_add_internal(ddlog_logfile_block_t* block, const ddlog_record_t* record,
+        ddlog_buffer_id_t buffer_id, const char* thread_name, const char* message){
+    uint64_t thread_ref = 0, function_ref = 0, file_ref = 0;
+    uint64_t timestamp = record->event.timestamp;
+    uint32_t ext_size = record->ext_data ? record->event.ext_data_size : 0;
+    size_t message_len = message ? strnlen(message, 2 * DDLOG_MAX_RECORD_SIZE - 1) : 0;
+    int64_t delta = 0;
+    char* p = NULL;
+
+    if (block->events_size + 128 + message_len + 1 + ext_size > DDLOG_LOGFILE_EVENTS_CAPACITY){
+        return DDLOG_RET_BUF_FULL;
+    }
+    if (ddlog_logfile_intern_internal(block, thread_name, &thread_ref) != DDLOG_RET_OK ||
+            ddlog_logfile_intern_internal(block, record->function_name, &function_ref) != DDLOG_RET_OK ||
+            ddlog_logfile_intern_internal(block, record->file_name, &file_ref) != DDLOG_RET_OK){
+        return DDLOG_RET_BUF_FULL;
+    }
+
+    if (block->hdr.event_num == 0){
+        block->hdr.base_timestamp = timestamp;
+        block->hdr.min_timestamp = timestamp;
+        block->hdr.max_timestamp = timestamp;
+        block->prev_timestamp = timestamp;
+    }
+    if (timestamp < block->hdr.min_timestamp){
+        block->hdr.min_timestamp = timestamp;
+    }
+    if (timestamp > block->hdr.max_timestamp){
+        block->hdr.max_timestamp = timestamp;
+    }
+
+    /* the buffers are drained one after the other, the difference can be negative */
+    delta = (int64_t) (timestamp - block->prev_timestamp);
+    block->prev_timestamp = timestamp;
+
+    p = block->events + block->events_size;
+    p += ddlog_logfile_put_varint(p, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+    p += ddlog_logfile_put_varint(p, buffer_id);
+    p += ddlog_logfile_put_varint(p, record->event.thread_id);
+    p += ddlog_logfile_put_varint(p, thread_ref);
+    p += ddlog_logfile_put_varint(p, function_ref);
+    p += ddlog_logfile_put_varint(p, file_ref);
+    p += ddlog_logfile_put_varint(p, record->event.line_number);
+    *p++ = (char) (record->event.flags & ~DDLOG_EVENT_FLAG_DEFERRED);
+    *p++ = (char) record->event.indent_level;
+    p += ddlog_logfile_put_varint(p, message_len);
+    memcpy(p, message ? message : "", message_len);
+    p += message_len;
+    *p++ = '\0';
+    p += ddlog_logfile_put_varint(p, (uint64_t) record->event.ext_event_type);
+    p += ddlog_logfile_put_varint(p, ext_size);
+    if (ext_size){
+        memcpy(p, record->ext_data, ext_size);
+        p += ext_size;
+    }
+    block->events_size = p - block->events;
+    block->hdr.event_num++;
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Finishes a block
+ *
+ * \param block The block encoder
+ * \return The payload to be written after the block header (block->hdr),
+ *         its size is hdr.stored_size
+ *
+ * The payload is stored compressed if it gets smaller.
+ */
+const char* ddlog_logfile_block_seal_internal(ddlog_logfile_block_t* block){
+    size_t raw_size = ddlog_logfile_block_size_internal(block);
+    size_t compressed = 0;
+
+    memcpy(block->raw, block->strings, block->strings_size);
+    memcpy(block->raw + block->strings_size, block->events, block->events_size);
+    block->hdr.raw_size = raw_size;
+    block->hdr.strings_size = block->strings_size;
+
+    compressed = ddlog_lz_compress(block->raw, raw_size, block->out, raw_size);
+    if (compressed > 0 && compressed < raw_size){
+        block->hdr.flags |= DDLOG_LOGFILE_BLOCK_COMPRESSED;
+        block->hdr.stored_size = compressed;
+        return block->out;
+    }
+    block->hdr.stored_size = raw_size;
+    return block->raw;
+}
+
+/******************************************************************************
+ * Reader
+ ******************************************************************************/
+
+/**
+ * \brief Checks a block header
+ *
+ * \return DDLOG_RET_OK if the block is complete in the file
+ */
+static int ddlog_logfile_check_block_internal(const ddlog_logfile_t* file, uint64_t offset, ddlog_logfile_block_hdr_t* hdr){
+    if (offset < sizeof(ddlog_logfile_hdr_t) || offset > file->size ||
+            file->size - offset < sizeof(ddlog_logfile_block_hdr_t)){
+        return DDLOG_RET_ERR;
+    }
+    memcpy(hdr, file->data + offset, sizeof(ddlog_logfile_block_hdr_t));
+    if (hdr->magic != DDLOG_LOGFILE_BLOCK_MAGIC ||
+            hdr->raw_size > DDLOG_LOGFILE_MAX_RAW_SIZE ||
+            hdr->strings_size > hdr->raw_size ||
+            hdr->string_num > DDLOG_LOGFILE_MAX_STRINGS ||
+            hdr->stored_size > file->size - offset - sizeof(ddlog_logfile_block_hdr_t)){
+        return DDLOG_RET_ERR;
+    }
+    if ((hdr->flags & DDLOG_LOGFILE_BLOCK_COMPRESSED) == 0 && hdr->stored_size != hdr->raw_size){
+        return DDLOG_RET_ERR;
+    }
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Rebuilds the block index of a file without footer
+ *
+ * The blocks are walked from the start of the file until the first
+ * incomplete block.
+ */
+static int ddlog_logfile_scan_internal(ddlog_logfile_t* file){
+    ddlog_logfile_block_hdr_t hdr;
+    ddlog_logfile_index_t* index = NULL;
+    uint64_t offset = sizeof(ddlog_logfile_hdr_t);
+    size_t capacity = 0;
+
+    while (ddlog_logfile_check_block_internal(file, offset, &hdr) == DDLOG_RET_OK){
+        if (file->index_num == capacity){
+            capacity = capacity ? 2 * capacity : 64;
+            index = realloc(file->index, capacity * sizeof(ddlog_logfile_index_t));
+            if (index == NULL){
+                return DDLOG_RET_ERR;
+            }
+            file->index = index;
+        }
+        index = &file->index[file->index_num++];
+        memset(index, 0, sizeof(ddlog_logfile_index_t));
+        index->offset = offset;
+        index->first_seq = hdr.first_seq;
+        index->min_timestamp = hdr.min_timestamp;
+        index->max_timestamp = hdr.max_timestamp;
+        index->event_num = hdr.event_num;
+        offset += sizeof(ddlog_logfile_block_hdr_t) + hdr.stored_size;
+    }
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Opens a binary log file for reading
+ *
+ * \param path The path of the file
+ * \param file The opened file
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the file can not be
+ *         opened or it is not a binary log file
+ *
+ * The block index is read from the footer. The index of a file without
+ * footer (the active file of the writer, or the writer died) is rebuilt
+ * by walking the block headers.
+ */
+int ddlog_logfile_open_internal(const char* path, ddlog_logfile_t* file){
+    ddlog_logfile_footer_t footer;
+    struct stat st;
+    void* mapping = NULL;
+    int fd = -1;
+
+    memset(file, 0, sizeof(ddlog_logfile_t));
+    fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return DDLOG_RET_ERR;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ddlog_logfile_hdr_t)){
+        close(fd);
+        return DDLOG_RET_ERR;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED){
+        return DDLOG_RET_ERR;
+    }
+    file->data = mapping;
+    file->size = st.st_size;
+    file->hdr = (const ddlog_logfile_hdr_t*) mapping;
+    if (memcmp(file->hdr->magic, DDLOG_LOGFILE_MAGIC, sizeof(file->hdr->magic)) != 0 ||
+            file->hdr->version != DDLOG_LOGFILE_VERSION){
+        ddlog_logfile_close_internal(file);
+        return DDLOG_RET_ERR;
+    }
+
+    if (file->size >= sizeof(ddlog_logfile_hdr_t) + sizeof(footer)){
+        memcpy(&footer, file->data + file->size - sizeof(footer), sizeof(footer));
+        if (memcmp(footer.magic, DDLOG_LOGFILE_FOOTER_MAGIC, sizeof(footer.magic)) == 0 &&
+                footer.index_offset >= sizeof(ddlog_logfile_hdr_t) &&
+                footer.index_offset <= file->size - sizeof(footer) &&
+                footer.index_num <= (file->size - sizeof(footer) - footer.index_offset) / sizeof(ddlog_logfile_index_t)){
+            file->index_num = footer.index_num;
+            file->index = malloc((footer.index_num ? footer.index_num : 1) * sizeof(ddlog_logfile_index_t));
+            if (file->index == NULL){
+                ddlog_logfile_close_internal(file);
+                return DDLOG_RET_ERR;
+            }
+            memcpy(file->index, file->data + footer.index_offset, footer.index_num * sizeof(ddlog_logfile_index_t));
+            file->complete = 1;
+            return DDLOG_RET_OK;
+        }
+    }
+    if (ddlog_logfile_scan_internal(file) != DDLOG_RET_OK){
+        ddlog_logfile_close_internal(file);
+        return DDLOG_RET_ERR;
+    }
+    return DDLOG_RET_OK;
+}
+
+void ddlog_logfile_close_internal(ddlog_logfile_t* file){
+    if (file->data){
+        munmap((void*) file->data, file->size);
+    }
+    free(file->index);
+    memset(file, 0, sizeof(ddlog_logfile_t));
+}
+
+/**
+ * \brief Returns with the first block which can hold events not older than timestamp
+ *
+ * \return The block index, index_num if there is no such block
+ *
+ * Only the block index is searched, the blocks are not read.
+ */
+size_t ddlog_logfile_find_time_internal(const ddlog_logfile_t* file, uint64_t timestamp){
+    size_t i = 0;
+
+    for (i = 0; i < file->index_num; i++){
+        if (file->index[i].max_timestamp >= timestamp){
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * \brief Returns with the block holding a sequence number
+ *
+ * \return The block index, index_num if the sequence number is after the last block
+ */
+size_t ddlog_logfile_find_seq_internal(const ddlog_logfile_t* file, uint64_t seq){
+    size_t low = 0, high = file->index_num;
+    size_t mid = 0;
+
+    /* the first block ending after seq */
+    while (low < high){
+        mid = low + (high - low) / 2;
+        if (file->index[mid].first_seq + file->index[mid].event_num <= seq){
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int ddlog_logfile_cursor_init_internal(ddlog_logfile_cursor_t* cursor, const ddlog_logfile_t* file){
+    memset(cursor, 0, sizeof(ddlog_logfile_cursor_t));
+    cursor->file = file;
+    cursor->payload = malloc(DDLOG_LOGFILE_MAX_RAW_SIZE);
+    return cursor->payload ? DDLOG_RET_OK : DDLOG_RET_ERR;
+}
+
+void ddlog_logfile_cursor_free_internal(ddlog_logfile_cursor_t* cursor){
+    free(cursor->payload);
+    memset(cursor, 0, sizeof(ddlog_logfile_cursor_t));
+}
+
+/**
+ * \brief Loads a block, the next event returned is its first event
+ *
+ * \param cursor The cursor
+ * \param block The index of the block
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if there is no such
+ *         block or it is corrupt
+ */
+int ddlog_logfile_cursor_seek_internal(ddlog_logfile_cursor_t* cursor, size_t block){
+    const ddlog_logfile_t* file = cursor->file;
+    ddlog_logfile_block_hdr_t* hdr = &cursor->hdr;
+    const char* stored = NULL;
+    const char* p = NULL, *end = NULL;
+    uint64_t len = 0;
+    uint32_t i = 0;
+
+    cursor->loaded = 0;
+    cursor->block = block;
+    if (block >= file->index_num ||
+            ddlog_logfile_check_block_internal(file, file->index[block].offset, hdr) != DDLOG_RET_OK){
+        return DDLOG_RET_ERR;
+    }
+    stored = file->data + file->index[block].offset + sizeof(ddlog_logfile_block_hdr_t);
+    if (hdr->flags & DDLOG_LOGFILE_BLOCK_COMPRESSED){
+        if (ddlog_lz_decompress(stored, hdr->stored_size, cursor->payload, DDLOG_LOGFILE_MAX_RAW_SIZE) != hdr->raw_size){
+            return DDLOG_RET_ERR;
+        }
+    } else {
+        memcpy(cursor->payload, stored, hdr->raw_size);
+    }
+
+    p = cursor->payload;
+    end = cursor->payload + hdr->strings_size;
+    for (i = 0; i < hdr->string_num; i++){
+        p = ddlog_logfile_get_varint(p, end, &len);
+        if (p == NULL || len >= (uint64_t) (end - p) || p[len] != '\0'){
+            return DDLOG_RET_ERR;
+        }
+        cursor->strings[i] = p;
+        p += len + 1;
+    }
+    cursor->pos = hdr->strings_size;
+    cursor->event_idx = 0;
+    cursor->prev_timestamp = hdr->base_timestamp;
+    cursor->loaded = 1;
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Resolves a string reference of an event
+ */
+static const char* ddlog_logfile_string_internal(const ddlog_logfile_cursor_t* cursor, uint64_t ref, int* error){
+    if (ref == 0){
+        return NULL;
+    }
+    if (ref > cursor->hdr.string_num){
+        *error = 1;
+        return NULL;
+    }
+    return cursor->strings[ref - 1];
+}
+
+/**
+ * \brief Decodes the next event
+ *
+ * \param cursor The cursor
+ * \param event The decoded event
+ * \return DDLOG_RET_OK if an event has been decoded, DDLOG_RET_ERR at the
+ *         end of the file or if a block is corrupt
+ *
+ * Continues with the following blocks when the loaded block is finished,
+ * the first block is loaded if the cursor has not been positioned.
+ */
+int ddlog_logfile_cursor_next_internal(ddlog_logfile_cursor_t* cursor, ddlog_logfile_event_t* event){
+    const char* p = NULL, *end = NULL;
+    uint64_t value = 0, thread_ref = 0, function_ref = 0, file_ref = 0;
+    uint64_t buffer_id = 0, thread_id = 0, line = 0, ext_type = 0, ext_size = 0, message_len = 0;
+    int error = 0;
+
+    while (!cursor->loaded || cursor->event_idx == cursor->hdr.event_num){
+        if (ddlog_logfile_cursor_seek_internal(cursor, cursor->loaded ? cursor->block + 1 : cursor->block) != DDLOG_RET_OK){
+            return DDLOG_RET_ERR;
+        }
+    }
+
+    p = cursor->payload + cursor->pos;
+    end = cursor->payload + cursor->hdr.raw_size;
+    if ((p = ddlog_logfile_get_varint(p, end, &value)) == NULL ||
+            (p = ddlog_logfile_get_varint(p, end, &buffer_id)) == NULL ||
+            (p = ddlog_logfile_get_varint(p, end, &thread_id)) == NULL ||
+            (p = ddlog_logfile_get_varint(p, end, &thread_ref)) == NULL ||
+            (p = ddlog_logfile_get_varint(p, end, &function_ref)) == NULL ||
+            (p = ddlog_logfile_get_varint(p, end, &file_ref)) == NULL ||
+            (p = ddlog_logfile_get_varint(p, end, &line)) == NULL ||
+            end - p < 2){
+        return DDLOG_RET_ERR;
+    }
+    memset(event, 0, sizeof(ddlog_logfile_event_t));
+    event->flags = (uint8_t) p[0];
+    event->indent_level = (uint8_t) p[1];
+    p += 2;
+    if ((p = ddlog_logfile_get_varint(p, end, &message_len)) == NULL ||
+            message_len >= (uint64_t) (end - p) || p[message_len] != '\0'){
+        return DDLOG_RET_ERR;
+    }
+    event->message = p;
+    event->message_len = message_len;
+    p += message_len + 1;
+    if ((p = ddlog_logfile_get_varint(p, end, &ext_type)) == NULL ||
+            (p = ddlog_logfile_get_varint(p, end, &ext_size)) == NULL ||
+            ext_size > (uint64_t) (end - p)){
+        return DDLOG_RET_ERR;
+    }
+    event->ext_event_type = (uint32_t) ext_type;
+    event->ext_data_size = (uint32_t) ext_size;
+    event->ext_data = ext_size ? p : NULL;
+    p += ext_size;
+
+    event->thread_name = ddlog_logfile_string_internal(cursor, thread_ref, &error);
+    event->function_name = ddlog_logfile_string_internal(cursor, function_ref, &error);
+    event->file_name = ddlog_logfile_string_internal(cursor, file_ref, &error);
+    if (error){
+        return DDLOG_RET_ERR;
+    }
+
+    cursor->prev_timestamp += (uint64_t) ((int64_t) (value >> 1) ^ -(int64_t) (value & 1));
+    event->timestamp = cursor->prev_timestamp;
+    event->seq = cursor->hdr.first_seq + cursor->event_idx;
+    event->buffer_id = (unsigned int) buffer_id;
+    event->thread_id = (unsigned int) thread_id;
+    event->line_number = (unsigned int) line;
+
+    cursor->pos = p - cursor->payload;
+    cursor->event_idx++;
+    return DDLOG_RET_OK;
+}
@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_proto.c
+ * \brief Machine readable console protocol implementation
+ *
+ * This file contains the command interpreter and the response encoders
+ * of the json and binary console modes (see ddlog_proto.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_proto.h"
+#include "private/ddlog_query.h"
+#include "private/ddlog_display.h"
+#include "private/ddlog_clock.h"
+#include "private/ddlog_fmt.h"
+#include "private/ddlog_thread.h"
+
+static const char* ddlog_proto_commands =
+    "\"help\",\"buffers\",\"threads\",\"stats <id>\",\"read <id> [query]\",\"drain <id>\","
+    "\"reset <id>\",\"mode text|json|binary\",\"quit\"";
+
+/**
+ * \brief Writes a JSON string value (with the quotes) into a stream
+ */
+static void ddlog_proto_fput_json_str(FILE* stream, const char* str){
+    const char* p = NULL;
+
+    if (str == NULL){
+        fputs("null", stream);
+        return;
+    }
+    fputc('"', stream);
+    for (p = str; *p; p++){
+        switch (*p){
+            case '"':  fputs("\\\"", stream); break;
+            case '\\': fputs("\\\\", stream); break;
+            case '\n': fputs("\\n", stream); break;
+            case '\r': fputs("\\r", stream); break;
+            case '\t': fputs("\\t", stream); break;
+            default:
+                if ((unsigned char) *p < 0x20){
+                    fprintf(stream, "\\u%04x", (unsigned char) *p);
+                } else {
+                    fputc(*p, stream);
+                }
+                break;
+        }
+    }
+    fputc('"', stream);
+}
+
+/**
+ * \brief Writes a JSON object as a record of the response
+ *
+ * \param stream The output stream
+ * \param mode The protocol mode
+ * \param json The JSON object
+ */
+static void ddlog_proto_write_object(FILE* stream, ddlog_proto_mode_t mode, const char* json){
+    ddlog_proto_frame_hdr_t hdr;
+    size_t len = strlen(json);
+
+    if (mode == DDLOG_PROTO_BINARY){
+        hdr.size = (uint32_t) (sizeof(hdr) + len);
+        hdr.type = DDLOG_PROTO_FRAME_JSON;
+        fwrite(&hdr, sizeof(hdr), 1, stream);
+        fwrite(json, 1, len, stream);
+    } else {
+        fprintf(stream, "%s\n", json);
+    }
+}
+
+/**
+ * \brief Writes the closing status record of a successful command
+ *
+ * \param extra Additional members of the status object (",\"name\":value") or ""
+ */
+static void ddlog_proto_write_ok(FILE* stream, ddlog_proto_mode_t mode, const char* extra){
+    char json[256];
+
+    snprintf(json, sizeof(json), "{\"status\":\"ok\"%s}", extra);
+    ddlog_proto_write_object(stream, mode, json);
+}
+
+/**
+ * \brief Writes the closing status record of a failed command
+ */
+static void ddlog_proto_write_error(FILE* stream, ddlog_proto_mode_t mode, const char* error){
+    char* json = NULL;
+    size_t size = 0;
+    FILE* object = open_memstream(&json, &size);
+
+    if (object == NULL){
+        return;
+    }
+    fputs("{\"status\":\"error\",\"error\":", object);
+    ddlog_proto_fput_json_str(object, error);
+    fputc('}', object);
+    fclose(object);
+    ddlog_proto_write_object(stream, mode, json);
+    free(json);
+}
+
+/**
+ * \brief Writes an event as a record of the response
+ *
+ * \param stream The output stream
+ * \param mode The protocol mode (json or binary)
+ * \param record The event
+ * \param buffer_id The id of the buffer of the event
+ */
+void ddlog_proto_write_event(FILE* stream, ddlog_proto_mode_t mode, const ddlog_record_t* record, ddlog_buffer_id_t buffer_id){
+    ddlog_proto_frame_hdr_t hdr;
+    ddlog_proto_event_t event;
+    struct timespec wall;
+    char thread[DDLOG_MAX_NAME_LEN];
+    char buffer[DDLOG_MAX_RECORD_SIZE];
+    const char* message = NULL;
+    const char* function = record->function_name ? record->function_name : "";
+    const char* file = record->file_name ? record->file_name : "";
+
+    ddlog_clock_to_wall_internal(record->event.timestamp, &wall);
+    ddlog_display_format_thread(thread, sizeof(thread), record);
+    message = ddlog_fmt_record_message(record, buffer, sizeof(buffer));
+    if (message == NULL){
+        message = "";
+    }
+
+    if (mode == DDLOG_PROTO_BINARY){
+        memset(&event, 0, sizeof(event));
+        event.seq = record->event.seq - 1;
+        event.time_ns = (uint64_t) wall.tv_sec * 1000000000ULL + wall.tv_nsec;
+        event.buffer_id = buffer_id;
+        event.thread_id = record->event.thread_id;
+        event.line_number = record->event.line_number;
+        event.ext_event_type = record->event.ext_event_type;
+        event.ext_data_size = record->ext_data ? record->event.ext_data_size : 0;
+        event.message_len = (uint32_t) strlen(message);
+        event.thread_len = (uint16_t) strlen(thread);
+        event.function_len = (uint16_t) strlen(function);
+        event.file_len = (uint16_t) strlen(file);
+        event.indent_level = record->event.indent_level;
+        event.flags = record->event.flags;
+
+        hdr.size = (uint32_t) (sizeof(hdr) + sizeof(event) + event.thread_len + event.function_len +
+                event.file_len + event.message_len + event.ext_data_size);
+        hdr.type = DDLOG_PROTO_FRAME_EVENT;
+        fwrite(&hdr, sizeof(hdr), 1, stream);
+        fwrite(&event, sizeof(event), 1, stream);
+        fwrite(thread, 1, event.thread_len, stream);
+        fwrite(function, 1, event.function_len, stream);
+        fwrite(file, 1, event.file_len, stream);
+        fwrite(message, 1, event.message_len, stream);
+        if (event.ext_data_size){
+            fwrite(record->ext_data, 1, event.ext_data_size, stream);
+        }
+        return;
+    }
+
+    fprintf(stream, "{\"seq\":%llu,\"time\":%lld.%09ld,\"buffer\":%u,\"thread_id\":%u,\"thread\":",
+            (unsigned long long) (record->event.seq - 1), (long long) wall.tv_sec, wall.tv_nsec,
+            (unsigned int) buffer_id, (unsigned int) record->event.thread_id);
+    ddlog_proto_fput_json_str(stream, thread);
+    fputs(",\"function\":", stream);
+    ddlog_proto_fput_json_str(stream, record->function_name);
+    fputs(",\"file\":", stream);
+    ddlog_proto_fput_json_str(stream, record->file_name);
+    fprintf(stream, ",\"line\":%u,\"indent\":%u,\"message\":", record->event.line_number, record->event.indent_level);
+    ddlog_proto_fput_json_str(stream, message);
+    fprintf(stream, ",\"ext_type\":%u,\"ext_size\":%u}\n", record->event.ext_event_type,
+            record->ext_data ? record->event.ext_data_size : 0);
+}
+
+/**
+ * \brief Parses the buffer id argument of a command
+ *
+ * \param args The arguments, moved after the id
+ * \param buffer The buffer is returned here
+ * \return The buffer id or -1 if the argument is not an existing buffer
+ */
+static int ddlog_proto_parse_buffer(char** args, ddlog_buffer_t** buffer){
+    char* end = NULL;
+    long id = 0;
+
+    errno = 0;
+    id = strtol(*args, &end, 0);
+    if (errno || end == *args || id < 0 || id >= ddlog_internal_get_max_buf_num()){
+        return -1;
+    }
+    *buffer = ddlog_internal_get_buffer_by_id((ddlog_buffer_id_t) id);
+    if (*buffer == NULL){
+        return -1;
+    }
+    *args = end;
+    return (int) id;
+}
+
+static void ddlog_proto_cmd_buffers(FILE* stream, ddlog_proto_mode_t mode){
+    ddlog_buffer_t* buffer = NULL;
+    char json[256];
+    int i = 0;
+
+    for (i = 0; i < ddlog_internal_get_max_buf_num(); i++){
+        buffer = ddlog_internal_get_buffer_by_id(i);
+        if (buffer){
+            snprintf(json, sizeof(json), "{\"buffer\":%d,\"size\":%zu,\"per_thread\":%d,\"rings\":%u,\"persistent\":%d}",
+                    i, buffer->buffer_size, buffer->per_thread, buffer->thread_buffer_num + 1, buffer->persistent);
+            ddlog_proto_write_object(stream, mode, json);
+        }
+    }
+    ddlog_proto_write_ok(stream, mode, "");
+}
+
+static void ddlog_proto_cmd_threads(FILE* stream, ddlog_proto_mode_t mode){
+    const ddlog_thread_info_t* info = NULL;
+    struct timespec wall;
+    char* json = NULL;
+    size_t size = 0;
+    FILE* object = NULL;
+    unsigned int i = 0;
+
+    for (i = 0; i < ddlog_thread_get_num_internal(); i++){
+        info = ddlog_thread_get_info_internal(i);
+        if (info == NULL || (object = open_memstream(&json, &size)) == NULL){
+            continue;
+        }
+        ddlog_clock_to_wall_internal(info->start_time, &wall);
+        fprintf(object, "{\"thread_id\":%u,\"tid\":%d,\"started\":%lld.%09ld,\"name\":",
+                i, (int) info->tid, (long long) wall.tv_sec, wall.tv_nsec);
+        ddlog_proto_fput_json_str(object, info->name);
+        fputc('}', object);
+        fclose(object);
+        ddlog_proto_write_object(stream, mode, json);
+        free(json);
+        json = NULL;
+    }
+    ddlog_proto_write_ok(stream, mode, "");
+}
+
+static void ddlog_proto_cmd_stats(FILE* stream, ddlog_proto_mode_t mode, int buffer_id){
+    ddlog_stats_t stats;
+    char json[512];
+
+    if (ddlog_get_stats_buffer_id(buffer_id, &stats) != DDLOG_RET_OK){
+        ddlog_proto_write_error(stream, mode, "The statistics are not available");
+        return;
+    }
+    snprintf(json, sizeof(json), "{\"buffer\":%d,\"events_written\":%llu,\"bytes_written\":%llu,\"wraps\":%llu,"
+            "\"events_dropped\":%llu,\"lock_contended\":%llu,\"lock_spin_ns\":%llu}",
+            buffer_id, stats.events_written, stats.bytes_written, stats.wraps,
+            stats.events_dropped, stats.lock_contended, stats.lock_spin_ns);
+    ddlog_proto_write_object(stream, mode, json);
+    ddlog_proto_write_ok(stream, mode, "");
+}
+
+static void ddlog_proto_cmd_read(FILE* stream, ddlog_proto_mode_t mode, int buffer_id, ddlog_buffer_t* buffer, const char* args){
+    ddlog_record_t record;
+    ddlog_buffer_iter_t iter;
+    ddlog_query_t query;
+    char error[128];
+    unsigned int count = 0;
+
+    if (ddlog_query_parse_internal(&query, args, error, sizeof(error)) != DDLOG_RET_OK){
+        ddlog_proto_write_error(stream, mode, error);
+        return;
+    }
+    ddlog_query_iter_init_internal(&query, &iter, buffer);
+    while ((query.limit == 0 || count < query.limit) && ddlog_iter_next_internal(&iter, &record) == DDLOG_RET_OK){
+        if (ddlog_query_match_internal(&query, &record)){
+            ddlog_proto_write_event(stream, mode, &record, buffer_id);
+            count++;
+        }
+    }
+    ddlog_query_free_internal(&query);
+    snprintf(error, sizeof(error), ",\"count\":%u", count);
+    ddlog_proto_write_ok(stream, mode, error);
+}
+
+static void ddlog_proto_cmd_drain(FILE* stream, ddlog_proto_mode_t mode, int buffer_id, ddlog_buffer_t* buffer){
+    ddlog_record_t record;
+    char extra[64];
+    unsigned int count = 0;
+
+    if (__sync_lock_test_and_set(&buffer->draining, 1)){
+        ddlog_proto_write_error(stream, mode, "The buffer is being drained");
+        return;
+    }
+    while (ddlog_drain_next_internal(buffer, &record) == DDLOG_RET_OK){
+        ddlog_proto_write_event(stream, mode, &record, buffer_id);
+        count++;
+    }
+    __sync_lock_release(&buffer->draining);
+    snprintf(extra, sizeof(extra), ",\"count\":%u", count);
+    ddlog_proto_write_ok(stream, mode, extra);
+}
+
+/**
+ * \brief Executes a protocol command line
+ *
+ * \param stream The response is written into this stream
+ * \param mode The protocol mode of the connection, changed by the mode command
+ * \param line The command line, modified
+ * \return 0 on success, 1 if the connection has to be closed
+ *
+ * The mode command is accepted in the text mode as well.
+ */
+int ddlog_proto_handle_command(FILE* stream, ddlog_proto_mode_t* mode, char* line){
+    ddlog_buffer_t* buffer = NULL;
+    char* command = line;
+    char* args = NULL;
+    char extra[64];
+    char json[512];
+    int buffer_id = -1;
+
+    while (*command == ' ' || *command == '\t'){
+        command++;
+    }
+    args = command + strcspn(command, " \t\r");
+    if (*args != '\0'){
+        *args++ = '\0';
+    }
+    while (*args == ' ' || *args == '\t'){
+        args++;
+    }
+
+    if (strcmp(command, "mode") == 0){
+        args[strcspn(args, " \t\r")] = '\0';
+        if (strcmp(args, "text") == 0){
+            *mode = DDLOG_PROTO_TEXT;
+        } else if (strcmp(args, "json") == 0 || strcmp(args, "binary") == 0){
+            *mode = args[0] == 'j' ? DDLOG_PROTO_JSON : DDLOG_PROTO_BINARY;
+            snprintf(extra, sizeof(extra), ",\"mode\":\"%s\"", args);
+            ddlog_proto_write_ok(stream, *mode, extra);
+        } else {
+            ddlog_proto_write_error(stream, *mode == DDLOG_PROTO_TEXT ? DDLOG_PROTO_JSON : *mode, "Unknown mode");
+        }
+        return 0;
+    }
+    if (*mode == DDLOG_PROTO_TEXT){
+        return 0;
+    }
+
+    if (command[0] == '\0'){
+        return 0;
+    } else if (strcmp(command, "quit") == 0){
+        return 1;
+    } else if (strcmp(command, "help") == 0){
+        snprintf(json, sizeof(json), "{\"status\":\"ok\",\"commands\":[%s]}", ddlog_proto_commands);
+        ddlog_proto_write_object(stream, *mode, json);
+    } else if (strcmp(command, "buffers") == 0){
+        ddlog_proto_cmd_buffers(stream, *mode);
+    } else if (strcmp(command, "threads") == 0){
+        ddlog_proto_cmd_threads(stream, *mode);
+    } else if (strcmp(command, "stats") == 0 || strcmp(command, "read") == 0 ||
+            strcmp(command, "drain") == 0 || strcmp(command, "reset") == 0){
+        buffer_id = ddlog_proto_parse_buffer(&args, &buffer);
+        if (buffer_id < 0){
+            ddlog_proto_write_error(stream, *mode, "Invalid buffer id");
+        } else if (command[0] == 's'){
+            ddlog_proto_cmd_stats(stream, *mode, buffer_id);
+        } else if (command[0] == 'd'){
+            ddlog_proto_cmd_drain(stream, *mode, buffer_id, buffer);
+        } else if (strcmp(command, "reset") == 0){
+            ddlog_reset_buffer_id(buffer_id);
+            ddlog_proto_write_ok(stream, *mode, "");
+        } else {
+            ddlog_proto_cmd_read(stream, *mode, buffer_id, buffer, args);
+        }
+    } else {
+        ddlog_proto_write_error(stream, *mode, "Unknown command");
+    }
+    return 0;
+}
@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_query.c
+ * \brief Event query implementation
+ *
+ * This file contains the query string parser and the event predicates
+ * used by the console server (see ddlog_query.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_query.h"
+#include "private/ddlog_clock.h"
+#include "private/ddlog_thread.h"
+#include "private/ddlog_display.h"
+#include "private/ddlog_fmt.h"
+
+/**
+ * \brief Parses a time value of a query to clock ticks
+ *
+ * \param str seconds[.fraction] since the epoch, or -seconds[.fraction]
+ *            relative to the current time
+ * \param ticks The time is returned here
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the value is invalid
+ */
+static int ddlog_query_parse_time(const char* str, uint64_t* ticks){
+    struct timespec now;
+    const char* p = str;
+    char* end = NULL;
+    uint64_t ns = 0, unit = 100000000ULL, wall_ns = 0;
+    int relative = 0;
+
+    if (*p == '-'){
+        relative = 1;
+        p++;
+    }
+    if (*p < '0' || *p > '9'){
+        return DDLOG_RET_ERR;
+    }
+    errno = 0;
+    ns = strtoull(p, &end, 10) * 1000000000ULL;
+    if (errno){
+        return DDLOG_RET_ERR;
+    }
+    if (*end == '.'){
+        for (end++; *end >= '0' && *end <= '9'; end++, unit /= 10){
+            ns += (uint64_t) (*end - '0') * unit;
+        }
+    }
+    if (*end != '\0'){
+        return DDLOG_RET_ERR;
+    }
+
+    wall_ns = ns;
+    if (relative){
+        clock_gettime(CLOCK_REALTIME, &now);
+        wall_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+        wall_ns = ns < wall_ns ? wall_ns - ns : 0;
+    }
+    *ticks = ddlog_clock_from_wall_internal(wall_ns);
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Parses an unsigned number of a query
+ */
+static int ddlog_query_parse_uint(const char* str, unsigned int* value, char** end){
+    unsigned long parsed = 0;
+
+    if (*str < '0' || *str > '9'){
+        return DDLOG_RET_ERR;
+    }
+    errno = 0;
+    parsed = strtoul(str, end, 0);
+    if (errno || parsed > UINT32_MAX){
+        return DDLOG_RET_ERR;
+    }
+    *value = (unsigned int) parsed;
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Reads the next key=value term of a query string
+ *
+ * \param str The position in the query string, moved after the term
+ * \param key The key is returned here
+ * \param key_size The size of the key buffer
+ * \param value The value is returned here, unquoted
+ * \param value_size The size of the value buffer
+ * \return 1 if a term has been read, 0 at the end of the string, -1 if
+ *         the term is invalid
+ */
+static int ddlog_query_next_term(const char** str, char* key, size_t key_size, char* value, size_t value_size){
+    const char* p = *str;
+    size_t len = 0;
+
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'){
+        p++;
+    }
+    if (*p == '\0'){
+        *str = p;
+        return 0;
+    }
+    while (*p != '\0' && *p != '=' && *p != ' ' && *p != '\t'){
+        if (len + 1 >= key_size){
+            return -1;
+        }
+        key[len++] = *p++;
+    }
+    key[len] = '\0';
+    if (*p != '=' || len == 0){
+        return -1;
+    }
+    p++;
+
+    len = 0;
+    if (*p == '"'){
+        for (p++; *p != '"'; p++){
+            if (*p == '\0'){
+                return -1;
+            }
+            if (*p == '\\' && (p[1] == '"' || p[1] == '\\')){
+                p++;
+            }
+            if (len + 1 >= value_size){
+                return -1;
+            }
+            value[len++] = *p;
+        }
+        p++;
+    } else {
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'){
+            if (len + 1 >= value_size){
+                return -1;
+            }
+            value[len++] = *p++;
+        }
+    }
+    value[len] = '\0';
+    *str = p;
+    return 1;
+}
+
+/**
+ * \brief Parses a query string
+ *
+ * \param query The parsed query is returned here, it has to be freed with
+ *              ddlog_query_free_internal() on success
+ * \param str The query string (see ddlog_query.h)
+ * \param error The description of the error is returned here
+ * \param error_size The size of the error buffer
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the query is invalid
+ */
+int ddlog_query_parse_internal(ddlog_query_t* query, const char* str, char* error, size_t error_size){
+    char key[16];
+    char value[DDLOG_MAX_NAME_LEN];
+    char* end = NULL;
+    int res = 0;
+
+    memset(query, 0, sizeof(ddlog_query_t));
+    query->time_to = UINT64_MAX;
+    query->line_max = UINT32_MAX;
+
+    while ((res = ddlog_query_next_term(&str, key, sizeof(key), value, sizeof(value))) > 0){
+        if (strcmp(key, "thread") == 0){
+            snprintf(query->thread, sizeof(query->thread), "%s", value);
+            query->fields |= DDLOG_QUERY_THREAD;
+        } else if (strcmp(key, "function") == 0){
+            snprintf(query->function, sizeof(query->function), "%s", value);
+            query->fields |= DDLOG_QUERY_FUNCTION;
+        } else if (strcmp(key, "line") == 0){
+            if (ddlog_query_parse_uint(value, &query->line_min, &end) != DDLOG_RET_OK){
+                break;
+            }
+            query->line_max = query->line_min;
+            if (*end == '-' && ddlog_query_parse_uint(end + 1, &query->line_max, &end) != DDLOG_RET_OK){
+                break;
+            }
+            if (*end != '\0'){
+                break;
+            }
+            query->fields |= DDLOG_QUERY_LINE;
+        } else if (strcmp(key, "from") == 0){
+            if (ddlog_query_parse_time(value, &query->time_from) != DDLOG_RET_OK){
+                break;
+            }
+            query->fields |= DDLOG_QUERY_TIME;
+        } else if (strcmp(key, "to") == 0){
+            if (ddlog_query_parse_time(value, &query->time_to) != DDLOG_RET_OK){
+                break;
+            }
+            query->fields |= DDLOG_QUERY_TIME;
+        } else if (strcmp(key, "msg") == 0){
+            snprintf(query->message, sizeof(query->message), "%s", value);
+            query->fields |= DDLOG_QUERY_MESSAGE;
+        } else if (strcmp(key, "re") == 0){
+            if (query->fields & DDLOG_QUERY_REGEX){
+                regfree(&query->regex);
+                query->fields &= ~DDLOG_QUERY_REGEX;
+            }
+            if (regcomp(&query->regex, value, REG_EXTENDED | REG_NOSUB) != 0){
+                break;
+            }
+            query->fields |= DDLOG_QUERY_REGEX;
+        } else if (strcmp(key, "ext") == 0){
+            if (ddlog_query_parse_uint(value, &query->ext_type, &end) != DDLOG_RET_OK || *end != '\0'){
+                break;
+            }
+            query->fields |= DDLOG_QUERY_EXT;
+        } else if (strcmp(key, "limit") == 0){
+            if (ddlog_query_parse_uint(value, &query->limit, &end) != DDLOG_RET_OK || *end != '\0'){
+                break;
+            }
+        } else {
+            snprintf(error, error_size, "Unknown query term: %s", key);
+            ddlog_query_free_internal(query);
+            return DDLOG_RET_ERR;
+        }
+    }
+
+    if (res < 0){
+        snprintf(error, error_size, "Invalid query term near: %.32s", str);
+        ddlog_query_free_internal(query);
+        return DDLOG_RET_ERR;
+    }
+    if (res > 0){
+        snprintf(error, error_size, "Invalid value of %s: %s", key, value);
+        ddlog_query_free_internal(query);
+        return DDLOG_RET_ERR;
+    }
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Releases the resources of a parsed query
+ */
+void ddlog_query_free_internal(ddlog_query_t* query){
+    if (query->fields & DDLOG_QUERY_REGEX){
+        regfree(&query->regex);
+    }
+    query->fields = 0;
+}
+
+/**
+ * \brief Checks the thread predicate of a query on a formatted thread name
+ *
+ * \param query The query
+ * \param name The thread name, "name" or "name/tid"
+ * \return 1 if the name matches, 0 otherwise
+ */
+static int ddlog_query_match_thread(const ddlog_query_t* query, const char* name){
+    size_t len = strlen(query->thread);
+
+    return strncmp(name, query->thread, len) == 0 && (name[len] == '\0' || name[len] == '/');
+}
+
+/**
+ * \brief Initializes a reader cursor skipping the event slots not matching a query
+ *
+ * \param query The query
+ * \param iter The cursor to be initialized
+ * \param buffer The log buffer to be read
+ */
+void ddlog_query_iter_init_internal(const ddlog_query_t* query, ddlog_buffer_iter_t* iter, ddlog_buffer_t* buffer){
+    ddlog_iter_init_internal(iter, buffer);
+    if (query->fields & (DDLOG_QUERY_TIME | DDLOG_QUERY_LINE | DDLOG_QUERY_EXT | DDLOG_QUERY_FUNCTION | DDLOG_QUERY_THREAD)){
+        iter->filter = ddlog_query_filter_event_internal;
+        iter->filter_arg = (void*) query;
+    }
+}
+
+/**
+ * \brief Checks the predicates of a query on an event slot
+ *
+ * \param event The event slot in the ring
+ * \param arg The query
+ * \return 0 if the event does not match, 1 if it may match
+ *
+ * The slot is read without copying it, the fields may be overwritten by
+ * a producer meanwhile. A wrong match is caught by ddlog_query_match_internal()
+ * on the copy, a wrong mismatch means the event has been overwritten anyway.
+ * The thread predicate is checked on the thread registry, the events with
+ * a thread name in their record (and the unknown threads) are left to
+ * ddlog_query_match_internal().
+ */
+int ddlog_query_filter_event_internal(const ddlog_event_t* event, void* arg){
+    const ddlog_query_t* query = (const ddlog_query_t*) arg;
+    const ddlog_callsite_t* callsite = event->callsite;
+    const ddlog_thread_info_t* info = NULL;
+    char thread[DDLOG_MAX_NAME_LEN];
+    uint64_t timestamp = event->timestamp;
+    unsigned int line = event->line_number;
+
+    if (timestamp < query->time_from || timestamp > query->time_to){
+        return 0;
+    }
+    if (line < query->line_min || line > query->line_max){
+        return 0;
+    }
+    if ((query->fields & DDLOG_QUERY_EXT) && event->ext_event_type != query->ext_type){
+        return 0;
+    }
+    if ((query->fields & DDLOG_QUERY_FUNCTION) && callsite && strcmp(callsite->function, query->function) != 0){
+        return 0;
+    }
+    if ((query->fields & DDLOG_QUERY_THREAD) && (event->flags & DDLOG_EVENT_FLAG_THREAD_NAME) == 0){
+        info = ddlog_thread_get_info_internal(event->thread_id);
+        if (info){
+            snprintf(thread, sizeof(thread), "%s/%d", info->name[0] != '\0' ? info->name : "-", (int) info->tid);
+            if (!ddlog_query_match_thread(query, thread)){
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * \brief Checks whether an event matches a query
+ *
+ * \param query The query
+ * \param record The copy of the event
+ * \return 1 if the event matches, 0 otherwise
+ */
+int ddlog_query_match_internal(const ddlog_query_t* query, const ddlog_record_t* record){
+    char buffer[DDLOG_MAX_RECORD_SIZE];
+    const char* message = NULL;
+
+    if (record->event.timestamp < query->time_from || record->event.timestamp > query->time_to){
+        return 0;
+    }
+    if (record->event.line_number < query->line_min || record->event.line_number > query->line_max){
+        return 0;
+    }
+    if ((query->fields & DDLOG_QUERY_EXT) && record->event.ext_event_type != query->ext_type){
+        return 0;
+    }
+    if ((query->fields & DDLOG_QUERY_FUNCTION) &&
+            (record->function_name == NULL || strcmp(record->function_name, query->function) != 0)){
+        return 0;
+    }
+    if (query->fields & DDLOG_QUERY_THREAD){
+        ddlog_display_format_thread(buffer, DDLOG_MAX_NAME_LEN, record);
+        if (!ddlog_query_match_thread(query, buffer)){
+            return 0;
+        }
+    }
+    if (query->fields & (DDLOG_QUERY_MESSAGE | DDLOG_QUERY_REGEX)){
+        message = ddlog_fmt_record_message(record, buffer, sizeof(buffer));
+        if (message == NULL){
+            message = "";
+        }
+        if ((query->fields & DDLOG_QUERY_MESSAGE) && strstr(message, query->message) == NULL){
+            return 0;
+        }
+        if ((query->fields & DDLOG_QUERY_REGEX) && regexec(&query->regex, message, 0, NULL, 0) != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_recorder.c
+ * \brief File backed log buffers implementation
+ *
+ * This file contains the creation of the flight recorder files for the
+ * logging process and the post mortem opening of them for ddlog_dump.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_recorder.h"
+#include "private/ddlog_clock.h"
+
+#define DDLOG_RECORDER_ALIGN(size, align) (((size) + (align) - 1) & ~((uint64_t) (align) - 1))
+#define DDLOG_RECORDER_RING_HDR_SIZE DDLOG_RECORDER_ALIGN(sizeof(ddlog_buffer_t), DDLOG_CACHE_LINE_SIZE)
+
+/**
+ * \brief Returns with a ring region of a recorder file
+ */
+static ddlog_buffer_t* ddlog_recorder_ring_internal(ddlog_recorder_hdr_t* hdr, unsigned int index){
+    return (ddlog_buffer_t*) ((char*) hdr + hdr->ring_offset + index * hdr->ring_stride);
+}
+
+/**
+ * \brief Sets up a new ring in a ring region of a recorder file
+ *
+ * \param hdr The header of the mapped file
+ * \param index The index of the ring region
+ * \return The ring or NULL in case of error
+ */
+static ddlog_buffer_t* ddlog_recorder_init_ring_internal(ddlog_recorder_hdr_t* hdr, unsigned int index){
+    ddlog_buffer_t* ring = ddlog_recorder_ring_internal(hdr, index);
+    char* memory = (char*) ring + DDLOG_RECORDER_RING_HDR_SIZE;
+
+    memset(ring, 0, sizeof(ddlog_buffer_t));
+    memset(memory, 0, hdr->buffer_size * sizeof(ddlog_event_t));
+    if (ddlog_setup_buffer_internal(ring, memory, hdr->buffer_size, hdr->data_size, hdr->ext_size)){
+        return NULL;
+    }
+    ring->persistent = 1;
+    __sync_synchronize();
+    hdr->ring_num = index + 1;
+    return ring;
+}
+
+/**
+ * \brief Creates a flight recorder file and its shared ring
+ *
+ * \param path The path of the file, an existing file is truncated
+ * \param size The maximum number of log messages in a ring
+ * \param per_thread (flag) if not 0 room is reserved for the private thread rings
+ * \return The shared ring of the buffer or NULL in case of error
+ *
+ * The file is extended to its final size without writing it, the ring
+ * regions not used take no disk space.
+ */
+ddlog_buffer_t* ddlog_recorder_create_internal(const char* path, size_t size, int per_thread, ddlog_buffer_id_t buffer_id){
+    ddlog_recorder_hdr_t* hdr = NULL;
+    ddlog_buffer_t* ring = NULL;
+    void* mapping = NULL;
+    size_t slots = 0, data_size = 0, ext_size = 0, capacity = 0;
+    uint64_t stride = 0, total = 0;
+    int fd = -1;
+
+    if (path == NULL || size == 0){
+        return NULL;
+    }
+    slots = ddlog_ring_slots_internal(size);
+    data_size = ddlog_ring_data_size_internal(slots);
+    ext_size = ddlog_ring_ext_size_internal(slots);
+    capacity = per_thread ? DDLOG_MAX_THREAD_BUF_NUM + 1 : 1;
+    stride = DDLOG_RECORDER_ALIGN(DDLOG_RECORDER_RING_HDR_SIZE + slots * sizeof(ddlog_event_t) +
+            data_size + ext_size, DDLOG_RECORDER_PAGE_SIZE);
+    total = DDLOG_RECORDER_PAGE_SIZE + capacity * stride;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t) total) != 0){
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED){
+        return NULL;
+    }
+
+    hdr = (ddlog_recorder_hdr_t*) mapping;
+    memcpy(hdr->magic, DDLOG_RECORDER_MAGIC, sizeof(hdr->magic));
+    hdr->version = DDLOG_RECORDER_VERSION;
+    hdr->buffer_struct_size = sizeof(ddlog_buffer_t);
+    hdr->event_size = sizeof(ddlog_event_t);
+    hdr->buffer_id = buffer_id;
+    hdr->pid = (int32_t) getpid();
+    hdr->ring_capacity = capacity;
+    hdr->ring_num = 0;
+    hdr->ring_offset = DDLOG_RECORDER_PAGE_SIZE;
+    hdr->ring_stride = stride;
+    hdr->buffer_size = slots;
+    hdr->data_size = data_size;
+    hdr->ext_size = ext_size;
+    hdr->clock = ddlog_clock_calibration;
+
+    ring = ddlog_recorder_init_ring_internal(hdr, 0);
+    if (ring == NULL){
+        munmap(mapping, total);
+        return NULL;
+    }
+    ring->mapping = mapping;
+    ring->mapping_size = total;
+    return ring;
+}
+
+/**
+ * \brief Sets up the next private thread ring of a file backed buffer
+ *
+ * \param buffer The shared ring of the buffer (holding the buffer lock)
+ * \return The new ring or NULL if there is no more room in the file
+ */
+ddlog_buffer_t* ddlog_recorder_add_ring_internal(ddlog_buffer_t* buffer){
+    ddlog_recorder_hdr_t* hdr = (ddlog_recorder_hdr_t*) buffer->mapping;
+    unsigned int index = buffer->thread_buffer_num + 1;
+
+    if (hdr == NULL || index >= hdr->ring_capacity){
+        return NULL;
+    }
+    return ddlog_recorder_init_ring_internal(hdr, index);
+}
+
+/**
+ * \brief Unmaps the file of a file backed buffer
+ *
+ * \param buffer The shared ring of the buffer
+ *
+ * The rings of the buffer are in the mapping, none of them can be used
+ * after this call. The file is kept.
+ */
+void ddlog_recorder_close_internal(ddlog_buffer_t* buffer){
+    void* mapping = buffer->mapping;
+    size_t mapping_size = buffer->mapping_size;
+
+    if (mapping){
+        munmap(mapping, mapping_size);
+    }
+}
+
+/**
+ * \brief Opens a flight recorder file for reading
+ *
+ * \param path The path of the file
+ * \return The shared ring of the recorded buffer or NULL if the file
+ *         is not a valid recorder file. The header is at the start of
+ *         the mapping of the returned ring.
+ *
+ * The file is mapped privately, the ring structures are fixed up to the
+ * mapping address and the sizes are taken from the header, the file is
+ * not modified. The rings can be read with the usual reader functions
+ * (ddlog_iter_*_internal()). The references to the memory of the writer
+ * process are cleared. The mapping has to be released with
+ * ddlog_recorder_close_internal().
+ */
+ddlog_buffer_t* ddlog_recorder_open_internal(const char* path){
+    ddlog_recorder_hdr_t* hdr = NULL;
+    ddlog_buffer_t* buffer = NULL, *ring = NULL;
+    void* mapping = NULL;
+    struct stat st;
+    uint64_t min_stride = 0;
+    unsigned int i = 0;
+    size_t j = 0;
+    int fd = -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < DDLOG_RECORDER_PAGE_SIZE){
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED){
+        return NULL;
+    }
+
+    /* validate the layout */
+    hdr = (ddlog_recorder_hdr_t*) mapping;
+    min_stride = DDLOG_RECORDER_RING_HDR_SIZE + hdr->buffer_size * sizeof(ddlog_event_t) +
+        hdr->data_size + hdr->ext_size;
+    if (memcmp(hdr->magic, DDLOG_RECORDER_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->version != DDLOG_RECORDER_VERSION ||
+            hdr->buffer_struct_size != sizeof(ddlog_buffer_t) ||
+            hdr->event_size != sizeof(ddlog_event_t) ||
+            hdr->buffer_size == 0 || (hdr->buffer_size & (hdr->buffer_size - 1)) != 0 ||
+            hdr->buffer_size > ddlog_ring_slots_internal(DDLOG_MAX_EVENT_NUM) ||
+            hdr->data_size == 0 || (hdr->data_size & (hdr->data_size - 1)) != 0 ||
+            hdr->data_size > ddlog_ring_data_size_internal(hdr->buffer_size) ||
+            hdr->ext_size < DDLOG_EXT_ARENA_MIN_SIZE || (hdr->ext_size & (hdr->ext_size - 1)) != 0 ||
+            hdr->ext_size > ddlog_ring_ext_size_internal(hdr->buffer_size) ||
+            hdr->ring_capacity == 0 || hdr->ring_capacity > DDLOG_MAX_THREAD_BUF_NUM + 1 ||
+            hdr->ring_num == 0 || hdr->ring_num > hdr->ring_capacity ||
+            hdr->ring_offset < sizeof(ddlog_recorder_hdr_t) || hdr->ring_offset % DDLOG_CACHE_LINE_SIZE != 0 ||
+            hdr->ring_stride < min_stride || hdr->ring_stride % DDLOG_CACHE_LINE_SIZE != 0 ||
+            hdr->ring_stride > (uint64_t) st.st_size ||
+            hdr->ring_offset + hdr->ring_capacity * hdr->ring_stride > (uint64_t) st.st_size){
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    /* fix up the rings */
+    buffer = ddlog_recorder_ring_internal(hdr, 0);
+    for (i = 0; i < hdr->ring_num; i++){
+        ring = ddlog_recorder_ring_internal(hdr, i);
+        ring->events = (ddlog_event_t*) ((char*) ring + DDLOG_RECORDER_RING_HDR_SIZE);
+        ring->buffer_size = hdr->buffer_size;
+        ring->mask = hdr->buffer_size - 1;
+        ring->data = (char*) ring->events + hdr->buffer_size * sizeof(ddlog_event_t);
+        ring->data_size = hdr->data_size;
+        ring->data_mask = hdr->data_size - 1;
+        ring->ext_arena = ring->data + hdr->data_size;
+        ring->ext_size = hdr->ext_size;
+        ring->thread_buffer_num = 0;
+        ring->persistent = 1;
+        ring->mapping = NULL;
+        ring->mapping_size = 0;
+        pthread_spin_init(&ring->lock, PTHREAD_PROCESS_PRIVATE);
+        for (j = 0; j < ring->buffer_size; j++){
+            ring->events[j].callsite = NULL;
+            ring->events[j].flags &= ~DDLOG_EVENT_FLAG_DEFERRED;
+        }
+        if (i > 0){
+            buffer->thread_buffers[i - 1] = ring;
+        }
+    }
+    buffer->thread_buffer_num = hdr->ring_num - 1;
+    buffer->mapping = mapping;
+    buffer->mapping_size = st.st_size;
+    return buffer;
+}
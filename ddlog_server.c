@@ -8,11 +8,28 @@
  * \brief ddlog library log display console/server implementation
  *
  * This file contains the implementation of the log console tcp server.
+ * The server thread serves all the connections from a single epoll loop.
+ * The sockets are non-blocking, every client has its own input line
+ * buffer, active buffer and output queue. The output of a command is
+ * formatted into memory and queued, it is sent as the client socket
+ * becomes writable, so a slow client does not hold up the others. The
+ * input of a client is not read until its queued output is sent.
+ *
+ * A following client has a lock-free follow cursor in its active buffer.
+ * The cursor is polled by the server loop, the new events are formatted
+ * and queued as long as the client keeps up with them. The events
+ * overwritten while the output of the client was queued are reported
+ * as lost.
+ *
+ * The "mode json" and "mode binary" lines switch a connection from the
+ * menu to the machine readable protocol (see ddlog_proto.h).
  */
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
@@ -21,20 +38,66 @@
 #include "ddlog.h"
 #include "private/ddlog_internal.h"
 #include "private/ddlog_display.h"
+#include "private/ddlog_query.h"
+#include "private/ddlog_proto.h"
+
+#define DDLOG_SERVER_MAX_CLIENTS    64
+#define DDLOG_SERVER_LINE_LEN       512
+#define DDLOG_SERVER_MAX_EVENTS     64
+#define DDLOG_SERVER_FOLLOW_INTERVAL_MS 20      /* follow cursor polling interval */
+#define DDLOG_SERVER_FOLLOW_BATCH   4096        /* events formatted per follow step */
 
 pthread_t ddlog_server_thread;
 static int server_port = 0;
 static const char* welcome_msg = "\n  >> DDLOG log access server console <<\n\n";
 static const char* ddlog_server_prompt_str = "ddlog> ";
 static int stop_server = 0;
-
-static ddlog_buffer_id_t active_buffer = 0;
+static int ddlog_server_epoll = -1;
+static int ddlog_server_client_num = 0;
+static int ddlog_server_follower_num = 0;
+static ddlog_record_t ddlog_server_record;
+static ddlog_query_t ddlog_server_query;
 
 typedef struct ddlog_server_menu_item {
     const char * menu_str;
     void (*menu_function)(void);
 } ddlog_server_menu_item;
 
+/**
+ * \struct ddlog_server_chunk_t
+ * \brief A piece of queued client output.
+ */
+typedef struct ddlog_server_chunk_t {
+    struct ddlog_server_chunk_t* next;
+    char* data;
+    size_t len;
+    size_t pos;                             /*!< The number of bytes already sent */
+} ddlog_server_chunk_t;
+
+/**
+ * \struct ddlog_server_client_t
+ * \brief The state of a console connection.
+ */
+typedef struct ddlog_server_client_t {
+    struct ddlog_server_client_t* prev;
+    struct ddlog_server_client_t* next;
+    int socket;
+    uint32_t events;                        /*!< The epoll events the socket is registered for */
+    char input[DDLOG_SERVER_LINE_LEN];      /*!< The received, not yet processed input */
+    size_t input_len;
+    int discard;                            /*!< (flag) skip the input up to the next new line */
+    char pending;                           /*!< The command waiting for an answer line or 0 */
+    int closing;                            /*!< (flag) close the connection when the output is sent */
+    ddlog_buffer_id_t active_buffer;
+    ddlog_proto_mode_t mode;                /*!< The protocol mode of the connection */
+    int following;                          /*!< (flag) the new events of the active buffer are sent */
+    ddlog_buffer_iter_t* follow;            /*!< The follow cursor */
+    ddlog_server_chunk_t* out_head;         /*!< The output queue */
+    ddlog_server_chunk_t* out_tail;
+} ddlog_server_client_t;
+
+static ddlog_server_client_t* ddlog_server_clients = NULL;
+
 void ddlog_menu_list_buffers(void);
 void ddlog_menu_print_logs(void);
 void ddlog_menu_stop_server(void);
@@ -48,178 +111,559 @@ static ddlog_server_menu_item ddlog_server_menu[] = {
     {"[2] Select active buffer", NULL},
     {"[3] Print logs from the active buffer",NULL},
     {"[4] Print logs from all buffers",NULL},
+    {"[p] Drain (print and consume) the active buffer",NULL},
+    {"[f] Follow the active buffer (print the new events)",NULL},
     {"[5] Reset (clear) the active buffer",NULL},
     {"[6] Reset (clear) all buffers",NULL},
     {"[7] Enable/disable logging", NULL},
     {"[8] Stop logging colsole", NULL},
+    {"[9] List threads", NULL},
+    {"[s] Show buffer statistics", NULL},
+    {"[g] Query the active buffer", NULL},
+    {"[c] List callsites", NULL},
+    {"[e] Enable callsites", NULL},
+    {"[d] Disable callsites", NULL},
+    {"[mode json|binary] Switch to the machine readable protocol", NULL},
     {"[q] Close connection", NULL},
     {NULL,NULL}
 };
 
 /******************************************************************************
- * read_line
- * reads a line from the socket
+ * trim_line
+ * removes the trailing white space (telnet sends CR LF) from a line
  *
  * Parameters:
  * -----------
- * socket     : open socket to read from
- * buffer     : the data read is stored in this buffer
- * buffer_len : the lengh of the ourput buffer
+ * buffer     : a line received from the client
  *
  ******************************************************************************/
-int read_line(int socket, char* buffer, size_t buffer_len){
-    char c;
-    unsigned int chars_read = 0;
-    int res = -1, eof = 0;
-    if (buffer && buffer_len) {
-        memset(buffer, 0, buffer_len);
-        while (1) {
-            res = read(socket, &c, 1);
-            if (res == 1){
-                if (c == '\n') {
-                    break;
-                } else if (c == -1) {
-                    eof = 1;
-                    break;
-                } else if (chars_read < buffer_len - 1){
-                    buffer[chars_read++] = c;
-                }
-            } else if (res == 0) {
-                eof = 1;
-                break;
-            } else {
-                *buffer = 0;
-                break;
-            }
-        }
-    }
-    if (res < 0) {             /* error */
-        return res;
-    } else if (eof){           /* CTRL-C */
-        return 0;
-    } else {
-        return chars_read;
+void trim_line(char* buffer){
+    size_t len = strlen(buffer);
+    while (len > 0 && (buffer[len - 1] == '\r' || buffer[len - 1] == ' ' || buffer[len - 1] == '\t')){
+        buffer[--len] = '\0';
     }
 }
 
+/**
+ * \brief Prints the menu and the prompt
+ */
+static void ddlog_server_print_menu(FILE* stream){
+    int menu_item_idx = 0;
+    while(ddlog_server_menu[menu_item_idx].menu_str){
+        fprintf(stream, "%s\n", ddlog_server_menu[menu_item_idx].menu_str);
+        menu_item_idx++;
+    }
+    fprintf(stream, "%s", ddlog_server_prompt_str);
+}
 
-void ddlog_server_handle_connection(int socket){
-    char buffer[8];
-    int loop = 1;
-    int res = 0;
-    FILE* stream = NULL;
-    int fd = -1;
-    int max_buf_num = 0;
-    char answer[8] = {0};
-    ddlog_buffer_id_t j = 0;
-
-    fd = dup(socket);
-    stream = fdopen(fd, "w");
+/**
+ * \brief Appends a memory buffer to the output queue of a client
+ *
+ * The queue takes the ownership of the buffer.
+ */
+static void ddlog_server_queue(ddlog_server_client_t* client, char* data, size_t len){
+    ddlog_server_chunk_t* chunk = NULL;
 
-    if (stream == NULL){
-        close(fd);
+    if (data == NULL || len == 0 || (chunk = malloc(sizeof(ddlog_server_chunk_t))) == NULL){
+        free(data);
         return;
     }
+    chunk->next = NULL;
+    chunk->data = data;
+    chunk->len = len;
+    chunk->pos = 0;
+    if (client->out_tail){
+        client->out_tail->next = chunk;
+    } else {
+        client->out_head = chunk;
+    }
+    client->out_tail = chunk;
+}
 
-    max_buf_num = ddlog_internal_get_max_buf_num();
+/**
+ * \brief Sends the queued output of a client as far as the socket takes it
+ *
+ * \return 0 on success, -1 if the connection is broken
+ */
+static int ddlog_server_flush(ddlog_server_client_t* client){
+    ddlog_server_chunk_t* chunk = NULL;
+    ssize_t res = 0;
 
-    while(loop) {
-        int menu_item_idx = 0;
-        while(ddlog_server_menu[menu_item_idx].menu_str){
-            fprintf(stream, "%s\n", ddlog_server_menu[menu_item_idx].menu_str);
-            menu_item_idx++;
-            fflush(stream);
+    while ((chunk = client->out_head) != NULL){
+        res = send(client->socket, chunk->data + chunk->pos, chunk->len - chunk->pos, MSG_NOSIGNAL);
+        if (res < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
         }
-        fprintf(stream, "%s", ddlog_server_prompt_str);
-        fflush(stream);
-
-        res = read_line(socket, buffer, sizeof(buffer));
-        if (res <= 0) { /* error of EOF */
-            loop = 0;
-            break;
+        chunk->pos += res;
+        if (chunk->pos == chunk->len){
+            client->out_head = chunk->next;
+            if (client->out_head == NULL){
+                client->out_tail = NULL;
+            }
+            free(chunk->data);
+            free(chunk);
         }
+    }
+    return 0;
+}
 
-        switch (buffer[0]) {
-            case '1':
-                ddlog_server_print_cmd_header(stream, "List log buffers");
-                fprintf(stream, "Active buffer: %d\n\n", active_buffer);
-                ddlog_display_print_buffer_list(stream);
-                ddlog_server_print_cmd_footer(stream);
-                break;
+/**
+ * \brief Executes a command line or the answer to the question of a command
+ */
+static void ddlog_server_handle_line(ddlog_server_client_t* client, char* line, FILE* stream){
+    char command = client->pending;
+    char error[128];
+    ddlog_proto_mode_t mode = DDLOG_PROTO_TEXT;
+    ddlog_buffer_t* buffer = NULL;
+    ddlog_buffer_id_t j = 0;
+    int res = 0;
+
+    client->pending = 0;
+    if (client->following){
+        /* any input stops following */
+        client->following = 0;
+        ddlog_server_follower_num--;
+        fprintf(stream, "\nFollowing has been stopped.\n");
+        ddlog_server_print_cmd_footer(stream);
+        ddlog_server_print_menu(stream);
+        return;
+    }
+    if (command == 0 && (client->mode != DDLOG_PROTO_TEXT || strncmp(line, "mode ", 5) == 0)){
+        mode = client->mode;
+        if (ddlog_proto_handle_command(stream, &client->mode, line)){
+            client->closing = 1;
+        } else if (mode != DDLOG_PROTO_TEXT && client->mode == DDLOG_PROTO_TEXT){
+            ddlog_server_print_menu(stream);
+        }
+        return;
+    }
+    if (command){
+        switch (command) {
             case '2':
-                ddlog_server_print_cmd_header(stream, "Set the active buffer");
-                fprintf(stream, "Buffer id: ");
-                fflush(stream);
-                res = read_line(socket, answer, sizeof(answer));
-                if (res > 0) {
+                if (line[0] != '\0') {
                     char* tail = NULL;
                     long int selected = 0;
                     errno = 0;
-                    selected = strtol(answer, &tail, 0);
+                    selected = strtol(line, &tail, 0);
                     if (errno){
                         fprintf(stream, "Error. Fallback to the default buffer.\n");
-                        active_buffer = 0;
+                        client->active_buffer = 0;
                     } else {
-                        active_buffer = (int) selected;
-                        fprintf(stream, "The active buffer now is %d\n", active_buffer);
+                        client->active_buffer = (int) selected;
+                        fprintf(stream, "The active buffer now is %d\n", client->active_buffer);
                     }
                 }
-                ddlog_server_print_cmd_footer(stream);
-                break;
-            case '3':
-                ddlog_server_print_cmd_header(stream, "Show logs from buffer");
-                fprintf(stream, "Active buffer: %d\n\n", active_buffer);
-                ddlog_display_print_buffer_id(stream, active_buffer);
-                ddlog_server_print_cmd_footer(stream);
-                break;
-            case '4':
-                ddlog_server_print_cmd_header(stream, "Show logs from all buffers");
-                ddlog_display_print_all_buffers(stream);
-                ddlog_server_print_cmd_footer(stream);
                 break;
-            case '5':
-                ddlog_server_print_cmd_header(stream, "Reset the active buffer");
-                ddlog_reset_buffer_id(active_buffer);
-                fprintf(stream, "Active buffer: %d\n\n", active_buffer);
-                fprintf(stream, "Reset has been completed.\n");
-                ddlog_server_print_cmd_footer(stream);
-                break;
-            case '6':
-                ddlog_server_print_cmd_header(stream, "Reset all log buffers");
-                for (j = 0; j < max_buf_num; j++){
-                    ddlog_reset_buffer_id(j);
+            case 'g':
+                if (ddlog_query_parse_internal(&ddlog_server_query, line, error, sizeof(error)) != DDLOG_RET_OK){
+                    fprintf(stream, "%s\n", error);
+                    break;
                 }
-                fprintf(stream, "Reset has been completed.\n");
-                ddlog_server_print_cmd_footer(stream);
-                break;
-            case '7':
-                ddlog_server_print_cmd_header(stream, "Enable/Disable logging");
-                ddlog_toggle_status();
-                fprintf(stream, "Current logging state: %s\n", ddlog_get_status() ? "Enabled" : "Disabled");
-                ddlog_server_print_cmd_footer(stream);
+                fprintf(stream, "\n");
+                res = ddlog_display_print_query(stream, client->active_buffer, &ddlog_server_query);
+                fprintf(stream, "\n%d matching event(s)\n", res);
+                ddlog_query_free_internal(&ddlog_server_query);
                 break;
-            case '8':
-                loop = 0;
-                stop_server = 1;
+            case 'c':
+                trim_line(line);
+                ddlog_display_print_callsites(stream, line);
                 break;
-            case 'q':
-                loop = 0;
+            case 'e':
+            case 'd':
+                trim_line(line);
+                if (line[0] != '\0') {
+                    if (command == 'e') {
+                        res = ddlog_callsite_enable(line);
+                    } else {
+                        res = ddlog_callsite_disable(line);
+                    }
+                    fprintf(stream, "%d callsite(s) %s\n", res, command == 'e' ? "enabled" : "disabled");
+                }
                 break;
             default:
                 break;
         }
+        ddlog_server_print_cmd_footer(stream);
+        ddlog_server_print_menu(stream);
+        return;
     }
-    if (stream){
+
+    switch (line[0]) {
+        case '1':
+            ddlog_server_print_cmd_header(stream, "List log buffers");
+            fprintf(stream, "Active buffer: %d\n\n", client->active_buffer);
+            ddlog_display_print_buffer_list(stream);
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case '2':
+            ddlog_server_print_cmd_header(stream, "Set the active buffer");
+            fprintf(stream, "Buffer id: ");
+            client->pending = '2';
+            return;
+        case '3':
+            ddlog_server_print_cmd_header(stream, "Show logs from buffer");
+            fprintf(stream, "Active buffer: %d\n\n", client->active_buffer);
+            ddlog_display_print_buffer_id(stream, client->active_buffer);
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case '4':
+            ddlog_server_print_cmd_header(stream, "Show logs from all buffers");
+            ddlog_display_print_all_buffers(stream);
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case 'p':
+            ddlog_server_print_cmd_header(stream, "Drain the active buffer");
+            fprintf(stream, "Active buffer: %d\n\n", client->active_buffer);
+            res = ddlog_drain_buffer_id(client->active_buffer, stream);
+            if (res >= 0) {
+                fprintf(stream, "\n%d event(s) consumed\n", res);
+            } else {
+                fprintf(stream, "The buffer could not be drained.\n");
+            }
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case 'f':
+            ddlog_server_print_cmd_header(stream, "Follow the active buffer");
+            fprintf(stream, "Active buffer: %d\n\n", client->active_buffer);
+            if (client->follow == NULL){
+                client->follow = malloc(sizeof(ddlog_buffer_iter_t));
+            }
+            buffer = ddlog_internal_get_buffer_by_id(client->active_buffer);
+            if (client->follow == NULL || buffer == NULL){
+                fprintf(stream, "The buffer could not be followed.\n");
+                ddlog_server_print_cmd_footer(stream);
+                break;
+            }
+            ddlog_iter_follow_init_internal(client->follow, buffer);
+            fprintf(stream, "Press enter to stop.\n\n");
+            client->following = 1;
+            ddlog_server_follower_num++;
+            return;
+        case '5':
+            ddlog_server_print_cmd_header(stream, "Reset the active buffer");
+            ddlog_reset_buffer_id(client->active_buffer);
+            fprintf(stream, "Active buffer: %d\n\n", client->active_buffer);
+            fprintf(stream, "Reset has been completed.\n");
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case '6':
+            ddlog_server_print_cmd_header(stream, "Reset all log buffers");
+            for (j = 0; j < ddlog_internal_get_max_buf_num(); j++){
+                ddlog_reset_buffer_id(j);
+            }
+            fprintf(stream, "Reset has been completed.\n");
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case '7':
+            ddlog_server_print_cmd_header(stream, "Enable/Disable logging");
+            ddlog_toggle_status();
+            fprintf(stream, "Current logging state: %s\n", ddlog_get_status() ? "Enabled" : "Disabled");
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case '8':
+            stop_server = 1;
+            client->closing = 1;
+            return;
+        case '9':
+            ddlog_server_print_cmd_header(stream, "List threads");
+            ddlog_display_print_thread_list(stream);
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case 's':
+            ddlog_server_print_cmd_header(stream, "Buffer statistics");
+            ddlog_display_print_stats(stream);
+            ddlog_server_print_cmd_footer(stream);
+            break;
+        case 'g':
+            ddlog_server_print_cmd_header(stream, "Query the active buffer");
+            fprintf(stream, "Active buffer: %d\n\n", client->active_buffer);
+            fprintf(stream, "Terms: thread=name function=name line=N[-M] from=T to=T (seconds since the epoch, -seconds ago)\n");
+            fprintf(stream, "       msg=\"text\" re=\"regex\" ext=type limit=N\n");
+            fprintf(stream, "Query: ");
+            client->pending = 'g';
+            return;
+        case 'c':
+            ddlog_server_print_cmd_header(stream, "List callsites");
+            fprintf(stream, "Pattern (function, file or file:line, empty for all): ");
+            client->pending = 'c';
+            return;
+        case 'e':
+        case 'd':
+            ddlog_server_print_cmd_header(stream, line[0] == 'e' ? "Enable callsites" : "Disable callsites");
+            fprintf(stream, "Pattern (function, file or file:line): ");
+            client->pending = line[0];
+            return;
+        case 'q':
+            client->closing = 1;
+            return;
+        default:
+            break;
+    }
+    ddlog_server_print_menu(stream);
+}
+
+/**
+ * \brief Executes the complete input lines of a client
+ *
+ * Stops at the first command whose output cannot be sent at once, the
+ * rest of the input is processed when the output queue is empty.
+ *
+ * \return 0 on success, -1 if the connection is broken
+ */
+static int ddlog_server_process_input(ddlog_server_client_t* client){
+    char line[DDLOG_SERVER_LINE_LEN];
+    char* newline = NULL;
+    char* data = NULL;
+    size_t len = 0, size = 0;
+    FILE* stream = NULL;
+
+    while (client->out_head == NULL && !client->closing){
+        newline = memchr(client->input, '\n', client->input_len);
+        if (newline == NULL){
+            if (client->input_len == sizeof(client->input)){
+                /* too long line, dropped */
+                client->input_len = 0;
+                client->discard = 1;
+            }
+            break;
+        }
+        len = newline - client->input;
+        memcpy(line, client->input, len);
+        line[len] = '\0';
+        client->input_len -= len + 1;
+        memmove(client->input, newline + 1, client->input_len);
+
+        if (memchr(line, 0xff, len)){
+            /* telnet IAC, the user pressed CTRL-C */
+            client->closing = 1;
+            break;
+        }
+        if (client->discard){
+            client->discard = 0;
+            continue;
+        }
+
+        stream = open_memstream(&data, &size);
+        if (stream == NULL){
+            return -1;
+        }
+        ddlog_server_handle_line(client, line, stream);
         fclose(stream);
+        ddlog_server_queue(client, data, size);
+        data = NULL;
+        if (ddlog_server_flush(client) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Sends the events written into the followed buffer since the last step
+ *
+ * Nothing is read while the client has queued output, the events
+ * overwritten in the meantime are reported as lost at the next step.
+ *
+ * \return 0 on success, -1 if the connection is broken
+ */
+static int ddlog_server_follow(ddlog_server_client_t* client){
+    ddlog_buffer_iter_t* iter = client->follow;
+    char* data = NULL;
+    size_t size = 0;
+    FILE* stream = NULL;
+    int i = 0;
+
+    if (!client->following || client->out_head){
+        return 0;
+    }
+    if (ddlog_iter_follow_internal(iter, ddlog_internal_get_buffer_by_id(client->active_buffer)) != DDLOG_RET_OK){
+        return 0;
+    }
+
+    stream = open_memstream(&data, &size);
+    if (stream == NULL){
+        return -1;
+    }
+    for (i = 0; i < DDLOG_SERVER_FOLLOW_BATCH; i++){
+        if (ddlog_iter_next_internal(iter, &ddlog_server_record) != DDLOG_RET_OK){
+            break;
+        }
+        if (iter->lost){
+            fprintf(stream, "*** %llu event(s) lost, the client fell behind ***\n", (unsigned long long) iter->lost);
+            iter->lost = 0;
+        }
+        ddlog_display_event(stream, &ddlog_server_record);
+    }
+    if (iter->lost){
+        fprintf(stream, "*** %llu event(s) lost, the client fell behind ***\n", (unsigned long long) iter->lost);
+        iter->lost = 0;
+    }
+    fclose(stream);
+    ddlog_server_queue(client, data, size);
+    return ddlog_server_flush(client);
+}
+
+/**
+ * \brief Registers the socket of a client for the events it is waiting for
+ *
+ * The client is written while it has queued output and read otherwise.
+ */
+static int ddlog_server_update_events(ddlog_server_client_t* client){
+    struct epoll_event event;
+    uint32_t events = client->out_head ? EPOLLOUT : EPOLLIN;
+
+    if (events == client->events){
+        return 0;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = client;
+    client->events = events;
+    return epoll_ctl(ddlog_server_epoll, EPOLL_CTL_MOD, client->socket, &event);
+}
+
+static void ddlog_server_close_client(ddlog_server_client_t* client){
+    ddlog_server_chunk_t* chunk = NULL;
+
+    if (client->prev){
+        client->prev->next = client->next;
+    } else {
+        ddlog_server_clients = client->next;
+    }
+    if (client->next){
+        client->next->prev = client->prev;
+    }
+    if (client->following){
+        ddlog_server_follower_num--;
+    }
+    free(client->follow);
+    epoll_ctl(ddlog_server_epoll, EPOLL_CTL_DEL, client->socket, NULL);
+    if (close(client->socket) < 0){
+        fprintf(stderr, "ddlog_server: Error closing client socket\n");
+    }
+    while ((chunk = client->out_head) != NULL){
+        client->out_head = chunk->next;
+        free(chunk->data);
+        free(chunk);
+    }
+    free(client);
+    ddlog_server_client_num--;
+}
+
+/**
+ * \brief Accepts the pending connections
+ */
+static void ddlog_server_accept(int server_sock){
+    ddlog_server_client_t* client = NULL;
+    struct epoll_event event;
+    char* data = NULL;
+    size_t size = 0;
+    FILE* stream = NULL;
+    int conn_sock = -1;
+
+    while ((conn_sock = accept(server_sock, NULL, NULL)) >= 0){
+        if (ddlog_server_client_num >= DDLOG_SERVER_MAX_CLIENTS){
+            fprintf(stderr, "ddlog_server: Too many connections\n");
+            close(conn_sock);
+            continue;
+        }
+        client = calloc(1, sizeof(ddlog_server_client_t));
+        if (client == NULL || fcntl(conn_sock, F_SETFL, fcntl(conn_sock, F_GETFL) | O_NONBLOCK) < 0){
+            free(client);
+            close(conn_sock);
+            continue;
+        }
+        client->socket = conn_sock;
+        client->events = EPOLLIN;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        if (epoll_ctl(ddlog_server_epoll, EPOLL_CTL_ADD, conn_sock, &event) < 0){
+            free(client);
+            close(conn_sock);
+            continue;
+        }
+        ddlog_server_client_num++;
+        client->next = ddlog_server_clients;
+        if (ddlog_server_clients){
+            ddlog_server_clients->prev = client;
+        }
+        ddlog_server_clients = client;
+
+        stream = open_memstream(&data, &size);
+        if (stream){
+            fprintf(stream, "%s", welcome_msg);
+            ddlog_server_print_menu(stream);
+            fclose(stream);
+            ddlog_server_queue(client, data, size);
+            data = NULL;
+        }
+        if (ddlog_server_flush(client) < 0 || ddlog_server_update_events(client) < 0){
+            fprintf(stderr, "ddlog_server: write error\n");
+            ddlog_server_close_client(client);
+        }
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        fprintf(stderr, "ddlog_server: Error calling accept()\n");
+    }
+}
+
+/**
+ * \brief Handles the events of a client socket
+ */
+static void ddlog_server_handle_client(ddlog_server_client_t* client, uint32_t events){
+    ssize_t res = 0;
+
+    if (events & EPOLLOUT){
+        if (ddlog_server_flush(client) < 0 || ddlog_server_follow(client) < 0){
+            ddlog_server_close_client(client);
+            return;
+        }
+    } else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        res = read(client->socket, client->input + client->input_len, sizeof(client->input) - client->input_len);
+        if (res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+            ddlog_server_close_client(client);
+            return;
+        }
+        if (res > 0){
+            if (client->discard){
+                /* the rest of a too long line */
+                char* newline = memchr(client->input, '\n', res);
+                if (newline == NULL){
+                    res = 0;
+                } else {
+                    client->discard = 0;
+                    res -= newline + 1 - client->input;
+                    memmove(client->input, newline + 1, res);
+                }
+            }
+            client->input_len += res;
+        }
+    }
+
+    if (client->out_head == NULL && ddlog_server_process_input(client) < 0){
+        ddlog_server_close_client(client);
+        return;
+    }
+    if (client->closing && client->out_head == NULL){
+        ddlog_server_close_client(client);
+        return;
+    }
+    if (ddlog_server_update_events(client) < 0){
+        ddlog_server_close_client(client);
     }
 }
 
 void *ddlog_server_handler(void* data UNUSED){
     int server_sock = 0;
-    int conn_sock = 0;
     struct sockaddr_in server_addr;
-    int res = 0;
-    ssize_t write_res = -1;
+    struct epoll_event event;
+    struct epoll_event events[DDLOG_SERVER_MAX_EVENTS];
+    ddlog_server_client_t* client = NULL, *next = NULL;
+    int res = 0, i = 0, event_num = 0;
     char filename[256] = {0};
 
     server_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -245,6 +689,22 @@ void *ddlog_server_handler(void* data UNUSED){
         return NULL;
     }
 
+    ddlog_server_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (ddlog_server_epoll < 0 || fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK) < 0){
+        fprintf(stderr, "ddlog_server: Error creating the epoll instance\n");
+        close(server_sock);
+        return NULL;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(ddlog_server_epoll, EPOLL_CTL_ADD, server_sock, &event) < 0){
+        fprintf(stderr, "ddlog_server: Error creating the epoll instance\n");
+        close(ddlog_server_epoll);
+        close(server_sock);
+        return NULL;
+    }
+
     fprintf(stderr, "ddlog_server: DDLOG server has been started...\n");
     /* Create the flag file containing the prt number we are listening at */
     {
@@ -261,30 +721,38 @@ void *ddlog_server_handler(void* data UNUSED){
         fclose(f);
     }
 
-    while (1){
-        conn_sock = accept(server_sock, NULL, NULL);
-        if (conn_sock < 0){
-            fprintf(stderr, "ddlog_server: Error calling accept()\n");
-            return NULL;
+    while (!stop_server){
+        event_num = epoll_wait(ddlog_server_epoll, events, DDLOG_SERVER_MAX_EVENTS,
+                ddlog_server_follower_num ? DDLOG_SERVER_FOLLOW_INTERVAL_MS : -1);
+        if (event_num < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "ddlog_server: Error calling epoll_wait()\n");
+            break;
         }
-
-        write_res = write(conn_sock, welcome_msg, strlen(welcome_msg));
-        if (write_res < 0){
-            fprintf(stderr, "ddlog_server: write error\n");
-        } else {
-            ddlog_server_handle_connection(conn_sock);
+        for (i = 0; i < event_num && !stop_server; i++){
+            if (events[i].data.ptr == NULL){
+                ddlog_server_accept(server_sock);
+            } else {
+                ddlog_server_handle_client(events[i].data.ptr, events[i].events);
+            }
         }
 
-        res = close(conn_sock);
-        if (res < 0){
-            fprintf(stderr, "ddlog_server: Error closing client socket\n");
-            return NULL;
+        for (client = ddlog_server_clients; client && ddlog_server_follower_num && !stop_server; client = next){
+            next = client->next;
+            if (ddlog_server_follow(client) < 0 || ddlog_server_update_events(client) < 0){
+                ddlog_server_close_client(client);
+            }
         }
+    }
 
-        if (stop_server) {
-            break;
-        }
+    while (ddlog_server_clients){
+        ddlog_server_close_client(ddlog_server_clients);
     }
+    close(ddlog_server_epoll);
+    ddlog_server_epoll = -1;
+    close(server_sock);
     unlink(filename);
     return NULL;
 }
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_snapshot.c
+ * \brief Buffer snapshot implementation
+ *
+ * A snapshot is a point in time copy of log buffers taken without
+ * locking the producers. Each ring (the slot array, the data ring and
+ * the ext arena) is copied with one memcpy into the snapshot arena.
+ * The events changed while being copied are invalidated in the copy,
+ * so the snapshot holds only complete events and it does not change
+ * any more, however fast the live buffers wrap.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_snapshot.h"
+#include "private/ddlog_clock.h"
+
+#define DDLOG_SNAPSHOT_ALIGN(size) (((size) + DDLOG_CACHE_LINE_SIZE - 1) & ~((size_t) DDLOG_CACHE_LINE_SIZE - 1))
+
+/**
+ * \brief Takes a snapshot of one buffer
+ *
+ * \param buffer_id The id of the buffer
+ * \return The snapshot or NULL in case of error. It has to be released
+ *         with ddlog_snapshot_free().
+ *
+ * The shared ring and all the private thread rings of the buffer are copied.
+ */
+ddlog_snapshot_t* ddlog_snapshot_buffer(ddlog_buffer_id_t buffer_id){
+    ddlog_buffer_t* buffers[DDLOG_MAX_BUF_NUM];
+    ddlog_buffer_t* buffer = ddlog_internal_get_buffer_by_id(buffer_id);
+
+    if (buffer == NULL){
+        return NULL;
+    }
+    memset(buffers, 0, sizeof(buffers));
+    buffers[buffer_id] = buffer;
+    return ddlog_snapshot_internal(buffers, DDLOG_MAX_BUF_NUM);
+}
+
+/**
+ * \brief Takes a snapshot of all the buffers
+ *
+ * \return The snapshot or NULL in case of error. It has to be released
+ *         with ddlog_snapshot_free().
+ */
+ddlog_snapshot_t* ddlog_snapshot_all(void){
+    ddlog_buffer_t* buffers[DDLOG_MAX_BUF_NUM];
+    ddlog_buffer_id_t i = 0;
+
+    if (!ddlog_internal_is_lib_inited()){
+        return NULL;
+    }
+    for (i = 0; i < DDLOG_MAX_BUF_NUM; i++){
+        buffers[i] = ddlog_internal_get_buffer_by_id(i);
+    }
+    return ddlog_snapshot_internal(buffers, DDLOG_MAX_BUF_NUM);
+}
+
+/**
+ * \brief Releases a snapshot
+ *
+ * \param snapshot The snapshot to be released
+ */
+void ddlog_snapshot_free(ddlog_snapshot_t* snapshot){
+    if (snapshot){
+        free(snapshot->arena);
+        free(snapshot);
+    }
+}
+
+/**
+ * \brief Returns with the arena size needed by the copy of a ring
+ *
+ * \param ring The ring to be copied
+ * \return The size of the ring structure and the ring memory, cache line aligned
+ */
+size_t ddlog_snapshot_ring_size_internal(const ddlog_buffer_t* ring){
+    return DDLOG_SNAPSHOT_ALIGN(sizeof(ddlog_buffer_t)) +
+        DDLOG_SNAPSHOT_ALIGN(ring->buffer_size * sizeof(ddlog_event_t) + ring->data_size + ring->ext_size);
+}
+
+/**
+ * \brief Copies a ring
+ *
+ * \param copy The ring structure of the copy
+ * \param ring The live ring
+ * \param memory The memory of the copied slots, data ring and ext arena
+ *
+ * The slot array, the data ring and the ext arena are allocated together,
+ * they are copied in one step. The heads are read after the copy: the
+ * records and ext payloads overwritten during the copy are detected by the
+ * readers the same way as in the live ring. The slots changed during the
+ * copy are invalidated.
+ */
+void ddlog_snapshot_ring_internal(ddlog_buffer_t* copy, const ddlog_buffer_t* ring, char* memory){
+    size_t slots_size = ring->buffer_size * sizeof(ddlog_event_t);
+    ddlog_event_t* events = (ddlog_event_t*) memory;
+    size_t i = 0;
+
+    memcpy(copy, ring, sizeof(ddlog_buffer_t));
+    copy->write_seq = ring->write_seq;
+    __sync_synchronize();
+
+    memcpy(memory, ring->events, slots_size + ring->data_size + ring->ext_size);
+    __sync_synchronize();
+
+    copy->data_head = ring->data_head;
+    copy->ext_head = ring->ext_head;
+    for (i = 0; i < ring->buffer_size; i++){
+        if (events[i].seq != ring->events[i].seq){
+            events[i].seq = 0;
+        }
+    }
+
+    copy->events = events;
+    copy->data = memory + slots_size;
+    copy->ext_arena = copy->data + ring->data_size;
+    copy->thread_buffer_num = 0;
+    memset(copy->thread_buffers, 0, sizeof(copy->thread_buffers));
+}
+
+/**
+ * \brief Takes a snapshot of a set of buffers
+ *
+ * \param buffers The buffers to be copied, indexed by the buffer id (NULL if not needed)
+ * \param buffer_num The number of elements in the buffers array
+ * \return The snapshot or NULL in case of error
+ *
+ * The arena is sized for the rings present at the time of the call,
+ * the private rings attached later are not copied.
+ */
+ddlog_snapshot_t* ddlog_snapshot_internal(ddlog_buffer_t** buffers, unsigned int buffer_num){
+    ddlog_snapshot_t* snapshot = NULL;
+    unsigned int ring_num[DDLOG_MAX_BUF_NUM];
+    ddlog_buffer_t* copy = NULL;
+    ddlog_buffer_t* ring_copy = NULL;
+    size_t size = 0, ring_size = 0;
+    char* pos = NULL;
+    unsigned int i = 0, j = 0;
+
+    if (buffer_num > DDLOG_MAX_BUF_NUM){
+        buffer_num = DDLOG_MAX_BUF_NUM;
+    }
+
+    snapshot = (ddlog_snapshot_t*) malloc(sizeof(ddlog_snapshot_t));
+    if (snapshot == NULL){
+        return NULL;
+    }
+    memset(snapshot, 0, sizeof(ddlog_snapshot_t));
+
+    /* size the arena */
+    for (i = 0; i < buffer_num; i++){
+        ring_num[i] = 0;
+        if (buffers[i]){
+            ring_num[i] = buffers[i]->thread_buffer_num;
+            __sync_synchronize();
+            size += ddlog_snapshot_ring_size_internal(buffers[i]);
+            for (j = 0; j < ring_num[i]; j++){
+                size += ddlog_snapshot_ring_size_internal(buffers[i]->thread_buffers[j]);
+            }
+        }
+    }
+    if (size > 0 && posix_memalign(&snapshot->arena, DDLOG_CACHE_LINE_SIZE, size)){
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->arena_size = size;
+    snapshot->timestamp = ddlog_clock_now_internal();
+
+    /* copy the rings */
+    pos = (char*) snapshot->arena;
+    for (i = 0; i < buffer_num; i++){
+        if (buffers[i] == NULL){
+            continue;
+        }
+        ring_size = DDLOG_SNAPSHOT_ALIGN(sizeof(ddlog_buffer_t));
+        copy = (ddlog_buffer_t*) pos;
+        ddlog_snapshot_ring_internal(copy, buffers[i], pos + ring_size);
+        pos += ddlog_snapshot_ring_size_internal(buffers[i]);
+
+        for (j = 0; j < ring_num[i]; j++){
+            ring_copy = (ddlog_buffer_t*) pos;
+            ddlog_snapshot_ring_internal(ring_copy, buffers[i]->thread_buffers[j], pos + ring_size);
+            pos += ddlog_snapshot_ring_size_internal(buffers[i]->thread_buffers[j]);
+            copy->thread_buffers[j] = ring_copy;
+        }
+        copy->thread_buffer_num = ring_num[i];
+        snapshot->buffers[i] = copy;
+    }
+    return snapshot;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_stats.c
+ * \brief Buffer performance counters implementation
+ *
+ * This file contains the aggregation of the sharded ring counters
+ * and the public statistics API.
+ */
+#include <string.h>
+#include <stdint.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_stats.h"
+#include "private/ddlog_clock.h"
+
+/**
+ * \brief Returns with the counters of the default buffer
+ *
+ * \param stats The counters are returned here
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
+ */
+int ddlog_get_stats(ddlog_stats_t* stats){
+    return ddlog_get_stats_buffer_id(ddlog_internal_get_default_buf_id(), stats);
+}
+
+/**
+ * \brief Returns with the counters of a buffer
+ *
+ * \param buffer_id The id of the buffer
+ * \param stats The counters are returned here
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
+ */
+int ddlog_get_stats_buffer_id(ddlog_buffer_id_t buffer_id, ddlog_stats_t* stats){
+    ddlog_buffer_t* buffer = NULL;
+
+    if (stats == NULL || !ddlog_internal_is_lib_inited()){
+        return DDLOG_RET_ERR;
+    }
+    buffer = ddlog_internal_get_buffer_by_id(buffer_id);
+    if (buffer == NULL){
+        return DDLOG_RET_ERR;
+    }
+    ddlog_stats_collect_internal(buffer, stats);
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Sums up the counter shards of a buffer
+ *
+ * \param buffer The buffer
+ * \param stats The sums are returned here
+ *
+ * The shards of the shared ring and of all the private thread rings are
+ * added up. The counters are read without any locking, the result is
+ * not an atomic snapshot of the counters.
+ */
+void ddlog_stats_collect_internal(const ddlog_buffer_t* buffer, ddlog_stats_t* stats){
+    const ddlog_buffer_t* ring = NULL;
+    const ddlog_stats_shard_t* shard = NULL;
+    unsigned int ring_num = 0, i = 0, j = 0;
+    uint64_t spin_ticks = 0;
+
+    memset(stats, 0, sizeof(ddlog_stats_t));
+    ring_num = buffer->thread_buffer_num + 1;
+    __sync_synchronize();
+    for (i = 0; i < ring_num; i++){
+        ring = (i == 0) ? buffer : buffer->thread_buffers[i - 1];
+        for (j = 0; j < DDLOG_STATS_SHARD_NUM; j++){
+            shard = &ring->stats[j];
+            stats->events_written += shard->events_written;
+            stats->bytes_written += shard->bytes_written;
+            stats->wraps += shard->wraps;
+            stats->events_dropped += shard->events_dropped;
+            stats->lock_contended += shard->lock_contended;
+            spin_ticks += shard->lock_spin_ticks;
+        }
+    }
+    stats->lock_spin_ns = (unsigned long long) ((double) spin_ticks * ddlog_clock_calibration.ns_per_tick);
+}
@@ -15,6 +15,7 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <string.h>
+#include <wchar.h>
 
 #include "ddlog.h"
 #include "ddlog_ext.h"
@@ -22,7 +23,13 @@
 #include "private/ddlog_debug.h"
 #include "private/ddlog_display.h"
 #include "private/ddlog_display_debug.h"
+#include "private/ddlog_clock.h"
+#include "private/ddlog_fmt.h"
+#include "private/ddlog_crash.h"
+#include "private/ddlog_logfile.h"
+#include "private/ddlog_query.h"
 
+DDLOG_DEFINE_MODULE();
 
 int start = 0;
 int threads_started = 0;
@@ -293,6 +300,7 @@ void test6(){
 
     DDLOG_BT;
     DDLOG_VA("This is a formatted message: %d, %s, %d", 1023, "alma", 12);
+    DDLOG_FMT("This is a deferred message: %d, %s, %-6.2f|%*d|%lu", 1023, "alma", 3.14159, 5, 12, 99UL);
     ddlog_display_print_buffer(stdout);
     ddlog_cleanup();
 }
@@ -366,8 +374,390 @@ void test10(void){
 
 }
 
+void test11(void){
+    pthread_t thr1, thr2;
+    char* thr1_name = "Thread1";
+    char* thr2_name = "Thread2";
+
+    ddlog_init_per_thread(32);
+    ddlog_thread_init("main thread");
+    test8_run = 1;
+    pthread_create(&thr1, NULL, test8_thr, (void*)thr1_name);
+    pthread_create(&thr2, NULL, test8_thr, (void*)thr2_name);
+    DDLOG("threads started");
+    sleep(1);
+    test8_run = 0;
+    pthread_join(thr1, NULL);
+    pthread_join(thr2, NULL);
+    DDLOG("threads finished");
+    ddlog_display_debug_print_all_buffers(stdout, 1, 0);
+    ddlog_display_print_buffer(stdout);
+    ddlog_cleanup();
+}
+
+void test12(void){
+    struct timespec wall;
+    uint64_t ticks = 0, back = 0;
+    int res = 0;
+
+    printf("invariant TSC: %d\n", ddlog_clock_tsc_invariant_internal());
+    printf("select an invalid source: %d\n", ddlog_set_clock_source((ddlog_clock_source_t) 99));
+    res = ddlog_set_clock_source(DDLOG_CLOCK_TSC);
+    printf("select TSC: %s\n", res == DDLOG_RET_OK ? "ok" : "not available");
+    ddlog_init(16);
+    ddlog_thread_init("main thread");
+    printf("clock source: %s, ns per tick: %f\n",
+            ddlog_clock_source_name_internal(ddlog_clock_calibration.source),
+            ddlog_clock_calibration.ns_per_tick);
+    DDLOG("clock test");
+
+    ticks = ddlog_clock_now_internal();
+    ddlog_clock_to_wall_internal(ticks, &wall);
+    back = ddlog_clock_from_wall_internal((uint64_t) wall.tv_sec * 1000000000ULL + wall.tv_nsec);
+    printf("wall clock round trip error: %lld ticks\n", (long long) (back - ticks));
+    printf("select a source after init: %d\n", ddlog_set_clock_source(DDLOG_CLOCK_MONOTONIC_RAW));
+    ddlog_display_print_buffer(stdout);
+    ddlog_cleanup();
+    ddlog_set_clock_source(DDLOG_CLOCK_MONOTONIC_RAW);
+}
+
+/* packs the arguments like DDLOG_FMT and compares the output with the
+ * expected string, with vsnprintf if expected is NULL */
+int test13_check(const char* expected, const char* format, ...){
+    char packed[256];
+    char printed[256];
+    char message[256];
+    size_t size = 0;
+    va_list args;
+
+    va_start(args, format);
+    size = ddlog_fmt_pack(packed, sizeof(packed), format, args);
+    va_end(args);
+    if (expected == NULL){
+        va_start(args, format);
+        vsnprintf(printed, sizeof(printed), format, args);
+        va_end(args);
+        expected = printed;
+    }
+    ddlog_fmt_format(message, sizeof(message), format, packed, size);
+    printf("%-24s -> [%s] %s\n", format, message, strcmp(message, expected) == 0 ? "ok" : "FAILED");
+    return strcmp(message, expected) == 0;
+}
+
+void test13(void){
+    char unterminated[4] = { 'a', 'b', 'c', 'd' };
+    int failed = 0;
+
+    printf("================================================================================\n");
+    printf(" Test #13 deferred formatting\n");
+    printf("================================================================================\n");
+    failed += !test13_check(NULL, "int %d %i %5d %-5d|", -42, 7, 123, 45);
+    failed += !test13_check(NULL, "unsigned %u %x %#o %X", 42u, 0xbeefu, 8u, 0xabcu);
+    failed += !test13_check(NULL, "long %ld %lld %zu %jd", -1L, 1LL << 40, (size_t) 99, (intmax_t) -5);
+    failed += !test13_check(NULL, "short %hd %hhu", (short) -3, (unsigned char) 200);
+    failed += !test13_check(NULL, "double %f %.2e %g %8.3f", 3.5, 12345.678, 0.0001, -2.25);
+    failed += !test13_check(NULL, "char %c%c %%", 'o', 'k');
+    failed += !test13_check(NULL, "str %s %.2s %-6s|", "alma", "korte", "szilva");
+    failed += !test13_check(NULL, "star %*d %.*s|", 6, 17, 3, "abcdef");
+    failed += !test13_check(NULL, "negative %.*s|", -1, "full");
+    failed += !test13_check(NULL, "unterminated %.4s|", unterminated);
+    failed += !test13_check(NULL, "null %s", (char*) NULL);
+    failed += !test13_check(NULL, "pointer %p", (void*) &failed);
+    /* the wide conversions are not supported, formatting stops at them */
+    failed += !test13_check("wide ", "wide %ls %d", L"wide", 3);
+    failed += !test13_check("wide ", "wide %lc %d", (wint_t) 'w', 3);
+    printf("deferred formatting: %s\n", failed ? "FAILED" : "ok");
+}
+
+/* formats a deferred message with the signal safe formatter */
+int test14_check(const char* expected, const char* format, ...){
+    char packed[256];
+    char message[256];
+    size_t size = 0;
+    va_list args;
+
+    va_start(args, format);
+    size = ddlog_fmt_pack(packed, sizeof(packed), format, args);
+    va_end(args);
+    ddlog_crash_format_message_internal(message, sizeof(message), format, packed, size);
+    printf("%-24s -> [%s] %s\n", format, message, strcmp(message, expected) == 0 ? "ok" : "FAILED");
+    return strcmp(message, expected) == 0;
+}
+
+void test14(void){
+    /* seconds since the epoch and the UTC date, the clock ticks can not
+     * represent the times before the boot */
+    static const struct {
+        uint64_t sec;
+        const char* date;
+    } dates[] = {
+        { 2147483648ULL, "2038-01-19 03:14:08" },
+        { 2214131696ULL, "2040-02-29 12:34:56" },
+        { 4107542399ULL, "2100-02-28 23:59:59" },
+        { 4107542400ULL, "2100-03-01 00:00:00" },
+        { 7263259200ULL, "2200-03-01 12:00:00" },
+    };
+    static ddlog_record_t record;
+    char line[256];
+    int failed = 0, ok = 0;
+    size_t i = 0;
+
+    printf("================================================================================\n");
+    printf(" Test #14 crash dump formatter\n");
+    printf("================================================================================\n");
+    failed += !test14_check("int -42 7 ff 10", "int %d %i %x %o", -42, 7, 255u, 8u);
+    failed += !test14_check("long -1 1099511627776 99", "long %ld %lld %zu", -1L, 1LL << 40, (size_t) 99);
+    failed += !test14_check("short -3 200", "short %hd %hhu", (short) -3, (unsigned char) 200);
+    failed += !test14_check("double 3.500000 -0.250000", "double %f %.2f", 3.5, -0.25);
+    failed += !test14_check("str alma ko|", "str %s %.2s|", "alma", "korte");
+    failed += !test14_check("char ok 100%", "char %c%c %d%%", 'o', 'k', 100);
+    failed += !test14_check("pointer (nil)", "pointer %p", (void*) NULL);
+
+    ddlog_init(16);
+    memset(&record, 0, sizeof(record));
+    record.thread_name = "crash";
+    record.function_name = "test14";
+    record.event.line_number = 42;
+    record.message = "dump";
+    for (i = 0; i < sizeof(dates) / sizeof(dates[0]); i++){
+        /* half a second off the boundary, the tick conversion is not exact */
+        record.event.timestamp = ddlog_clock_from_wall_internal(dates[i].sec * 1000000000ULL + 500000000ULL);
+        ddlog_crash_format_event_internal(&record, line, sizeof(line));
+        ok = strncmp(line, dates[i].date, strlen(dates[i].date)) == 0 &&
+            strstr(line, " [crash:test14:42]: dump") != NULL;
+        printf("%s %s\n", line, ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+    ddlog_cleanup();
+    printf("crash dump formatter: %s\n", failed ? "FAILED" : "ok");
+}
+
+/* compresses and decompresses a buffer */
+int test15_lz(const char* name, const char* data, size_t size){
+    static char compressed[2 * 65536];
+    static char decompressed[65536];
+    size_t compressed_size = 0, decompressed_size = 0;
+    int ok = 0;
+
+    compressed_size = ddlog_lz_compress(data, size, compressed, sizeof(compressed));
+    decompressed_size = ddlog_lz_decompress(compressed, compressed_size, decompressed, sizeof(decompressed));
+    ok = compressed_size > 0 && decompressed_size == size && memcmp(data, decompressed, size) == 0;
+    printf("lz %s: %zu -> %zu bytes %s\n", name, size, compressed_size, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+void test15(void){
+    static char data[65536];
+    char path[64];
+    ddlog_buffer_opt_t opt;
+    ddlog_writer_opt_t writer;
+    ddlog_logfile_t file;
+    ddlog_logfile_cursor_t cursor;
+    ddlog_logfile_event_t event;
+    char message[64];
+    unsigned int count = 0, seq_errors = 0, msg_errors = 0;
+    uint64_t prev_seq = 0;
+    size_t i = 0, block = 0;
+    int failed = 0;
+
+    printf("================================================================================\n");
+    printf(" Test #15 binary log files\n");
+    printf("================================================================================\n");
+    for (i = 0; i < sizeof(data); i++){
+        data[i] = "ddlog event "[i % 12] + (i / 4096);
+    }
+    failed += !test15_lz("text", data, sizeof(data));
+    srand(15);
+    for (i = 0; i < sizeof(data); i++){
+        data[i] = (char) rand();
+    }
+    failed += !test15_lz("random", data, sizeof(data));
+    failed += !test15_lz("empty", data, 0);
+    /* corrupt input must not be decoded past the output buffer */
+    i = ddlog_lz_decompress(data, 4096, data + 8192, 1024);
+    printf("lz corrupt input: %s\n", i <= 1024 ? "ok" : "FAILED");
+    failed += i > 1024;
+
+    snprintf(path, sizeof(path), "/tmp/ddlog_test_%d.bin", (int) getpid());
+    memset(&opt, 0, sizeof(opt));
+    opt.size = 64;
+    opt.overflow = DDLOG_OVERFLOW_BLOCK;
+    opt.block_timeout_ns = 1000000000ULL;
+    ddlog_init_opt(&opt);
+    ddlog_thread_init("writer test");
+    memset(&writer, 0, sizeof(writer));
+    writer.path = path;
+    writer.format = DDLOG_WRITER_FORMAT_BINARY;
+    writer.poll_interval_ms = 1;
+    ddlog_start_writer(&writer);
+    for (i = 0; i < 5000; i++){
+        DDLOG_FMT("event %d", (int) i);
+    }
+    ddlog_stop_writer();
+    ddlog_cleanup();
+
+    if (ddlog_logfile_open_internal(path, &file) != DDLOG_RET_OK){
+        printf("open %s: FAILED\n", path);
+        unlink(path);
+        return;
+    }
+    ddlog_logfile_cursor_init_internal(&cursor, &file);
+    while (ddlog_logfile_cursor_next_internal(&cursor, &event) == DDLOG_RET_OK){
+        snprintf(message, sizeof(message), "event %u", count);
+        if (count > 0 && event.seq != prev_seq + 1){
+            seq_errors++;
+        }
+        if (strcmp(event.message, message) != 0 || event.thread_name == NULL || strncmp(event.thread_name, "writer test/", 12) != 0){
+            msg_errors++;
+        }
+        prev_seq = event.seq;
+        count++;
+    }
+    printf("blocks: %zu, complete: %d, events: %u, sequence errors: %u, message errors: %u %s\n",
+            file.index_num, file.complete, count, seq_errors, msg_errors,
+            file.complete && count == 5000 && seq_errors == 0 && msg_errors == 0 ? "ok" : "FAILED");
+    failed += !(file.complete && count == 5000 && seq_errors == 0 && msg_errors == 0);
+
+    /* the block index finds the block of an event */
+    if (file.index_num > 1){
+        block = ddlog_logfile_find_seq_internal(&file, file.index[1].first_seq + 1);
+        printf("find seq: block %zu %s\n", block, block == 1 ? "ok" : "FAILED");
+        failed += block != 1;
+    }
+    ddlog_logfile_cursor_free_internal(&cursor);
+    ddlog_logfile_close_internal(&file);
+    unlink(path);
+    printf("binary log files: %s\n", failed ? "FAILED" : "ok");
+}
+
+void* test16_thr(void* arg){
+    int i = 0;
+
+    ddlog_thread_init((char*) arg);
+    for (i = 0; i < 10; i++){
+        DDLOG_FMT("%s event %d", (char*) arg, i);
+    }
+    return NULL;
+}
+
+/* runs a query on the default buffer, at most max_copied candidate events may be copied */
+int test16_query(const char* str, unsigned int expected, unsigned int max_copied){
+    ddlog_query_t query;
+    ddlog_buffer_iter_t iter;
+    static ddlog_record_t record;
+    char error[128];
+    unsigned int copied = 0, matched = 0;
+    int res = 0;
+
+    if (ddlog_query_parse_internal(&query, str, error, sizeof(error)) != DDLOG_RET_OK){
+        printf("%-36s -> %s FAILED\n", str, error);
+        return 0;
+    }
+    ddlog_query_iter_init_internal(&query, &iter, ddlog_internal_get_default_buf());
+    while (ddlog_iter_next_internal(&iter, &record) == DDLOG_RET_OK){
+        copied++;
+        if (ddlog_query_match_internal(&query, &record)){
+            matched++;
+        }
+    }
+    ddlog_query_free_internal(&query);
+    res = matched == expected && copied <= max_copied;
+    printf("%-36s -> copied %u, matched %u %s\n", str, copied, matched, res ? "ok" : "FAILED");
+    return res;
+}
+
+void test16(void){
+    static const char* invalid[] = { "thread", "color=red", "line=abc", "line=5-", "from=yesterday", "re=\"(\"", "msg=\"open" };
+    pthread_t thr1, thr2;
+    ddlog_query_t query;
+    char error[128];
+    int failed = 0, res = 0;
+    size_t i = 0;
+
+    printf("================================================================================\n");
+    printf(" Test #16 queries\n");
+    printf("================================================================================\n");
+    for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++){
+        res = ddlog_query_parse_internal(&query, invalid[i], error, sizeof(error));
+        printf("%-36s -> %s %s\n", invalid[i], res == DDLOG_RET_OK ? "accepted" : error, res == DDLOG_RET_OK ? "FAILED" : "ok");
+        if (res == DDLOG_RET_OK){
+            ddlog_query_free_internal(&query);
+            failed++;
+        }
+    }
+
+    ddlog_init(64);
+    ddlog_thread_init("main thread");
+    pthread_create(&thr1, NULL, test16_thr, (void*) "alpha");
+    pthread_join(thr1, NULL);
+    pthread_create(&thr2, NULL, test16_thr, (void*) "beta");
+    pthread_join(thr2, NULL);
+    ddlog_log_long("alpha", "test16", 1, "named alpha");
+    ddlog_log_long("alphabet", "test16", 2, "named alphabet");
+
+    /* the thread filter copies only the ring of the thread and the shared ring */
+    failed += !test16_query("thread=alpha", 11, 12);
+    failed += !test16_query("thread=beta", 10, 12);
+    failed += !test16_query("thread=beta msg=\"event 7\"", 1, 12);
+    failed += !test16_query("function=test16 line=1-2", 2, 2);
+    failed += !test16_query("re=\"^(alpha|beta) event [0-4]$\"", 10, 22);
+    failed += !test16_query("from=-60", 22, 22);
+    failed += !test16_query("to=1", 0, 0);
+    ddlog_cleanup();
+    printf("queries: %s\n", failed ? "FAILED" : "ok");
+}
+
+void test17(void){
+    ddlog_buffer_iter_t iter;
+    static ddlog_record_t record;
+    ddlog_buffer_t* buffer = NULL;
+    char message[32];
+    char long_message[1000];
+    unsigned int count = 0;
+    size_t memory = 0, message_len = 0;
+    int i = 0, ok = 0;
+
+    printf("================================================================================\n");
+    printf(" Test #17 variable length records\n");
+    printf("================================================================================\n");
+    ddlog_init(DDLOG_MAX_EVENT_NUM);
+    for (i = 0; i < 1000; i++){
+        snprintf(message, sizeof(message), "short message %d", i);
+        ddlog_log(message);
+    }
+    buffer = ddlog_internal_get_default_buf();
+    ddlog_iter_init_internal(&iter, buffer);
+    while (ddlog_iter_next_internal(&iter, &record) == DDLOG_RET_OK){
+        count++;
+    }
+    /* the ext arena is not counted, it replaces the allocated ext payloads */
+    memory = buffer->buffer_size * sizeof(ddlog_event_t) + buffer->data_size;
+    ok = count > DDLOG_MAX_EVENT_NUM && memory <= DDLOG_MAX_EVENT_NUM * DDLOG_EVENT_BUDGET_SIZE;
+    printf("%u short events in %zu bytes, budget of %d events: %u bytes %s\n", count, memory,
+            DDLOG_MAX_EVENT_NUM, DDLOG_MAX_EVENT_NUM * DDLOG_EVENT_BUDGET_SIZE, ok ? "ok" : "FAILED");
+
+    /* the formatted messages are truncated only at the record size */
+    memset(long_message, 'x', sizeof(long_message) - 1);
+    long_message[sizeof(long_message) - 1] = '\0';
+    DDLOG_VA("long %s", long_message);
+    ddlog_iter_init_internal(&iter, buffer);
+    while (ddlog_iter_next_internal(&iter, &record) == DDLOG_RET_OK){
+        message_len = record.message ? strlen(record.message) : 0;
+    }
+    printf("long formatted message: %zu characters %s\n", message_len,
+            message_len == sizeof(long_message) + 4 ? "ok" : "FAILED");
+    ok = ok && message_len == sizeof(long_message) + 4;
+    ddlog_cleanup();
+    printf("variable length records: %s\n", ok ? "ok" : "FAILED");
+}
 
 int main(){
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
     test5();
     return 0;
 }
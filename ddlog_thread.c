@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_thread.c
+ * \brief Thread registry implementation
+ *
+ * This file contains the registry mapping the numeric thread ids
+ * stored in the events to the thread names, kernel thread ids and
+ * start times.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "ddlog.h"
+#include "private/ddlog_thread.h"
+#include "private/ddlog_clock.h"
+
+static ddlog_thread_info_t ddlog_threads[DDLOG_MAX_THREAD_NUM];
+static volatile unsigned int ddlog_thread_num = 1; /* id 0 means no thread */
+
+__thread uint16_t ddlog_thread_id = DDLOG_THREAD_ID_NONE;
+
+/**
+ * \brief Registers the calling thread
+ *
+ * \param name The name of the thread (optional)
+ * \return The id of the thread or DDLOG_THREAD_ID_NONE if the registry is full
+ *
+ * A new entry is allocated even if the thread has been registered before
+ * with a different name, the earlier events keep the earlier name.
+ */
+uint16_t ddlog_thread_register_internal(const char* name){
+    const ddlog_thread_info_t* current = NULL;
+    ddlog_thread_info_t* info = NULL;
+    unsigned int id = 0;
+
+    current = ddlog_thread_get_info_internal(ddlog_thread_id);
+    if (current && strncmp(current->name, name ? name : "", sizeof(current->name) - 1) == 0){
+        return ddlog_thread_id;
+    }
+
+    id = __sync_fetch_and_add(&ddlog_thread_num, 1);
+    if (id >= DDLOG_MAX_THREAD_NUM){
+        __sync_fetch_and_sub(&ddlog_thread_num, 1);
+        return DDLOG_THREAD_ID_NONE;
+    }
+
+    info = &ddlog_threads[id];
+    snprintf(info->name, sizeof(info->name), "%s", name ? name : "");
+    info->tid = (pid_t) syscall(SYS_gettid);
+    info->start_time = ddlog_clock_now_internal();
+    __sync_synchronize();
+    info->valid = 1;
+
+    ddlog_thread_id = (uint16_t) id;
+    return ddlog_thread_id;
+}
+
+/**
+ * \brief Returns with the registry entry of a thread
+ *
+ * \param thread_id The id of the thread
+ * \return The registry entry or NULL if the id is not registered
+ */
+const ddlog_thread_info_t* ddlog_thread_get_info_internal(uint16_t thread_id){
+    if (thread_id == DDLOG_THREAD_ID_NONE || thread_id >= DDLOG_MAX_THREAD_NUM ||
+            ddlog_threads[thread_id].valid == 0){
+        return NULL;
+    }
+    return &ddlog_threads[thread_id];
+}
+
+/**
+ * \brief Returns with the upper bound of the registered thread ids
+ */
+unsigned int ddlog_thread_get_num_internal(void){
+    unsigned int num = ddlog_thread_num;
+    return num < DDLOG_MAX_THREAD_NUM ? num : DDLOG_MAX_THREAD_NUM;
+}
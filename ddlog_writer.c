@@ -0,0 +1,528 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_writer.c
+ * \brief Background log file writer implementation
+ *
+ * This file contains the optional writer thread. It consumes the events
+ * of all the buffers (the same way as ddlog_drain_buffer_id()) and
+ * appends them to a log file in batches, one writev() call per batch of
+ * text lines or per block of the binary format (see ddlog_logfile.h).
+ * The logging threads are not involved, they keep logging into the
+ * memory buffers. The log file is rotated by size and by age, a bounded
+ * number of rotated files is kept.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_logfile.h"
+#include "private/ddlog_display.h"
+#include "private/ddlog_fmt.h"
+#include "private/ddlog_clock.h"
+
+#define DDLOG_WRITER_BATCH              64      /* events per writev() call */
+#define DDLOG_WRITER_TEXT_SIZE          (DDLOG_MAX_RECORD_SIZE + 3 * DDLOG_MAX_NAME_LEN)
+#define DDLOG_WRITER_DEFAULT_POLL_MS    100
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024    /* Linux UIO_MAXIOV */
+#endif
+
+/**
+ * \struct ddlog_writer_t
+ * \brief The state of the writer thread.
+ *
+ * A text batch holds the consumed events, the lines formatted from them
+ * and the iovec array pointing to the lines. The binary events are
+ * encoded into the block being built, the block index of the active
+ * file is written into the footer when the file is closed.
+ */
+typedef struct ddlog_writer_t {
+    ddlog_writer_opt_t opt;                     /*!< The options, opt.path points to path */
+    char path[PATH_MAX];                        /*!< The path of the active log file */
+    pthread_t thread;                           /*!< The writer thread */
+    pthread_mutex_t mutex;                      /*!< Protects stop */
+    pthread_cond_t cond;                        /*!< Wakes up the writer thread to stop */
+    int stop;                                   /*!< The writer thread has to exit */
+    int fd;                                     /*!< The active log file or -1 */
+    uint64_t file_size;                         /*!< The size of the active log file */
+    uint64_t file_header_size;                  /*!< The size of the header of the active log file */
+    time_t file_open_time;                      /*!< The time the active log file was opened (monotonic) */
+    unsigned int event_num;                     /*!< The number of events in the batch */
+    uint64_t batch_size;                        /*!< The number of bytes in the batch */
+    ddlog_record_t records[DDLOG_WRITER_BATCH]; /*!< The events of the batch */
+    char text[DDLOG_WRITER_BATCH][DDLOG_WRITER_TEXT_SIZE];  /*!< Text lines or the formatted message (binary) */
+    char thread_name[DDLOG_MAX_NAME_LEN];       /*!< The resolved thread name (binary) */
+    struct iovec iov[DDLOG_WRITER_BATCH];       /*!< The lines of the batch */
+    ddlog_logfile_block_t block;                /*!< The block being built (binary) */
+    uint64_t seq;                               /*!< The sequence number of the next event (binary) */
+    ddlog_logfile_index_t* index;               /*!< The block index of the active file (binary) */
+    size_t index_num;                           /*!< The number of blocks in the active file */
+    size_t index_capacity;                      /*!< The size of the index array */
+} ddlog_writer_t;
+
+static ddlog_writer_t* ddlog_writer = NULL;
+
+static time_t ddlog_writer_now_internal(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/**
+ * \brief Writes an iovec array completely
+ *
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
+ *
+ * The iovec array is modified if the data is written in several calls.
+ */
+static int ddlog_writer_writev_internal(int fd, struct iovec* iov, int iov_num){
+    ssize_t res = 0;
+    size_t done = 0;
+
+    while (iov_num > 0){
+        res = writev(fd, iov, iov_num > IOV_MAX ? IOV_MAX : iov_num);
+        if (res < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return DDLOG_RET_ERR;
+        }
+        done = (size_t) res;
+        while (iov_num > 0 && done >= iov->iov_len){
+            done -= iov->iov_len;
+            iov++;
+            iov_num--;
+        }
+        if (iov_num > 0){
+            iov->iov_base = (char*) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Renames the rotated log files
+ *
+ * path.N-1 is renamed to path.N, ..., path to path.1, path.N (N is
+ * opt.max_files) is overwritten by the rename. Without retention the
+ * active log file is deleted.
+ */
+static void ddlog_writer_shift_files_internal(ddlog_writer_t* writer){
+    char from[PATH_MAX + 16];
+    char to[PATH_MAX + 16];
+    unsigned int i = 0;
+
+    if (writer->opt.max_files == 0){
+        unlink(writer->path);
+        return;
+    }
+    for (i = writer->opt.max_files - 1; i > 0; i--){
+        snprintf(from, sizeof(from), "%s.%u", writer->path, i);
+        snprintf(to, sizeof(to), "%s.%u", writer->path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", writer->path);
+    rename(writer->path, to);
+}
+
+/**
+ * \brief Closes the active log file
+ *
+ * \param writer The writer
+ * \param complete (flag) if not 0 the block index and the footer are
+ *        written into a binary log file
+ */
+static void ddlog_writer_close_file_internal(ddlog_writer_t* writer, int complete){
+    ddlog_logfile_footer_t footer;
+    struct iovec iov[2];
+
+    if (writer->fd < 0){
+        return;
+    }
+    if (complete && writer->opt.format == DDLOG_WRITER_FORMAT_BINARY){
+        memset(&footer, 0, sizeof(footer));
+        footer.index_offset = writer->file_size;
+        footer.index_num = writer->index_num;
+        footer.event_num = writer->index_num ?
+            writer->index[writer->index_num - 1].first_seq + writer->index[writer->index_num - 1].event_num -
+            writer->index[0].first_seq : 0;
+        memcpy(footer.magic, DDLOG_LOGFILE_FOOTER_MAGIC, sizeof(footer.magic));
+        iov[0].iov_base = writer->index;
+        iov[0].iov_len = writer->index_num * sizeof(ddlog_logfile_index_t);
+        iov[1].iov_base = &footer;
+        iov[1].iov_len = sizeof(footer);
+        ddlog_writer_writev_internal(writer->fd, iov, 2);
+    }
+    close(writer->fd);
+    writer->fd = -1;
+    writer->index_num = 0;
+}
+
+/**
+ * \brief Opens a new active log file
+ *
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR in case of error
+ *
+ * The previous log file (also the one of an earlier run) is rotated
+ * first. A binary log file starts with the file header.
+ */
+static int ddlog_writer_open_file_internal(ddlog_writer_t* writer){
+    ddlog_logfile_hdr_t hdr;
+    struct iovec iov;
+
+    ddlog_writer_shift_files_internal(writer);
+    writer->fd = open(writer->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0){
+        return DDLOG_RET_ERR;
+    }
+    writer->file_size = 0;
+    writer->file_header_size = 0;
+    writer->file_open_time = ddlog_writer_now_internal();
+
+    if (writer->opt.format == DDLOG_WRITER_FORMAT_BINARY){
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, DDLOG_LOGFILE_MAGIC, sizeof(hdr.magic));
+        hdr.version = DDLOG_LOGFILE_VERSION;
+        hdr.pid = (int32_t) getpid();
+        hdr.clock = ddlog_clock_calibration;
+        iov.iov_base = &hdr;
+        iov.iov_len = sizeof(hdr);
+        if (ddlog_writer_writev_internal(writer->fd, &iov, 1) != DDLOG_RET_OK){
+            ddlog_writer_close_file_internal(writer, 0);
+            return DDLOG_RET_ERR;
+        }
+        writer->file_size = sizeof(hdr);
+        writer->file_header_size = sizeof(hdr);
+    }
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Opens the active log file or rotates it if it is full or too old
+ *
+ * \param writer The writer
+ * \param size The number of bytes to be written next
+ * \return DDLOG_RET_OK if the log file is open, DDLOG_RET_ERR otherwise
+ *
+ * A file holding no events is not rotated, a batch larger than the size
+ * limit is written into a new file.
+ */
+static int ddlog_writer_prepare_file_internal(ddlog_writer_t* writer, uint64_t size){
+    int rotate = 0;
+
+    if (writer->fd < 0){
+        return ddlog_writer_open_file_internal(writer);
+    }
+    if (writer->file_size > writer->file_header_size){
+        if (writer->opt.max_file_size && writer->file_size + size > writer->opt.max_file_size){
+            rotate = 1;
+        }
+        if (writer->opt.max_file_age &&
+                ddlog_writer_now_internal() - writer->file_open_time >= (time_t) writer->opt.max_file_age){
+            rotate = 1;
+        }
+    }
+    if (rotate){
+        ddlog_writer_close_file_internal(writer, 1);
+        return ddlog_writer_open_file_internal(writer);
+    }
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Writes the block being built into the log file
+ *
+ * The block is emptied also if it can not be written, the events are lost.
+ */
+static void ddlog_writer_write_block_internal(ddlog_writer_t* writer){
+    ddlog_logfile_block_t* block = &writer->block;
+    ddlog_logfile_index_t* index = NULL;
+    const char* payload = NULL;
+    struct iovec iov[2];
+    size_t capacity = 0;
+
+    if (block->hdr.event_num == 0){
+        return;
+    }
+    payload = ddlog_logfile_block_seal_internal(block);
+    iov[0].iov_base = &block->hdr;
+    iov[0].iov_len = sizeof(ddlog_logfile_block_hdr_t);
+    iov[1].iov_base = (void*) payload;
+    iov[1].iov_len = block->hdr.stored_size;
+
+    if (ddlog_writer_prepare_file_internal(writer, iov[0].iov_len + iov[1].iov_len) == DDLOG_RET_OK){
+        if (writer->index_num == writer->index_capacity){
+            capacity = writer->index_capacity ? 2 * writer->index_capacity : 64;
+            index = realloc(writer->index, capacity * sizeof(ddlog_logfile_index_t));
+            if (index){
+                writer->index = index;
+                writer->index_capacity = capacity;
+            }
+        }
+        if (writer->index_num < writer->index_capacity){
+            index = &writer->index[writer->index_num];
+            memset(index, 0, sizeof(ddlog_logfile_index_t));
+            index->offset = writer->file_size;
+            index->first_seq = block->hdr.first_seq;
+            index->min_timestamp = block->hdr.min_timestamp;
+            index->max_timestamp = block->hdr.max_timestamp;
+            index->event_num = block->hdr.event_num;
+            if (ddlog_writer_writev_internal(writer->fd, iov, 2) == DDLOG_RET_OK){
+                writer->file_size += iov[0].iov_len + iov[1].iov_len;
+                writer->index_num++;
+            } else {
+                /* start a new file at the next block, the readers recover the blocks written */
+                ddlog_writer_close_file_internal(writer, 0);
+            }
+        }
+    }
+    ddlog_logfile_block_reset_internal(block, writer->seq);
+}
+
+/**
+ * \brief Adds the last consumed event to the batch or to the block
+ *
+ * \param writer The writer
+ * \param buffer_id The id of the buffer the event was consumed from
+ */
+static void ddlog_writer_add_event_internal(ddlog_writer_t* writer, ddlog_buffer_id_t buffer_id){
+    const ddlog_record_t* record = &writer->records[writer->event_num];
+    char* text = writer->text[writer->event_num];
+    const char* thread_name = record->thread_name;
+    const char* message = NULL;
+    size_t len = 0;
+
+    if (writer->opt.format == DDLOG_WRITER_FORMAT_TEXT){
+        ddlog_display_format_event_str(record, text, DDLOG_WRITER_TEXT_SIZE - 1);
+        len = strlen(text);
+        text[len++] = '\n';
+        writer->iov[writer->event_num].iov_base = text;
+        writer->iov[writer->event_num].iov_len = len;
+        writer->batch_size += len;
+        writer->event_num++;
+        return;
+    }
+
+    message = ddlog_fmt_record_message(record, text, DDLOG_WRITER_TEXT_SIZE);
+    if (thread_name == NULL){
+        ddlog_display_format_thread(writer->thread_name, sizeof(writer->thread_name), record);
+        thread_name = writer->thread_name;
+    }
+    if (ddlog_logfile_block_add_internal(&writer->block, record, buffer_id, thread_name, message) != DDLOG_RET_OK){
+        ddlog_writer_write_block_internal(writer);
+        ddlog_logfile_block_add_internal(&writer->block, record, buffer_id, thread_name, message);
+    }
+    writer->seq++;
+    if (ddlog_logfile_block_size_internal(&writer->block) >= DDLOG_LOGFILE_BLOCK_SIZE){
+        ddlog_writer_write_block_internal(writer);
+    }
+}
+
+/**
+ * \brief Writes the batch into the log file
+ *
+ * The batch is emptied also if it can not be written, the events are lost.
+ */
+static void ddlog_writer_flush_internal(ddlog_writer_t* writer){
+    if (writer->event_num == 0){
+        return;
+    }
+    if (ddlog_writer_prepare_file_internal(writer, writer->batch_size) == DDLOG_RET_OK){
+        if (ddlog_writer_writev_internal(writer->fd, writer->iov, writer->event_num) == DDLOG_RET_OK){
+            writer->file_size += writer->batch_size;
+        } else {
+            /* start a new file at the next batch */
+            ddlog_writer_close_file_internal(writer, 0);
+        }
+    }
+    writer->event_num = 0;
+    writer->batch_size = 0;
+}
+
+/**
+ * \brief Consumes and writes the events of all the buffers
+ *
+ * \param writer The writer
+ * \return The number of events written
+ *
+ * The buffers being drained by ddlog_drain_buffer_id() are skipped
+ * in this pass. Nothing is consumed while the log file can not be opened.
+ */
+static unsigned int ddlog_writer_drain_internal(ddlog_writer_t* writer){
+    ddlog_buffer_t* buffer = NULL;
+    ddlog_buffer_id_t id = 0;
+    unsigned int num = 0;
+
+    if (ddlog_writer_prepare_file_internal(writer, 0) != DDLOG_RET_OK){
+        return 0;
+    }
+    for (id = 0; id < DDLOG_MAX_BUF_NUM; id++){
+        buffer = ddlog_internal_get_buffer_by_id(id);
+        if (buffer == NULL || __sync_lock_test_and_set(&buffer->draining, 1)){
+            continue;
+        }
+        while (ddlog_drain_next_internal(buffer, &writer->records[writer->event_num]) == DDLOG_RET_OK){
+            ddlog_writer_add_event_internal(writer, id);
+            num++;
+            if (writer->event_num == DDLOG_WRITER_BATCH){
+                ddlog_writer_flush_internal(writer);
+            }
+        }
+        __sync_lock_release(&buffer->draining);
+    }
+    ddlog_writer_flush_internal(writer);
+    return num;
+}
+
+/**
+ * \brief The writer thread
+ *
+ * Drains the buffers until it is stopped, waits poll_interval_ms
+ * between the passes finding no events. The binary block being built
+ * is written before waiting. The events logged before
+ * ddlog_stop_writer() are written before the thread exits.
+ */
+static void* ddlog_writer_handler(void* arg){
+    ddlog_writer_t* writer = (ddlog_writer_t*) arg;
+    struct timespec deadline;
+    unsigned int num = 0;
+    int stop = 0;
+
+    while (1){
+        pthread_mutex_lock(&writer->mutex);
+        stop = writer->stop;
+        pthread_mutex_unlock(&writer->mutex);
+
+        num = ddlog_writer_drain_internal(writer);
+        if (stop){
+            break;
+        }
+        if (num > 0){
+            continue;
+        }
+
+        /* the buffers are empty, the partial block is not kept back */
+        ddlog_writer_write_block_internal(writer);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += writer->opt.poll_interval_ms / 1000;
+        deadline.tv_nsec += (long) (writer->opt.poll_interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&writer->mutex);
+        if (!writer->stop){
+            pthread_cond_timedwait(&writer->cond, &writer->mutex, &deadline);
+        }
+        pthread_mutex_unlock(&writer->mutex);
+    }
+    ddlog_writer_write_block_internal(writer);
+    ddlog_writer_close_file_internal(writer, 1);
+    return NULL;
+}
+
+/**
+ * \brief Starts the background log file writer
+ *
+ * \param opt The writer options
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ALREADY_INITED if the writer
+ *         is running, DDLOG_RET_ERR in case of error
+ *
+ * The writer thread consumes the events of all the buffers and appends
+ * them to opt->path. An existing log file is rotated first. The file is
+ * rotated when the next batch or block would make it larger than max_file_size or
+ * when it is older than max_file_age seconds, the rotated files are
+ * renamed to path.1 ... path.max_files, the older ones are deleted.
+ */
+int ddlog_start_writer(const ddlog_writer_opt_t* opt){
+    ddlog_writer_t* writer = NULL;
+    pthread_condattr_t cond_attr;
+
+    if (opt == NULL || opt->path == NULL || strlen(opt->path) >= PATH_MAX || !ddlog_internal_is_lib_inited()){
+        return DDLOG_RET_ERR;
+    }
+    if (opt->format != DDLOG_WRITER_FORMAT_TEXT && opt->format != DDLOG_WRITER_FORMAT_BINARY){
+        return DDLOG_RET_ERR;
+    }
+    if (ddlog_writer){
+        return DDLOG_RET_ALREADY_INITED;
+    }
+
+    writer = calloc(1, sizeof(ddlog_writer_t));
+    if (writer == NULL){
+        return DDLOG_RET_ERR;
+    }
+    writer->opt = *opt;
+    strcpy(writer->path, opt->path);
+    writer->opt.path = writer->path;
+    if (writer->opt.poll_interval_ms == 0){
+        writer->opt.poll_interval_ms = DDLOG_WRITER_DEFAULT_POLL_MS;
+    }
+    writer->fd = -1;
+    if (writer->opt.format == DDLOG_WRITER_FORMAT_BINARY &&
+            ddlog_logfile_block_init_internal(&writer->block) != DDLOG_RET_OK){
+        free(writer);
+        return DDLOG_RET_ERR;
+    }
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writer->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    if (pthread_create(&writer->thread, NULL, ddlog_writer_handler, writer) != 0){
+        pthread_cond_destroy(&writer->cond);
+        pthread_mutex_destroy(&writer->mutex);
+        ddlog_logfile_block_free_internal(&writer->block);
+        free(writer);
+        return DDLOG_RET_ERR;
+    }
+    ddlog_writer = writer;
+    return DDLOG_RET_OK;
+}
+
+/**
+ * \brief Stops the background log file writer
+ *
+ * \return DDLOG_RET_OK on success, DDLOG_RET_ERR if the writer is not running
+ *
+ * Waits until the events logged before the call are written and the
+ * log file is closed.
+ */
+int ddlog_stop_writer(void){
+    ddlog_writer_t* writer = ddlog_writer;
+
+    if (writer == NULL){
+        return DDLOG_RET_ERR;
+    }
+    pthread_mutex_lock(&writer->mutex);
+    writer->stop = 1;
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->thread, NULL);
+
+    ddlog_writer = NULL;
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->mutex);
+    ddlog_logfile_block_free_internal(&writer->block);
+    free(writer->index);
+    free(writer);
+    return DDLOG_RET_OK;
+}
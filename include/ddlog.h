@@ -22,73 +22,371 @@
 #include <execinfo.h>
 
 typedef unsigned char ddlog_buffer_id_t;
+typedef struct ddlog_snapshot_t ddlog_snapshot_t;
 
 #define DDLOG_RET_OK             0
 #define DDLOG_RET_ERR            -1
 #define DDLOG_RET_EVNT_LOCKED    -2
 #define DDLOG_RET_ALREADY_INITED -3
+#define DDLOG_RET_BUF_FULL       -4
 
+/*
+ * Severity levels. The log statements less severe than DDLOG_COMPILE_LEVEL
+ * are compiled out, the rest is filtered at runtime by ddlog_set_level().
+ */
+#define DDLOG_LEVEL_NONE         0
+#define DDLOG_LEVEL_ERROR        1
+#define DDLOG_LEVEL_WARN         2
+#define DDLOG_LEVEL_INFO         3
+#define DDLOG_LEVEL_DEBUG        4
+#define DDLOG_LEVEL_TRACE        5
+
+#ifndef DDLOG_COMPILE_LEVEL
+#define DDLOG_COMPILE_LEVEL DDLOG_LEVEL_TRACE
+#endif
+
+/* The runtime level, DDLOG_LEVEL_NONE if the logging is disabled */
+extern volatile int ddlog_active_level;
+
+/* Checked by the macros before the arguments are evaluated. */
+#define DDLOG_LEVEL_ENABLED(level) __builtin_expect(ddlog_active_level >= (level), 0)
+
+/**
+ * \struct ddlog_callsite_t
+ * \brief Static descriptor of a logging macro expansion.
+ *
+ * Every expansion of the logging macros emits one descriptor into the
+ * DDLOG_CALLSITE_SECTION linker section. The events refer to the
+ * descriptor, the names are not copied into the log buffer.
+ * The descriptors form the callsite registry: every callsite can be
+ * disabled individually and counts the events it has stored.
+ * The hit counter is updated by every stored event of the callsite, it is kept
+ * on its own cache line so the updates do not invalidate the line of
+ * the enable bit read by all the threads passing the callsite.
+ */
+#define DDLOG_CALLSITE_ALIGN 64
+
+typedef struct ddlog_callsite_t {
+    const char* function;       /*!< The name of the function */
+    const char* file;           /*!< The source file name */
+    const char* format;         /*!< The format string of DDLOG_FMT or NULL */
+    unsigned int line;          /*!< The line number in the source file */
+    unsigned int level;         /*!< The severity level (DDLOG_LEVEL_*) */
+    volatile int enabled;       /*!< The callsite is enabled, checked before the arguments are evaluated */
+    volatile unsigned long long hits __attribute__ ((aligned (DDLOG_CALLSITE_ALIGN))); /*!< Number of events stored by the callsite, the dropped ones are not counted */
+} __attribute__ ((aligned (DDLOG_CALLSITE_ALIGN))) ddlog_callsite_t;
+
+#define DDLOG_CALLSITE_SECTION "ddlog_callsites"
+
+#define DDLOG_CALLSITE(name, level, format_str)                                 \
+    static ddlog_callsite_t name                                                \
+        __attribute__ ((section (DDLOG_CALLSITE_SECTION), used,                 \
+                        aligned (DDLOG_CALLSITE_ALIGN))) =                      \
+        { __FUNCTION__, __FILE__, format_str, __LINE__, level, 1, 0 }
+
+#define DDLOG_CALLSITE_ENABLED(name) __builtin_expect((name).enabled, 1)
+
+int ddlog_register_callsites(ddlog_callsite_t* start, ddlog_callsite_t* stop);
+int ddlog_unregister_callsites(ddlog_callsite_t* start, ddlog_callsite_t* stop);
+
+/* the extended event macros emit callsites too */
 #include "ddlog_ext.h"
 
+/*
+ * Every module (executable or shared object) using the logging macros
+ * registers its callsite section at load time by placing
+ * DDLOG_DEFINE_MODULE(); into exactly one of its source files. The section
+ * bounds are provided by the linker, they are NULL if the module has no
+ * callsites. The events of a module not defined this way are logged as
+ * usual, only its callsites can not be listed, enabled or disabled.
+ *
+ * The section is unregistered when the module is unloaded (dlclose()).
+ * Unloading a module while the events it has logged are still in a buffer
+ * is not supported: the events point to the callsites and the format
+ * strings of the module, reading them after the module is unmapped (dump,
+ * query, follow, background writer, crash dump) crashes the process.
+ * Call ddlog_reset() before dlclose() if the module has logged any event.
+ */
+#define DDLOG_DEFINE_MODULE()                                                   \
+    extern ddlog_callsite_t __start_ddlog_callsites[]                           \
+        __attribute__ ((weak, visibility ("hidden")));                          \
+    extern ddlog_callsite_t __stop_ddlog_callsites[]                            \
+        __attribute__ ((weak, visibility ("hidden")));                          \
+    static void ddlog_register_module_callsites(void)                           \
+        __attribute__ ((constructor, used));                                    \
+    static void ddlog_register_module_callsites(void){                          \
+        ddlog_register_callsites(__start_ddlog_callsites, __stop_ddlog_callsites); \
+    }                                                                           \
+    static void ddlog_unregister_module_callsites(void)                         \
+        __attribute__ ((destructor, used));                                     \
+    static void ddlog_unregister_module_callsites(void){                        \
+        ddlog_unregister_callsites(__start_ddlog_callsites, __stop_ddlog_callsites); \
+    }                                                                           \
+    extern int ddlog_module_defined
+
+/**
+ * \enum ddlog_overflow_policy_t
+ * \brief What happens to a new event when the buffer is full.
+ *
+ * A buffer is full if the events not yet consumed by ddlog_drain_buffer_id()
+ * or by the background writer (see ddlog_start_writer()) occupy all the
+ * slots or all the data space.
+ */
+typedef enum ddlog_overflow_policy_t {
+    DDLOG_OVERFLOW_OVERWRITE = 0,   /*!< Overwrite the oldest event (default) */
+    DDLOG_OVERFLOW_DROP_NEW,        /*!< Drop the new event */
+    DDLOG_OVERFLOW_BLOCK            /*!< Wait for the drainer, drop the new event after the timeout */
+} ddlog_overflow_policy_t;
+
+/**
+ * \struct ddlog_buffer_opt_t
+ * \brief Options of ddlog_create_buffer_opt().
+ */
+typedef struct ddlog_buffer_opt_t {
+    size_t size;                            /*!< The size of the buffer in log messages, it holds more of the short ones (see ddlog_init()) */
+    int per_thread;                         /*!< The buffer has private thread rings */
+    ddlog_overflow_policy_t overflow;       /*!< The overflow policy */
+    unsigned long long block_timeout_ns;    /*!< The maximum wait of DDLOG_OVERFLOW_BLOCK */
+    const char* path;                       /*!< Place the buffer in this file (flight recorder) or NULL */
+} ddlog_buffer_opt_t;
+
+/**
+ * \struct ddlog_stats_t
+ * \brief Performance counters of a log buffer.
+ *
+ * The counters are summed over the shared ring and the private thread
+ * rings of the buffer. They count from the creation of the buffer,
+ * ddlog_reset() does not clear them.
+ */
+typedef struct ddlog_stats_t {
+    unsigned long long events_written;  /*!< Number of events stored */
+    unsigned long long bytes_written;   /*!< Bytes stored in the data rings and the ext arenas */
+    unsigned long long wraps;           /*!< Number of ring wraps */
+    unsigned long long events_dropped;  /*!< Number of events dropped because the slot was locked */
+    unsigned long long lock_contended;  /*!< Number of times the buffer lock was found taken */
+    unsigned long long lock_spin_ns;    /*!< Time spent spinning on the buffer lock */
+} ddlog_stats_t;
+
+/**
+ * \enum ddlog_writer_format_t
+ * \brief The log file formats of the background writer.
+ */
+typedef enum ddlog_writer_format_t {
+    DDLOG_WRITER_FORMAT_TEXT = 0,   /*!< One line per event, same as the ddlog console */
+    DDLOG_WRITER_FORMAT_BINARY      /*!< Compressed event blocks with a block index (see ddlog_logfile.h) */
+} ddlog_writer_format_t;
+
+/**
+ * \struct ddlog_writer_opt_t
+ * \brief Options of ddlog_start_writer().
+ */
+typedef struct ddlog_writer_opt_t {
+    const char* path;                       /*!< The active log file, the rotated files get a .1, .2, ... suffix */
+    ddlog_writer_format_t format;           /*!< The log file format */
+    unsigned long long max_file_size;       /*!< Rotate the file at this size in bytes, 0 for no limit */
+    unsigned int max_file_age;              /*!< Rotate the file after this many seconds, 0 for no limit */
+    unsigned int max_files;                 /*!< The number of rotated files kept */
+    unsigned int poll_interval_ms;          /*!< The wait between the drain passes when the buffers are empty */
+} ddlog_writer_opt_t;
+
+/**
+ * \enum ddlog_clock_source_t
+ * \brief The clock sources of the event timestamps.
+ */
+typedef enum ddlog_clock_source_t {
+    DDLOG_CLOCK_MONOTONIC_RAW = 0,   /*!< clock_gettime(CLOCK_MONOTONIC_RAW), default */
+    DDLOG_CLOCK_MONOTONIC_COARSE,    /*!< clock_gettime(CLOCK_MONOTONIC_COARSE), cheapest, tick resolution */
+    DDLOG_CLOCK_TSC                  /*!< The CPU time stamp counter (x86 only, needs invariant TSC) */
+} ddlog_clock_source_t;
+
+int ddlog_set_clock_source(ddlog_clock_source_t source);
 int ddlog_init(size_t size);
+int ddlog_init_per_thread(size_t size);
+int ddlog_init_opt(const ddlog_buffer_opt_t* opt);
 void ddlog_thread_init(const char* thread_name);
 int ddlog_reset(void);
 int ddlog_reset_buffer_id(ddlog_buffer_id_t buffer_id);
 void ddlog_cleanup(void);
 ddlog_buffer_id_t ddlog_create_buffer(size_t size);
+ddlog_buffer_id_t ddlog_create_buffer_per_thread(size_t size);
+ddlog_buffer_id_t ddlog_create_buffer_opt(const ddlog_buffer_opt_t* opt);
 int ddlog_delete_buffer(ddlog_buffer_id_t buffer_id);
+int ddlog_drain_buffer_id(ddlog_buffer_id_t buffer_id, FILE* stream);
+int ddlog_get_stats(ddlog_stats_t* stats);
+int ddlog_get_stats_buffer_id(ddlog_buffer_id_t buffer_id, ddlog_stats_t* stats);
+int ddlog_start_writer(const ddlog_writer_opt_t* opt);
+int ddlog_stop_writer(void);
+int ddlog_install_crash_handler(int fd);
+void ddlog_uninstall_crash_handler(void);
+ddlog_snapshot_t* ddlog_snapshot_buffer(ddlog_buffer_id_t buffer_id);
+ddlog_snapshot_t* ddlog_snapshot_all(void);
+void ddlog_snapshot_free(ddlog_snapshot_t* snapshot);
 int ddlog_log(const char* message);
 int ddlog_log_id(ddlog_buffer_id_t buffer_id, const char* message);
 int ddlog_log_long(const char* thread, const char* function, unsigned int line_num, const char* message);
 int ddlog_log_long_id(ddlog_buffer_id_t buffer_id, const char* thread, const char* function, unsigned int line_num, const char* message);
+int ddlog_log_fmt(const char* function, unsigned int line_num, const char* format, ...)
+    __attribute__ ((format (printf, 3, 4)));
+int ddlog_log_fmt_id(ddlog_buffer_id_t buffer_id, const char* function, unsigned int line_num, const char* format, ...)
+    __attribute__ ((format (printf, 4, 5)));
+int ddlog_log_cs(ddlog_callsite_t* callsite, const char* message);
+int ddlog_log_fmt_cs(ddlog_callsite_t* callsite, ...);
+int ddlog_log_va_cs(ddlog_callsite_t* callsite, const char* format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+int ddlog_callsite_enable(const char* pattern);
+int ddlog_callsite_disable(const char* pattern);
 void ddlog_toggle_status(void);
+void ddlog_set_level(int level);
+int ddlog_get_level(void);
 int ddlog_get_status(void);
 void ddlog_inc_indent(void);
 void ddlog_dec_indent(void);
 int ddlog_start_server(void);
 void ddlog_wait_for_server(void);
 
-#define DDLOG_VA(format_str, ...)                               \
+#define DDLOG_LOG_LEVEL(level, message)                         \
     do {                                                        \
-        char buffer[256];                                       \
-        memset(buffer, 0, sizeof(buffer));                      \
-        snprintf(buffer, sizeof(buffer) - 1,                    \
-                 format_str, ## __VA_ARGS__);                   \
-        ddlog_log_long(NULL, __FUNCTION__, __LINE__, buffer);   \
+        if (DDLOG_LEVEL_ENABLED(level)) {                       \
+            DDLOG_CALLSITE(ddlog_callsite, level, NULL);        \
+            if (DDLOG_CALLSITE_ENABLED(ddlog_callsite)) {       \
+                ddlog_log_cs(&ddlog_callsite, message);         \
+            }                                                   \
+        }                                                       \
     } while (0);
 
-#define DDLOG(message)                                          \
+#define DDLOG_LOG_LEVEL_VA(level, format_str, ...)              \
     do {                                                        \
-        ddlog_log_long(NULL, __FUNCTION__, __LINE__, message);  \
+        if (DDLOG_LEVEL_ENABLED(level)) {                       \
+            DDLOG_CALLSITE(ddlog_callsite, level, NULL);        \
+            if (DDLOG_CALLSITE_ENABLED(ddlog_callsite)) {       \
+                ddlog_log_va_cs(&ddlog_callsite,                \
+                                format_str, ## __VA_ARGS__);    \
+            }                                                   \
+        }                                                       \
     } while (0);
 
+/*
+ * Binary logging: only the callsite and the raw argument values are
+ * stored, the message is formatted when the log is printed.
+ * The format string has to be a string literal. The dead printf call
+ * lets the compiler check the arguments against the format.
+ */
+#define DDLOG_LOG_LEVEL_FMT(level, format_str, ...)             \
+    do {                                                        \
+        if (DDLOG_LEVEL_ENABLED(level)) {                       \
+            DDLOG_CALLSITE(ddlog_callsite, level,               \
+                           "" format_str);                      \
+            if (0) {                                            \
+                printf(format_str, ## __VA_ARGS__);             \
+            }                                                   \
+            if (DDLOG_CALLSITE_ENABLED(ddlog_callsite)) {       \
+                ddlog_log_fmt_cs(&ddlog_callsite,               \
+                                 ## __VA_ARGS__);               \
+            }                                                   \
+        }                                                       \
+    } while (0);
+
+#if DDLOG_COMPILE_LEVEL >= DDLOG_LEVEL_ERROR
+#define DDLOG_ERROR(message)             DDLOG_LOG_LEVEL(DDLOG_LEVEL_ERROR, message)
+#define DDLOG_ERROR_VA(format_str, ...)  DDLOG_LOG_LEVEL_VA(DDLOG_LEVEL_ERROR, format_str, ## __VA_ARGS__)
+#define DDLOG_ERROR_FMT(format_str, ...) DDLOG_LOG_LEVEL_FMT(DDLOG_LEVEL_ERROR, format_str, ## __VA_ARGS__)
+#else
+#define DDLOG_ERROR(message)             do { } while (0);
+#define DDLOG_ERROR_VA(format_str, ...)  do { } while (0);
+#define DDLOG_ERROR_FMT(format_str, ...) do { } while (0);
+#endif
+
+#if DDLOG_COMPILE_LEVEL >= DDLOG_LEVEL_WARN
+#define DDLOG_WARN(message)              DDLOG_LOG_LEVEL(DDLOG_LEVEL_WARN, message)
+#define DDLOG_WARN_VA(format_str, ...)   DDLOG_LOG_LEVEL_VA(DDLOG_LEVEL_WARN, format_str, ## __VA_ARGS__)
+#define DDLOG_WARN_FMT(format_str, ...)  DDLOG_LOG_LEVEL_FMT(DDLOG_LEVEL_WARN, format_str, ## __VA_ARGS__)
+#else
+#define DDLOG_WARN(message)              do { } while (0);
+#define DDLOG_WARN_VA(format_str, ...)   do { } while (0);
+#define DDLOG_WARN_FMT(format_str, ...)  do { } while (0);
+#endif
+
+#if DDLOG_COMPILE_LEVEL >= DDLOG_LEVEL_INFO
+#define DDLOG_INFO(message)              DDLOG_LOG_LEVEL(DDLOG_LEVEL_INFO, message)
+#define DDLOG_INFO_VA(format_str, ...)   DDLOG_LOG_LEVEL_VA(DDLOG_LEVEL_INFO, format_str, ## __VA_ARGS__)
+#define DDLOG_INFO_FMT(format_str, ...)  DDLOG_LOG_LEVEL_FMT(DDLOG_LEVEL_INFO, format_str, ## __VA_ARGS__)
+#else
+#define DDLOG_INFO(message)              do { } while (0);
+#define DDLOG_INFO_VA(format_str, ...)   do { } while (0);
+#define DDLOG_INFO_FMT(format_str, ...)  do { } while (0);
+#endif
+
+#if DDLOG_COMPILE_LEVEL >= DDLOG_LEVEL_DEBUG
+#define DDLOG_DEBUG(message)             DDLOG_LOG_LEVEL(DDLOG_LEVEL_DEBUG, message)
+#define DDLOG_DEBUG_VA(format_str, ...)  DDLOG_LOG_LEVEL_VA(DDLOG_LEVEL_DEBUG, format_str, ## __VA_ARGS__)
+#define DDLOG_DEBUG_FMT(format_str, ...) DDLOG_LOG_LEVEL_FMT(DDLOG_LEVEL_DEBUG, format_str, ## __VA_ARGS__)
+#else
+#define DDLOG_DEBUG(message)             do { } while (0);
+#define DDLOG_DEBUG_VA(format_str, ...)  do { } while (0);
+#define DDLOG_DEBUG_FMT(format_str, ...) do { } while (0);
+#endif
+
+#if DDLOG_COMPILE_LEVEL >= DDLOG_LEVEL_TRACE
+#define DDLOG_TRACE(message)             DDLOG_LOG_LEVEL(DDLOG_LEVEL_TRACE, message)
+#define DDLOG_TRACE_VA(format_str, ...)  DDLOG_LOG_LEVEL_VA(DDLOG_LEVEL_TRACE, format_str, ## __VA_ARGS__)
+#define DDLOG_TRACE_FMT(format_str, ...) DDLOG_LOG_LEVEL_FMT(DDLOG_LEVEL_TRACE, format_str, ## __VA_ARGS__)
+#else
+#define DDLOG_TRACE(message)             do { } while (0);
+#define DDLOG_TRACE_VA(format_str, ...)  do { } while (0);
+#define DDLOG_TRACE_FMT(format_str, ...) do { } while (0);
+#endif
+
+/* The level-less macros log at INFO level */
+#define DDLOG_VA(format_str, ...)  DDLOG_INFO_VA(format_str, ## __VA_ARGS__)
+#define DDLOG_FMT(format_str, ...) DDLOG_INFO_FMT(format_str, ## __VA_ARGS__)
+#define DDLOG(message)             DDLOG_INFO(message)
+
+/*
+ * The function entry/leave macros log at TRACE level. The indent level
+ * is changed only if TRACE is enabled, the disabled macros make no calls.
+ */
+#if DDLOG_COMPILE_LEVEL >= DDLOG_LEVEL_TRACE
 #define DDLOG_ENTRY                                             \
     do {                                                        \
-        ddlog_inc_indent();                                     \
-        ddlog_log_long(NULL, __FUNCTION__, __LINE__, "ENTRY");  \
+        if (DDLOG_LEVEL_ENABLED(DDLOG_LEVEL_TRACE)) {           \
+            ddlog_inc_indent();                                 \
+            DDLOG_LOG_LEVEL(DDLOG_LEVEL_TRACE, "ENTRY")         \
+        }                                                       \
     } while (0);
 
 #define DDLOG_LEAVE                                             \
     do {                                                        \
-        ddlog_log_long(NULL, __FUNCTION__, __LINE__, "LEAVE");  \
-        ddlog_dec_indent();                                     \
+        if (DDLOG_LEVEL_ENABLED(DDLOG_LEVEL_TRACE)) {           \
+            DDLOG_LOG_LEVEL(DDLOG_LEVEL_TRACE, "LEAVE")         \
+            ddlog_dec_indent();                                 \
+        }                                                       \
     } while (0);
 
 #define DDLOG_RET_FN(function, ret_type)                        \
     do {                                                        \
         ret_type temp_ret_value;                                \
         temp_ret_value = function;                              \
-        ddlog_log_long(NULL, __FUNCTION__, __LINE__, "LEAVE");  \
-        ddlog_dec_indent();                                     \
+        if (DDLOG_LEVEL_ENABLED(DDLOG_LEVEL_TRACE)) {           \
+            DDLOG_LOG_LEVEL(DDLOG_LEVEL_TRACE, "LEAVE")         \
+            ddlog_dec_indent();                                 \
+        }                                                       \
         return temp_ret_value;                                  \
     } while (0);
 
 #define DDLOG_RET_EXP(expression)                               \
     do {                                                        \
-        ddlog_log_long(NULL, __FUNCTION__, __LINE__, "LEAVE");  \
-        ddlog_dec_indent();                                     \
+        if (DDLOG_LEVEL_ENABLED(DDLOG_LEVEL_TRACE)) {           \
+            DDLOG_LOG_LEVEL(DDLOG_LEVEL_TRACE, "LEAVE")         \
+            ddlog_dec_indent();                                 \
+        }                                                       \
         return (expression);                                    \
     } while (0);
+#else
+#define DDLOG_ENTRY                      do { } while (0);
+#define DDLOG_LEAVE                      do { } while (0);
+#define DDLOG_RET_FN(function, ret_type) do { return (function); } while (0);
+#define DDLOG_RET_EXP(expression)        do { return (expression); } while (0);
+#endif
 
 #define DDLOG_INC_IND                                           \
     do {                                                        \
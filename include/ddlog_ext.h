@@ -61,6 +61,11 @@ int ddlog_ext_log_long_id(ddlog_buffer_id_t buffer_id,
         int line_number,
         const char* message);
 
+int ddlog_ext_log_cs(ddlog_callsite_t* callsite,
+        ddlog_ext_event_type_t event_type,
+        void* ext_data,
+        size_t data_size,
+        const char* message);
 
 int ddlog_ext_event_type_is_valid(ddlog_ext_event_type_t event_type);
 
@@ -70,25 +75,44 @@ void ddlog_ext_display_bt(FILE* stream, void* datap, size_t size);
 int ddlog_ext_init(void);
 ddlog_ext_event_type_t ddlog_ext_register_event(ddlog_ext_print_cb_t print_callback);
 
+/* The extended event macros log at DEBUG level */
+#if DDLOG_COMPILE_LEVEL >= DDLOG_LEVEL_DEBUG
 #define DDLOG_BT                                                \
     do {                                                        \
-        void* array[256];                                       \
-        size_t size = 0;                                        \
-        memset(array, 0 ,sizeof(array));                        \
-        size = backtrace(array, sizeof(array));                 \
-        ddlog_ext_log_long(DDLOG_EXT_EVENT_TYPE_BT,             \
-                          array, size * sizeof(void*),          \
-                          NULL, __FUNCTION__,                   \
-                          __LINE__, "Backtrace");               \
+        if (DDLOG_LEVEL_ENABLED(DDLOG_LEVEL_DEBUG)) {           \
+            DDLOG_CALLSITE(ddlog_callsite,                      \
+                           DDLOG_LEVEL_DEBUG, NULL);            \
+            if (DDLOG_CALLSITE_ENABLED(ddlog_callsite)) {       \
+                void* array[256];                               \
+                size_t size = 0;                                \
+                memset(array, 0 ,sizeof(array));                \
+                size = backtrace(array,                         \
+                        sizeof(array) / sizeof(array[0]));      \
+                ddlog_ext_log_cs(&ddlog_callsite,               \
+                                 DDLOG_EXT_EVENT_TYPE_BT,       \
+                                 array, size * sizeof(void*),   \
+                                 "Backtrace");                  \
+            }                                                   \
+        }                                                       \
     } while (0);
 
 #define DDLOG_HEX(data, data_size)                              \
     do {                                                        \
-        ddlog_ext_log_long(DDLOG_EXT_EVENT_TYPE_HEXDUMP,        \
-                          data, data_size, NULL,                \
-                          __FUNCTION__, __LINE__,               \
-                          "External log message");              \
+        if (DDLOG_LEVEL_ENABLED(DDLOG_LEVEL_DEBUG)) {           \
+            DDLOG_CALLSITE(ddlog_callsite,                      \
+                           DDLOG_LEVEL_DEBUG, NULL);            \
+            if (DDLOG_CALLSITE_ENABLED(ddlog_callsite)) {       \
+                ddlog_ext_log_cs(&ddlog_callsite,               \
+                                 DDLOG_EXT_EVENT_TYPE_HEXDUMP,  \
+                                 data, data_size,               \
+                                 "External log message");       \
+            }                                                   \
+        }                                                       \
     } while (0);
+#else
+#define DDLOG_BT                         do { } while (0);
+#define DDLOG_HEX(data, data_size)       do { } while (0);
+#endif
 
 
 #endif
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_callsite.h
+ * \brief Registry of the logging macro callsites.
+ */
+#ifndef __DDLOG_CALLSITE_H
+#define __DDLOG_CALLSITE_H
+#include "ddlog.h"
+
+#define DDLOG_MAX_CALLSITE_SECTIONS 64
+
+/**
+ * \struct ddlog_callsite_section_t
+ * \brief The callsite section of a loaded module.
+ */
+typedef struct ddlog_callsite_section_t {
+    ddlog_callsite_t* start;    /*!< The first callsite of the module */
+    ddlog_callsite_t* stop;     /*!< Points after the last callsite of the module */
+} ddlog_callsite_section_t;
+
+typedef void (*ddlog_callsite_cb_t)(ddlog_callsite_t* callsite, void* data);
+
+int ddlog_callsite_match_internal(const ddlog_callsite_t* callsite, const char* pattern);
+unsigned int ddlog_callsite_foreach_internal(const char* pattern, ddlog_callsite_cb_t callback, void* data);
+const char* ddlog_callsite_level_name_internal(unsigned int level);
+
+#endif
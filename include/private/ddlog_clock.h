@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_clock.h
+ * \brief Event timestamp sources and their calibration.
+ *
+ * The events store raw clock ticks of the selected clock source.
+ * The ticks are converted to wall clock time only when the events
+ * are displayed, using the calibration record taken at ddlog_init().
+ */
+#ifndef __DDLOG_CLOCK_H
+#define __DDLOG_CLOCK_H
+#include <stdint.h>
+#include <time.h>
+#include "ddlog.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DDLOG_CLOCK_HAVE_TSC 1
+#else
+#define DDLOG_CLOCK_HAVE_TSC 0
+#endif
+
+/* CPUID 0x80000007 EDX: the TSC is invariant */
+#define DDLOG_CLOCK_CPUID_INVARIANT_TSC (1U << 8)
+
+/* duration of the TSC frequency measurement at init */
+#define DDLOG_CLOCK_CALIBRATION_NS 10000000ULL
+
+/**
+ * \struct ddlog_clock_calibration_t
+ * \brief Pairs a clock reading with the wall clock time.
+ */
+typedef struct ddlog_clock_calibration_t {
+    ddlog_clock_source_t source;   /*!< The clock source of the event timestamps */
+    uint64_t base_ticks;           /*!< Clock reading at the calibration */
+    uint64_t base_wall_ns;         /*!< Wall clock time at the calibration (ns since the epoch) */
+    double ns_per_tick;            /*!< Length of one clock tick in nanoseconds */
+} ddlog_clock_calibration_t;
+
+extern ddlog_clock_calibration_t ddlog_clock_calibration;
+
+int ddlog_clock_tsc_invariant_internal(void);
+int ddlog_clock_set_source_internal(ddlog_clock_source_t source);
+void ddlog_clock_calibrate_internal(void);
+void ddlog_clock_to_wall_internal(uint64_t ticks, struct timespec* wall);
+uint64_t ddlog_clock_from_wall_internal(uint64_t wall_ns);
+const char* ddlog_clock_source_name_internal(ddlog_clock_source_t source);
+
+/**
+ * \brief Reads the time stamp counter
+ */
+static inline uint64_t ddlog_clock_read_tsc_internal(void){
+#if DDLOG_CLOCK_HAVE_TSC
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * \brief Reads a posix clock in nanoseconds
+ */
+static inline uint64_t ddlog_clock_read_ns_internal(clockid_t clock_id){
+    struct timespec ts;
+    clock_gettime(clock_id, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * \brief Returns the current event timestamp in clock ticks
+ *
+ * This is called on the logging path for every event.
+ */
+static inline uint64_t ddlog_clock_now_internal(void){
+    switch (ddlog_clock_calibration.source){
+        case DDLOG_CLOCK_TSC:
+            return ddlog_clock_read_tsc_internal();
+        case DDLOG_CLOCK_MONOTONIC_COARSE:
+            return ddlog_clock_read_ns_internal(CLOCK_MONOTONIC_COARSE);
+        default:
+            return ddlog_clock_read_ns_internal(CLOCK_MONOTONIC_RAW);
+    }
+}
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_crash.h
+ * \brief Crash dump of the log buffers from the fatal signal handler.
+ *
+ * The dump is formatted by the functions of this module only, they use
+ * no locks, no heap and no stdio, so they can be called from a signal
+ * handler.
+ */
+#ifndef __DDLOG_CRASH_H
+#define __DDLOG_CRASH_H
+#include <stddef.h>
+#include "private/ddlog_internal.h"
+
+size_t ddlog_crash_format_message_internal(char* buffer, size_t size, const char* format, const char* args, size_t args_size);
+size_t ddlog_crash_format_event_internal(const ddlog_record_t* record, char* buffer, size_t size);
+
+#endif
@@ -5,15 +5,23 @@
 #include <sys/time.h>
 #include "ddlog.h"
 #include "private/ddlog_internal.h"
+#include "private/ddlog_query.h"
 
 
-void ddlog_display_event(FILE* stream, const ddlog_event_t* event);
-void ddlog_display_format_timestamp(char* buffer, size_t size, const struct timeval* t);
-void ddlog_display_format_event_str(const ddlog_event_t* event, char* buffer, size_t buffer_size);
+void ddlog_display_event(FILE* stream, const ddlog_record_t* record);
+void ddlog_display_format_timestamp(char* buffer, size_t size, uint64_t timestamp);
+void ddlog_display_format_thread(char* buffer, size_t size, const ddlog_record_t* record);
+void ddlog_display_format_event_str(const ddlog_record_t* record, char* buffer, size_t buffer_size);
 void ddlog_display_print_buffer_id(FILE* stream, ddlog_buffer_id_t buffer_id);
+void ddlog_display_print_snapshot_buffer(FILE* stream, const ddlog_snapshot_t* snapshot, ddlog_buffer_id_t buffer_id);
+void ddlog_display_print_snapshot(FILE* stream, const ddlog_snapshot_t* snapshot);
 void ddlog_display_print_buffer(FILE* stream);
 void ddlog_display_print_buffer_list(FILE* stream);
 void ddlog_display_print_all_buffers(FILE* stream);
+void ddlog_display_print_thread_list(FILE* stream);
+void ddlog_display_print_stats(FILE* stream);
+void ddlog_display_print_callsites(FILE* stream, const char* pattern);
+unsigned int ddlog_display_print_query(FILE* stream, ddlog_buffer_id_t buffer_id, const ddlog_query_t* query);
 
 void ddlog_display_enable_indention(void);
 void ddlog_display_disable_indention(void);
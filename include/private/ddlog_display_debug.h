@@ -7,7 +7,9 @@
 #define __DDLOG_DISPLAY_DEBUG_H
 #include <stdio.h>
 #include "ddlog.h"
+#include "private/ddlog_internal.h"
 
+void ddlog_display_debug_print_slots(FILE* stream, ddlog_buffer_t* buffer);
 void ddlog_display_debug_print_buffer_id(FILE* stream, ddlog_buffer_id_t buffer_id);
 void ddlog_display_debug_print_all_buffers(FILE* stream, int print_status, int print_events);
 
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_fmt.h
+ * \brief Deferred (binary) message formatting.
+ */
+#ifndef __DDLOG_FMT_H
+#define __DDLOG_FMT_H
+#include <stddef.h>
+#include <stdarg.h>
+#include "private/ddlog_internal.h"
+
+#define DDLOG_FMT_LEN_NONE   0
+#define DDLOG_FMT_LEN_HH     1
+#define DDLOG_FMT_LEN_H      2
+#define DDLOG_FMT_LEN_L      3
+#define DDLOG_FMT_LEN_LL     4
+#define DDLOG_FMT_LEN_J      5
+#define DDLOG_FMT_LEN_Z      6
+#define DDLOG_FMT_LEN_T      7
+#define DDLOG_FMT_LEN_LD     8
+
+/**
+ * \struct ddlog_fmt_spec_t
+ * \brief A parsed printf conversion specification.
+ */
+typedef struct ddlog_fmt_spec_t {
+    const char* start;          /*!< Points to the '%' character */
+    const char* end;            /*!< Points after the conversion character */
+    int length;                 /*!< The length modifier (DDLOG_FMT_LEN_*) */
+    int width_arg;              /*!< The width is provided as an argument ('*') */
+    int precision_arg;          /*!< The precision is provided as an argument ('.*') */
+    int precision;              /*!< The precision, -1 if not present or provided as an argument */
+    char conversion;            /*!< The conversion character, 0 if invalid */
+} ddlog_fmt_spec_t;
+
+const char* ddlog_fmt_parse_spec(const char* format, ddlog_fmt_spec_t* spec);
+size_t ddlog_fmt_pack(char* buffer, size_t size, const char* format, va_list args);
+void ddlog_fmt_format(char* buffer, size_t size, const char* format, const char* args, size_t args_size);
+const char* ddlog_fmt_record_message(const ddlog_record_t* record, char* buffer, size_t size);
+
+#endif
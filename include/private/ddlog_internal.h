@@ -12,6 +12,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <sys/time.h>
 
@@ -21,44 +22,183 @@
 
 #define DDLOG_MAX_EVENT_NUM  128
 #define DDLOG_MAX_BUF_NUM    5
-#define DDLOG_FNAME_BUF_SIZE 32
-#define DDLOG_TNAME_BUF_SIZE 32
-#define DDLOG_MSG_BUF_SIZE   256
+#define DDLOG_MAX_THREAD_BUF_NUM 64
+#define DDLOG_CACHE_LINE_SIZE 64
+#define DDLOG_STATS_SHARD_NUM 16       /* counter shards of a shared ring, power of two */
+#define DDLOG_EVENT_BUDGET_SIZE 336    /* bytes of memory per requested event: the name and message fields of the fixed size events */
+#define DDLOG_RECORD_AVG_SIZE 64       /* data ring bytes per slot: the header, a short name and a 40 char message */
+#define DDLOG_MAX_RECORD_SIZE 2048
+#define DDLOG_DATA_RING_MIN_SIZE (2 * DDLOG_MAX_RECORD_SIZE)
+#define DDLOG_MAX_NAME_LEN   256
+#define DDLOG_MAX_DEFERRED_SIZE (DDLOG_MAX_RECORD_SIZE - 16 - 2 * DDLOG_MAX_NAME_LEN)
+#define DDLOG_EXT_INLINE_SIZE 256       /* ext payloads up to this size are stored in the event record */
+#define DDLOG_EXT_SLOT_SIZE   64        /* ext arena bytes per slot */
+#define DDLOG_EXT_ARENA_MIN_SIZE 16384  /* per ring arena of the larger ext payloads, power of two */
+#define DDLOG_MAX_EXT_SIZE    8192      /* ext payloads are truncated to this size */
+
+#define DDLOG_EVENT_FLAG_DEFERRED   0x01  /*!< The message is a format string pointer and packed arguments */
+#define DDLOG_EVENT_FLAG_EXT_INLINE 0x02  /*!< The ext payload is stored in the event record, not in the ext arena */
+#define DDLOG_EVENT_FLAG_THREAD_NAME 0x04 /*!< The event record holds a thread name, it overrides the thread registry */
+
+#define DDLOG_EVENT_SEQ_DROPPED     (1ULL << 63) /*!< Tombstone stamp: the events of the slot up to the stamp are dropped */
+#define DDLOG_EVENT_LOCKED          0x01  /*!< The slot is being filled by a producer */
+#define DDLOG_EVENT_LOCK_DROPPED    0x02  /*!< A producer dropped its event on the locked slot */
 
 /**
  * \struct ddlog_event_t
  * \brief Structure to hold all log event specific data.
+ *
+ * Events are stored in a contiguous slot array, every slot is exactly
+ * one cache line. The variable length part of the event (thread name,
+ * function name and the message) is stored as a record in the data
+ * ring of the buffer, the event refers to it by position and size.
  */
 typedef struct ddlog_event_t {
-    char function_name[DDLOG_FNAME_BUF_SIZE]; /*!< Name of the function the log comes from. Optional. */
-    char thread_name[DDLOG_TNAME_BUF_SIZE];   /*!< Thread name from the log comes from. Optional. */
-    char message[DDLOG_MSG_BUF_SIZE];         /*!< The log message itself */
+    volatile uint64_t seq;                   /*!< Sequence number of the stored event + 1. 0 if the slot is empty or being written, DDLOG_EVENT_SEQ_DROPPED is set in a tombstone */
+    uint64_t timestamp;                      /*!< Timestamp of the log message in clock ticks (see ddlog_clock.h) */
+    uint64_t data_pos;                       /*!< Position of the event record in the data ring */
+    uint32_t data_size;                      /*!< Size of the event record */
     unsigned int line_number ;               /*!< The line number of the log message in the code */
-    struct timeval timestamp;                /*!< Timestamp of the log message */
-    struct ddlog_event_t* next;               /*!< The next log event. Events are stored in linked list */
-    unsigned char used;                      /*!< Event slot is free/used */
-    unsigned char lock;                      /*!< The event structure is locked (getting populated with data */
-    void* ext_data;                          /*!< Extended log data if log is special */
-    size_t ext_data_size;                    /*!< The size of the extended log data */
+    uint64_t ext_pos;                        /*!< Position of the extended log data in the ext arena */
+    const ddlog_callsite_t* callsite;        /*!< The static descriptor of the logging macro or NULL */
+    uint32_t ext_data_size;                  /*!< The size of the extended log data */
     ddlog_ext_event_type_t ext_event_type;    /*!< The external event type if any */
-    ddlog_ext_print_cb_t ext_print_cb;        /*!< Function to print/format external data to stream */
+    unsigned char lock;                      /*!< The event structure is locked (getting populated with data), DDLOG_EVENT_LOCK* */
     uint8_t indent_level;                    /*!< Log message ident level */
-} ddlog_event_t;
+    uint8_t flags;                           /*!< Event flags (DDLOG_EVENT_FLAG_*) */
+    uint16_t thread_id;                      /*!< Registry id of the logging thread (see ddlog_thread.h) */
+} __attribute__ ((aligned (DDLOG_CACHE_LINE_SIZE))) ddlog_event_t;
+
+/**
+ * \struct ddlog_record_hdr_t
+ * \brief Header of the variable length event records in the data ring.
+ *
+ * The header is followed by the thread name, the function name and the
+ * message, each of them stored with the terminating zero. A length of 0
+ * means the field is not present. The record size is rounded up to 8 bytes.
+ * For deferred events the message field holds the format string pointer
+ * followed by the packed argument values. A small extended payload is
+ * stored after the message at the next 8 byte aligned offset.
+ */
+typedef struct ddlog_record_hdr_t {
+    uint32_t size;              /*!< Size of the whole record including the header */
+    uint16_t thread_len;        /*!< Length of the thread name */
+    uint16_t function_len;      /*!< Length of the function name */
+    uint32_t message_len;       /*!< Length of the message */
+    uint32_t reserved;
+} ddlog_record_hdr_t;
+
+/**
+ * \struct ddlog_record_t
+ * \brief A log event copied out of a ring by a reader.
+ *
+ * Holds the copy of the event slot and its record, the string pointers
+ * point into the copied record data (NULL if the field is not present).
+ * The function and file names of the events with a callsite point into
+ * the callsite descriptor.
+ * The extended payload is copied from the ext arena, or points into the
+ * record data if it was stored inline.
+ */
+typedef struct ddlog_record_t {
+    ddlog_event_t event;        /*!< Copy of the event slot */
+    const char* thread_name;    /*!< Thread name or NULL */
+    const char* function_name;  /*!< Function name or NULL */
+    const char* file_name;      /*!< Source file name (only for events with a callsite) or NULL */
+    const char* message;        /*!< The log message or NULL, not set for deferred events */
+    const char* format;         /*!< The format string of a deferred event */
+    const char* args;           /*!< The packed arguments of a deferred event */
+    size_t args_size;           /*!< The size of the packed arguments */
+    const void* ext_data;       /*!< The extended payload or NULL */
+    char data[DDLOG_MAX_RECORD_SIZE]; /*!< Copy of the event record */
+    char ext[DDLOG_MAX_EXT_SIZE] __attribute__ ((aligned (8))); /*!< Copy of the ext payload from the ext arena */
+} ddlog_record_t;
 
 
+/**
+ * \struct ddlog_stats_shard_t
+ * \brief One shard of the performance counters of a ring.
+ *
+ * The threads logging into a shared ring update the shard selected by
+ * their registry id, so the counters do not bounce one cache line between
+ * the producers. A private ring has one writer, it uses the first shard only.
+ */
+typedef struct ddlog_stats_shard_t {
+    volatile uint64_t events_written;   /*!< Number of events stored */
+    volatile uint64_t bytes_written;    /*!< Bytes reserved in the data ring and the ext arena */
+    volatile uint64_t wraps;            /*!< Number of ring wraps */
+    volatile uint64_t events_dropped;   /*!< Number of events dropped */
+    volatile uint64_t lock_contended;   /*!< Number of contended buffer lock acquisitions */
+    volatile uint64_t lock_spin_ticks;  /*!< Clock ticks spent spinning on the buffer lock */
+} __attribute__ ((aligned (DDLOG_CACHE_LINE_SIZE))) ddlog_stats_shard_t;
+
 /**
  * \struct ddlog_buffer_t
  * \brief Structure to hold all log buffer related information
  */
 typedef struct ddlog_buffer_t {
-    ddlog_event_t* head;         /*!< Head of the event data list*/
-    ddlog_event_t* next_write;   /*!< The next write position in the list*/
-    size_t buffer_size;         /*!< The number of events (log buffer capacity)*/
-    int wrapped;                /*!< Number of buffer wraps*/
+    ddlog_event_t* events;      /*!< The event slot array (cache line aligned) */
+    char* data;                 /*!< The data ring holding the event records, follows the slot array */
+    size_t data_size;           /*!< Size of the data ring in bytes, power of two */
+    size_t data_mask;           /*!< data_size - 1 */
+    volatile uint64_t data_head; /*!< Number of bytes ever reserved in the data ring */
+    char* ext_arena;            /*!< Arena of the large ext payloads, follows the data ring */
+    size_t ext_size;            /*!< Size of the ext arena in bytes, power of two */
+    volatile uint64_t ext_head; /*!< Number of bytes ever reserved in the ext arena */
+    volatile uint64_t write_seq; /*!< The next event sequence number, the slot index is write_seq & mask */
+    volatile uint64_t reset_seq; /*!< The generation floor, the events below it have been reset */
+    volatile uint64_t reset_data_head; /*!< The data ring position of the generation floor */
+    volatile uint64_t reset_ext_head; /*!< The ext arena position of the generation floor */
+    volatile uint64_t read_seq; /*!< The next event to be consumed by the drainer */
+    volatile uint64_t data_tail; /*!< The end of the consumed records in the data ring */
+    volatile uint64_t ext_tail; /*!< The end of the consumed payloads in the ext arena */
+    ddlog_overflow_policy_t overflow; /*!< The overflow policy */
+    uint64_t block_timeout_ns;  /*!< The maximum wait of DDLOG_OVERFLOW_BLOCK */
+    volatile int draining;      /*!< A drainer is consuming the buffer */
+    int persistent;             /*!< The ring is in a file mapping (see ddlog_recorder.h) */
+    void* mapping;              /*!< The file mapping holding the rings of the buffer (main ring only) */
+    size_t mapping_size;        /*!< The size of the file mapping */
+    size_t buffer_size;         /*!< The number of events (log buffer capacity), power of two */
+    size_t mask;                /*!< buffer_size - 1, used to wrap the slot indexes */
     pthread_spinlock_t lock;    /*!< Buffer lock for pointer operations */
-    unsigned int event_locked;  /*!< Counter of msg drops because of event is locked */
+    ddlog_buffer_id_t id;       /*!< The id of the buffer */
+    uint32_t instance;          /*!< Unique id of the buffer instance, validates the thread local ring references */
+    int per_thread;             /*!< Threads calling ddlog_thread_init() get a private ring in this buffer */
+    int single_producer;        /*!< This is a private thread ring, written without atomic operations */
+    volatile int owned;         /*!< The private ring is owned by a running thread */
+    struct ddlog_buffer_t* thread_buffers[DDLOG_MAX_THREAD_BUF_NUM]; /*!< Private thread rings of a per thread buffer */
+    volatile unsigned int thread_buffer_num; /*!< Number of private thread rings */
+    ddlog_stats_shard_t stats[DDLOG_STATS_SHARD_NUM]; /*!< Performance counters (see ddlog_stats.h) */
 } ddlog_buffer_t;
 
+/**
+ * \struct ddlog_thread_buffer_ref_t
+ * \brief Thread local reference to the private ring of the thread in a buffer.
+ */
+typedef struct ddlog_thread_buffer_ref_t {
+    uint32_t instance;          /*!< The instance id of the buffer the ring belongs to */
+    ddlog_buffer_t* ring;       /*!< The private ring of the thread */
+} ddlog_thread_buffer_ref_t;
+
+/**
+ * \struct ddlog_buffer_iter_t
+ * \brief Reader side cursor merging the rings of a buffer in timestamp order.
+ *
+ * The shared ring and all the private thread rings of the buffer are
+ * walked in parallel, the event with the oldest timestamp is returned first.
+ */
+typedef struct ddlog_buffer_iter_t {
+    ddlog_buffer_t* rings[DDLOG_MAX_THREAD_BUF_NUM + 1]; /*!< The shared ring and the thread rings */
+    uint64_t next_seq[DDLOG_MAX_THREAD_BUF_NUM + 1];     /*!< The next sequence number to read per ring */
+    uint64_t end_seq[DDLOG_MAX_THREAD_BUF_NUM + 1];      /*!< The write position of the ring at init time */
+    uint64_t stall_seq[DDLOG_MAX_THREAD_BUF_NUM + 1];    /*!< Follow mode: the unpublished event the ring stopped at */
+    uint64_t lost;                                      /*!< Follow mode: the events overwritten before they were read */
+    unsigned int ring_num;                              /*!< The number of rings to merge */
+    uint32_t instance;                                  /*!< The instance id of the buffer */
+    int follow;                                         /*!< (flag) follow mode, see ddlog_iter_follow_internal() */
+    int (*filter)(const ddlog_event_t* event, void* arg); /*!< Skips the event slots it returns 0 for, or NULL */
+    void* filter_arg;                                   /*!< The argument of the filter */
+} ddlog_buffer_iter_t;
+
 typedef enum {
     DDLOG_LOCK_UNINITED = 0,
     DDLOG_LOCK_UNLOCKED = 1,
@@ -67,16 +207,70 @@ typedef enum {
 } ddlog_lock_state_t;
 
 
-ddlog_buffer_t* ddlog_init_buffer_internal(size_t size);
+int ddlog_init_internal(const ddlog_buffer_opt_t* opt);
+ddlog_buffer_id_t ddlog_create_buffer_internal(const ddlog_buffer_opt_t* opt);
+ddlog_buffer_t* ddlog_new_buffer_internal(const ddlog_buffer_opt_t* opt, size_t size, ddlog_buffer_id_t buffer_id);
+ddlog_buffer_t* ddlog_init_buffer_internal(size_t slots);
+size_t ddlog_ring_slots_internal(size_t size);
+size_t ddlog_ring_data_size_internal(size_t slots);
+size_t ddlog_ring_ext_size_internal(size_t slots);
+int ddlog_setup_buffer_internal(ddlog_buffer_t* buffer, void* memory, size_t slots, size_t data_size, size_t ext_size);
+ddlog_buffer_t* ddlog_get_thread_buffer_internal(ddlog_buffer_t* buffer);
+int ddlog_attach_thread_buffer_internal(ddlog_buffer_t* buffer);
+void ddlog_release_thread_buffers_internal(void* data);
 int ddlog_reset_buffer_internal(ddlog_buffer_t* log_buffer);
 void ddlog_cleanup_buffer_internal(ddlog_buffer_t* buffer);
-void ddlog_reset_event_internal(ddlog_event_t* event);
+
+int ddlog_fill_event_internal(ddlog_buffer_t* ring, ddlog_event_t* event,
+        const ddlog_callsite_t* callsite, const char* thread,
+        const char* function, unsigned int line_num,
+        const char* message, size_t message_len, uint8_t flags,
+        void* ext_data, size_t ext_data_size,
+        ddlog_ext_event_type_t event_type);
 
 int ddlog_log_internal(ddlog_buffer_t* log_buffer, const char* thread,
         const char* function, unsigned int line_num,
         const char* message, void* ext_data, size_t ext_data_size,
         ddlog_ext_event_type_t event_type);
 
+int ddlog_log_raw_internal(ddlog_buffer_t* log_buffer,
+        const ddlog_callsite_t* callsite, const char* thread,
+        const char* function, unsigned int line_num,
+        const char* message, size_t message_len, uint8_t flags,
+        void* ext_data, size_t ext_data_size,
+        ddlog_ext_event_type_t event_type);
+
+int ddlog_log_ordered_internal(ddlog_buffer_t* ring,
+        const ddlog_callsite_t* callsite, const char* thread,
+        const char* function, unsigned int line_num,
+        const char* message, size_t message_len, uint8_t flags,
+        void* ext_data, size_t ext_data_size,
+        ddlog_ext_event_type_t event_type);
+
+int ddlog_log_bounded_internal(ddlog_buffer_t* ring,
+        const ddlog_callsite_t* callsite, const char* thread,
+        const char* function, unsigned int line_num,
+        const char* message, size_t message_len, uint8_t flags,
+        void* ext_data, size_t ext_data_size,
+        ddlog_ext_event_type_t event_type);
+
+int ddlog_log_fmt_internal(ddlog_buffer_t* log_buffer,
+        const ddlog_callsite_t* callsite, const char* function,
+        unsigned int line_num, const char* format, va_list args);
+
+void ddlog_iter_init_internal(ddlog_buffer_iter_t* iter, ddlog_buffer_t* buffer);
+int ddlog_iter_next_internal(ddlog_buffer_iter_t* iter, ddlog_record_t* record);
+void ddlog_iter_follow_init_internal(ddlog_buffer_iter_t* iter, ddlog_buffer_t* buffer);
+int ddlog_iter_follow_internal(ddlog_buffer_iter_t* iter, ddlog_buffer_t* buffer);
+int ddlog_read_event_internal(ddlog_buffer_t* ring, uint64_t seq, ddlog_record_t* record);
+int ddlog_consume_event_internal(ddlog_buffer_t* ring, ddlog_record_t* record);
+int ddlog_drain_next_internal(ddlog_buffer_t* buffer, ddlog_record_t* record);
+void ddlog_data_write_internal(ddlog_buffer_t* ring, uint64_t pos, const void* src, size_t size);
+void ddlog_data_write_str_internal(ddlog_buffer_t* ring, uint64_t pos, const char* str, size_t len);
+void ddlog_data_read_internal(const ddlog_buffer_t* ring, uint64_t pos, void* dst, size_t size);
+void ddlog_ext_write_internal(ddlog_buffer_t* ring, uint64_t pos, const void* src, size_t size);
+void ddlog_ext_read_internal(const ddlog_buffer_t* ring, uint64_t pos, void* dst, size_t size);
+
 int ddlog_lock_buffer_internal(ddlog_buffer_t* buffer);
 int ddlog_unlock_buffer_internal(ddlog_buffer_t* buffer);
 int ddlog_lock_global(int full_lock);
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_logfile.h
+ * \brief Binary log file format.
+ *
+ * File layout: the file header (ddlog_logfile_hdr_t), the blocks, the
+ * block index and the footer (ddlog_logfile_footer_t) at the end of the
+ * file. A block is a block header (ddlog_logfile_block_hdr_t) followed
+ * by the payload, compressed if DDLOG_LOGFILE_BLOCK_COMPRESSED is set.
+ * A file without footer (the writer process died) is read by walking
+ * the block headers.
+ *
+ * The payload starts with the string table of the block: the thread,
+ * function and file names used by the events of the block, each of them
+ * stored once as a varint length, the characters and a terminating zero.
+ * The events follow, every event is encoded as:
+ *  - the timestamp difference to the previous event of the block (to the
+ *    base timestamp for the first one), zigzag varint
+ *  - the buffer id and the thread registry id, varints
+ *  - the thread, function and file name string indexes + 1 (0 if the
+ *    name is not present), varints
+ *  - the line number, varint
+ *  - the event flags and the indent level, one byte each
+ *  - the message length (varint), the message and a terminating zero
+ *  - the ext event type and the ext payload size (varints), the payload
+ *
+ * The blocks can be decoded independently. The sequence number of an
+ * event is the first_seq of its block plus its position in the block.
+ * The multi byte fields are stored in the byte order of the writer.
+ */
+#ifndef __DDLOG_LOGFILE_H
+#define __DDLOG_LOGFILE_H
+#include <stdint.h>
+#include <stddef.h>
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_clock.h"
+
+#define DDLOG_LOGFILE_MAGIC         "DDLOGBN"
+#define DDLOG_LOGFILE_FOOTER_MAGIC  "DDLOGIX"
+#define DDLOG_LOGFILE_VERSION       2
+#define DDLOG_LOGFILE_BLOCK_MAGIC   0x4b4c4244      /* "DBLK" */
+
+#define DDLOG_LOGFILE_BLOCK_SIZE    (64 * 1024)     /* a block is sealed at this payload size */
+#define DDLOG_LOGFILE_MAX_STRINGS   256             /* names per block */
+#define DDLOG_LOGFILE_MAX_EVENT_SIZE (128 + 2 * DDLOG_MAX_RECORD_SIZE + DDLOG_MAX_EXT_SIZE)
+#define DDLOG_LOGFILE_MAX_RAW_SIZE  (DDLOG_LOGFILE_BLOCK_SIZE + DDLOG_LOGFILE_MAX_EVENT_SIZE + \
+                                     DDLOG_LOGFILE_MAX_STRINGS * (DDLOG_MAX_NAME_LEN + 4))
+
+#define DDLOG_LOGFILE_BLOCK_COMPRESSED 0x1
+
+/**
+ * \struct ddlog_logfile_hdr_t
+ * \brief Header of a binary log file.
+ */
+typedef struct ddlog_logfile_hdr_t {
+    char magic[8];                      /*!< DDLOG_LOGFILE_MAGIC */
+    uint32_t version;                   /*!< DDLOG_LOGFILE_VERSION */
+    int32_t pid;                        /*!< The writer process id */
+    ddlog_clock_calibration_t clock;    /*!< The clock calibration of the event timestamps */
+} ddlog_logfile_hdr_t;
+
+/**
+ * \struct ddlog_logfile_block_hdr_t
+ * \brief Header of a block of events.
+ */
+typedef struct ddlog_logfile_block_hdr_t {
+    uint32_t magic;                 /*!< DDLOG_LOGFILE_BLOCK_MAGIC */
+    uint32_t flags;                 /*!< DDLOG_LOGFILE_BLOCK_* */
+    uint32_t raw_size;              /*!< The size of the payload */
+    uint32_t stored_size;           /*!< The size of the payload in the file */
+    uint32_t strings_size;          /*!< The size of the string table at the start of the payload */
+    uint32_t string_num;            /*!< The number of strings in the string table */
+    uint32_t event_num;             /*!< The number of events in the block */
+    uint32_t reserved;
+    uint64_t first_seq;             /*!< The sequence number of the first event */
+    uint64_t base_timestamp;        /*!< The reference of the first timestamp difference */
+    uint64_t min_timestamp;         /*!< The oldest timestamp in the block */
+    uint64_t max_timestamp;         /*!< The newest timestamp in the block */
+} ddlog_logfile_block_hdr_t;
+
+/**
+ * \struct ddlog_logfile_index_t
+ * \brief Block index entry.
+ *
+ * The buffers are drained one after the other, the timestamp ranges of
+ * the blocks can overlap a little.
+ */
+typedef struct ddlog_logfile_index_t {
+    uint64_t offset;                /*!< The file offset of the block header */
+    uint64_t first_seq;             /*!< The sequence number of the first event */
+    uint64_t min_timestamp;         /*!< The oldest timestamp in the block */
+    uint64_t max_timestamp;         /*!< The newest timestamp in the block */
+    uint32_t event_num;             /*!< The number of events in the block */
+    uint32_t reserved;
+} ddlog_logfile_index_t;
+
+/**
+ * \struct ddlog_logfile_footer_t
+ * \brief The last bytes of a completely written binary log file.
+ */
+typedef struct ddlog_logfile_footer_t {
+    uint64_t index_offset;          /*!< The file offset of the block index */
+    uint64_t index_num;             /*!< The number of index entries (blocks) */
+    uint64_t event_num;             /*!< The number of events in the file */
+    char magic[8];                  /*!< DDLOG_LOGFILE_FOOTER_MAGIC */
+} ddlog_logfile_footer_t;
+
+/**
+ * \struct ddlog_logfile_block_t
+ * \brief Block encoder.
+ *
+ * The events are encoded into the event area, the names into the string
+ * table. Sealing concatenates and compresses them into the output.
+ */
+typedef struct ddlog_logfile_block_t {
+    ddlog_logfile_block_hdr_t hdr;                      /*!< The header of the block being built */
+    uint64_t prev_timestamp;                            /*!< The timestamp of the last event */
+    char* strings;                                      /*!< The string table */
+    size_t strings_size;                                /*!< The size of the string table */
+    uint32_t string_offsets[DDLOG_LOGFILE_MAX_STRINGS]; /*!< The offsets of the names in the string table */
+    uint16_t string_lens[DDLOG_LOGFILE_MAX_STRINGS];    /*!< The lengths of the names */
+    uint16_t string_hash[2 * DDLOG_LOGFILE_MAX_STRINGS]; /*!< Open addressing hash of the names, index + 1 */
+    char* events;                                       /*!< The encoded events */
+    size_t events_size;                                 /*!< The size of the encoded events */
+    char* raw;                                          /*!< The payload of the sealed block */
+    char* out;                                          /*!< The compressed payload of the sealed block */
+} ddlog_logfile_block_t;
+
+/**
+ * \struct ddlog_logfile_t
+ * \brief A binary log file opened for reading.
+ */
+typedef struct ddlog_logfile_t {
+    const char* data;                   /*!< The file mapping */
+    size_t size;                        /*!< The size of the file */
+    const ddlog_logfile_hdr_t* hdr;     /*!< The file header */
+    ddlog_logfile_index_t* index;       /*!< The block index (copied from the footer or rebuilt) */
+    size_t index_num;                   /*!< The number of blocks */
+    int complete;                       /*!< (flag) the file has a footer */
+} ddlog_logfile_t;
+
+/**
+ * \struct ddlog_logfile_event_t
+ * \brief A decoded event, the strings point into the cursor.
+ */
+typedef struct ddlog_logfile_event_t {
+    uint64_t seq;                       /*!< The sequence number of the event */
+    uint64_t timestamp;                 /*!< Timestamp in clock ticks (see the file header) */
+    unsigned int buffer_id;             /*!< The id of the buffer the event was logged into */
+    unsigned int thread_id;             /*!< Registry id of the logging thread */
+    const char* thread_name;            /*!< Thread name or NULL */
+    const char* function_name;          /*!< Function name or NULL */
+    const char* file_name;              /*!< Source file name or NULL */
+    const char* message;                /*!< The message */
+    size_t message_len;                 /*!< The length of the message */
+    unsigned int line_number;           /*!< The line number of the log call */
+    uint8_t flags;                      /*!< Event flags (DDLOG_EVENT_FLAG_*) */
+    uint8_t indent_level;               /*!< Log message indent level */
+    uint32_t ext_event_type;            /*!< The external event type */
+    const void* ext_data;               /*!< The extended payload or NULL */
+    uint32_t ext_data_size;             /*!< The size of the extended payload */
+} ddlog_logfile_event_t;
+
+/**
+ * \struct ddlog_logfile_cursor_t
+ * \brief Reader position in a binary log file.
+ */
+typedef struct ddlog_logfile_cursor_t {
+    const ddlog_logfile_t* file;                    /*!< The file */
+    size_t block;                                   /*!< The index of the loaded block */
+    ddlog_logfile_block_hdr_t hdr;                  /*!< The header of the loaded block */
+    char* payload;                                  /*!< The decompressed payload of the loaded block */
+    const char* strings[DDLOG_LOGFILE_MAX_STRINGS]; /*!< The names of the loaded block */
+    size_t pos;                                     /*!< The position of the next event in the payload */
+    uint32_t event_idx;                             /*!< The index of the next event in the block */
+    uint64_t prev_timestamp;                        /*!< The timestamp of the previous event */
+    int loaded;                                     /*!< (flag) a block is loaded */
+} ddlog_logfile_cursor_t;
+
+/**
+ * \brief Returns with the payload size of a block being built
+ */
+static inline size_t ddlog_logfile_block_size_internal(const ddlog_logfile_block_t* block){
+    return block->strings_size + block->events_size;
+}
+
+size_t ddlog_lz_compress(const char* src, size_t size, char* dst, size_t capacity);
+size_t ddlog_lz_decompress(const char* src, size_t size, char* dst, size_t capacity);
+
+int ddlog_logfile_block_init_internal(ddlog_logfile_block_t* block);
+void ddlog_logfile_block_free_internal(ddlog_logfile_block_t* block);
+void ddlog_logfile_block_reset_internal(ddlog_logfile_block_t* block, uint64_t first_seq);
+int ddlog_logfile_block_add_internal(ddlog_logfile_block_t* block, const ddlog_record_t* record,
+        ddlog_buffer_id_t buffer_id, const char* thread_name, const char* message);
+const char* ddlog_logfile_block_seal_internal(ddlog_logfile_block_t* block);
+
+int ddlog_logfile_open_internal(const char* path, ddlog_logfile_t* file);
+void ddlog_logfile_close_internal(ddlog_logfile_t* file);
+size_t ddlog_logfile_find_time_internal(const ddlog_logfile_t* file, uint64_t timestamp);
+size_t ddlog_logfile_find_seq_internal(const ddlog_logfile_t* file, uint64_t seq);
+int ddlog_logfile_cursor_init_internal(ddlog_logfile_cursor_t* cursor, const ddlog_logfile_t* file);
+void ddlog_logfile_cursor_free_internal(ddlog_logfile_cursor_t* cursor);
+int ddlog_logfile_cursor_seek_internal(ddlog_logfile_cursor_t* cursor, size_t block);
+int ddlog_logfile_cursor_next_internal(ddlog_logfile_cursor_t* cursor, ddlog_logfile_event_t* event);
+
+#endif
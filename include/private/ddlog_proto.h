@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_proto.h
+ * \brief Machine readable protocol of the log console.
+ *
+ * A console connection is switched from the menu to the protocol by the
+ * "mode json" or "mode binary" command line. In the protocol modes every
+ * request is a single command line, the response is a sequence of
+ * records closed by a status record:
+ *  - help                  the list of the commands
+ *  - buffers               one record per log buffer
+ *  - threads               one record per registered thread
+ *  - stats <id>            the counters of a buffer
+ *  - read <id> [query]     the events of a buffer matching the query
+ *                          terms (see ddlog_query.h)
+ *  - drain <id>            consumes and returns the new events of a buffer
+ *  - reset <id>            clears a buffer
+ *  - mode text|json|binary switches the response format, text returns
+ *                          to the menu
+ *  - quit                  closes the connection
+ *
+ * The status record is {"status":"ok",...} or {"status":"error","error":...}.
+ *
+ * In json mode every record is a JSON object on its own line. In binary
+ * mode every record is a frame: a ddlog_proto_frame_hdr_t followed by the
+ * payload. The events are DDLOG_PROTO_FRAME_EVENT frames (see
+ * ddlog_proto_event_t), the other records are DDLOG_PROTO_FRAME_JSON
+ * frames holding the JSON object. The multi byte fields are in the byte
+ * order of the server.
+ */
+#ifndef __DDLOG_PROTO_H
+#define __DDLOG_PROTO_H
+#include <stdio.h>
+#include <stdint.h>
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+
+#define DDLOG_PROTO_FRAME_EVENT     1
+#define DDLOG_PROTO_FRAME_JSON      2
+
+/**
+ * \enum ddlog_proto_mode_t
+ * \brief The protocol mode of a console connection.
+ */
+typedef enum ddlog_proto_mode_t {
+    DDLOG_PROTO_TEXT = 0,       /*!< The interactive menu */
+    DDLOG_PROTO_JSON,           /*!< JSON lines */
+    DDLOG_PROTO_BINARY          /*!< Length prefixed frames */
+} ddlog_proto_mode_t;
+
+/**
+ * \struct ddlog_proto_frame_hdr_t
+ * \brief Header of a binary mode frame.
+ */
+typedef struct ddlog_proto_frame_hdr_t {
+    uint32_t size;              /*!< The size of the frame including the header */
+    uint32_t type;              /*!< DDLOG_PROTO_FRAME_* */
+} ddlog_proto_frame_hdr_t;
+
+/**
+ * \struct ddlog_proto_event_t
+ * \brief Payload of an event frame.
+ *
+ * Followed by the thread name, the function name, the file name, the
+ * message and the ext payload, without terminating zeros.
+ */
+typedef struct ddlog_proto_event_t {
+    uint64_t seq;               /*!< The sequence number of the event in its ring */
+    uint64_t time_ns;           /*!< Wall clock time in nanoseconds since the epoch */
+    uint32_t buffer_id;         /*!< The id of the buffer */
+    uint32_t thread_id;         /*!< Registry id of the logging thread */
+    uint32_t line_number;       /*!< The line number of the log call */
+    uint32_t ext_event_type;    /*!< The ext event type */
+    uint32_t ext_data_size;     /*!< The size of the ext payload */
+    uint32_t message_len;       /*!< The length of the message */
+    uint16_t thread_len;        /*!< The length of the thread name */
+    uint16_t function_len;      /*!< The length of the function name */
+    uint16_t file_len;          /*!< The length of the file name */
+    uint8_t indent_level;       /*!< Log message indent level */
+    uint8_t flags;              /*!< Event flags (DDLOG_EVENT_FLAG_*) */
+} ddlog_proto_event_t;
+
+int ddlog_proto_handle_command(FILE* stream, ddlog_proto_mode_t* mode, char* line);
+void ddlog_proto_write_event(FILE* stream, ddlog_proto_mode_t mode, const ddlog_record_t* record, ddlog_buffer_id_t buffer_id);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_query.h
+ * \brief Event queries of the log console.
+ *
+ * A query is a list of predicates, an event matches if all of them hold.
+ * The query string is a space separated list of key=value terms, the
+ * values containing spaces are written in double quotes:
+ *  - thread=name      the thread name, "name" also matches "name/tid"
+ *  - function=name    the function name
+ *  - line=N or N-M    the line number or line range
+ *  - from=T, to=T     the time window, T is seconds[.fraction] since the
+ *                     epoch, or -seconds relative to the current time
+ *  - msg=text         the message contains the text
+ *  - re=regex         the message matches the POSIX extended regex
+ *  - ext=N            the ext event type
+ *  - limit=N          stop after N matching events
+ *
+ * The predicates on the event slot (time, line, ext type, the function
+ * of the callsite and the registered thread) are checked by the iterator
+ * before the record is copied, the rest after the copy. The messages are formatted only if a
+ * message predicate is present.
+ */
+#ifndef __DDLOG_QUERY_H
+#define __DDLOG_QUERY_H
+#include <stdint.h>
+#include <regex.h>
+#include "ddlog.h"
+#include "ddlog_ext.h"
+#include "private/ddlog_internal.h"
+
+#define DDLOG_QUERY_THREAD      0x01
+#define DDLOG_QUERY_FUNCTION    0x02
+#define DDLOG_QUERY_LINE        0x04
+#define DDLOG_QUERY_TIME        0x08
+#define DDLOG_QUERY_MESSAGE     0x10
+#define DDLOG_QUERY_REGEX       0x20
+#define DDLOG_QUERY_EXT         0x40
+
+/**
+ * \struct ddlog_query_t
+ * \brief A parsed event query.
+ */
+typedef struct ddlog_query_t {
+    unsigned int fields;                /*!< The predicates of the query (DDLOG_QUERY_*) */
+    char thread[DDLOG_MAX_NAME_LEN];    /*!< The thread name */
+    char function[DDLOG_MAX_NAME_LEN];  /*!< The function name */
+    unsigned int line_min;              /*!< The line range */
+    unsigned int line_max;
+    uint64_t time_from;                 /*!< The time window in clock ticks */
+    uint64_t time_to;
+    char message[DDLOG_MAX_NAME_LEN];   /*!< The message substring */
+    regex_t regex;                      /*!< The compiled message regex */
+    ddlog_ext_event_type_t ext_type;    /*!< The ext event type */
+    unsigned int limit;                 /*!< The maximum number of matches, 0 if unlimited */
+} ddlog_query_t;
+
+int ddlog_query_parse_internal(ddlog_query_t* query, const char* str, char* error, size_t error_size);
+void ddlog_query_free_internal(ddlog_query_t* query);
+void ddlog_query_iter_init_internal(const ddlog_query_t* query, ddlog_buffer_iter_t* iter, ddlog_buffer_t* buffer);
+int ddlog_query_filter_event_internal(const ddlog_event_t* event, void* arg);
+int ddlog_query_match_internal(const ddlog_query_t* query, const ddlog_record_t* record);
+
+#endif
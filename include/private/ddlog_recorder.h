@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_recorder.h
+ * \brief File backed log buffers (flight recorder).
+ *
+ * The rings of a file backed buffer are placed in a shared file mapping.
+ * The page cache keeps the events after the process crashed, the file
+ * can be printed post mortem with the ddlog_dump tool.
+ *
+ * File layout: the header (one page), followed by the ring regions of
+ * ring_stride bytes. Every ring region holds the ring structure
+ * (ddlog_buffer_t) followed by the slot array, the data ring and the ext
+ * arena. The first region is the shared ring of the buffer, the rest are
+ * the private thread rings. The file is sparse, only the used rings take
+ * disk space.
+ */
+#ifndef __DDLOG_RECORDER_H
+#define __DDLOG_RECORDER_H
+#include <stdint.h>
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_clock.h"
+
+#define DDLOG_RECORDER_MAGIC     "DDLOGFR"
+#define DDLOG_RECORDER_VERSION   1
+#define DDLOG_RECORDER_PAGE_SIZE 4096
+
+/**
+ * \struct ddlog_recorder_hdr_t
+ * \brief Header of a flight recorder file.
+ *
+ * Describes the layout of the file, the sizes are checked by the reader
+ * before the rings are accessed.
+ */
+typedef struct ddlog_recorder_hdr_t {
+    char magic[8];                      /*!< DDLOG_RECORDER_MAGIC */
+    uint32_t version;                   /*!< DDLOG_RECORDER_VERSION */
+    uint32_t buffer_struct_size;        /*!< sizeof(ddlog_buffer_t) of the writer */
+    uint32_t event_size;                /*!< sizeof(ddlog_event_t) of the writer */
+    uint32_t buffer_id;                 /*!< The id of the buffer in the writer process */
+    int32_t pid;                        /*!< The writer process id */
+    uint32_t ring_capacity;             /*!< The number of ring regions in the file */
+    volatile uint32_t ring_num;         /*!< The number of rings in use */
+    uint32_t reserved;
+    uint64_t ring_offset;               /*!< The offset of the first ring region */
+    uint64_t ring_stride;               /*!< The size of a ring region */
+    uint64_t buffer_size;               /*!< The number of event slots of a ring */
+    uint64_t data_size;                 /*!< The data ring size of a ring */
+    uint64_t ext_size;                  /*!< The ext arena size of a ring */
+    ddlog_clock_calibration_t clock;    /*!< The clock calibration of the event timestamps */
+} ddlog_recorder_hdr_t;
+
+ddlog_buffer_t* ddlog_recorder_create_internal(const char* path, size_t size, int per_thread, ddlog_buffer_id_t buffer_id);
+ddlog_buffer_t* ddlog_recorder_add_ring_internal(ddlog_buffer_t* buffer);
+void ddlog_recorder_close_internal(ddlog_buffer_t* buffer);
+ddlog_buffer_t* ddlog_recorder_open_internal(const char* path);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_snapshot.h
+ * \brief Point in time copies of the log buffers.
+ */
+#ifndef __DDLOG_SNAPSHOT_H
+#define __DDLOG_SNAPSHOT_H
+#include <stdint.h>
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+
+/**
+ * \struct ddlog_snapshot_t
+ * \brief Frozen copies of log buffers.
+ *
+ * Every copied buffer is a ddlog_buffer_t whose slot array, data ring,
+ * ext arena and private thread rings point into the snapshot arena, so
+ * the same reader code (ddlog_iter_*_internal()) works on the live
+ * buffers and on the snapshots.
+ */
+struct ddlog_snapshot_t {
+    uint64_t timestamp;                          /*!< The time of the snapshot in clock ticks */
+    ddlog_buffer_t* buffers[DDLOG_MAX_BUF_NUM];  /*!< The frozen buffers indexed by the buffer id, NULL if not copied */
+    void* arena;                                 /*!< The memory holding all the copies */
+    size_t arena_size;                           /*!< The size of the arena */
+};
+
+ddlog_snapshot_t* ddlog_snapshot_internal(ddlog_buffer_t** buffers, unsigned int buffer_num);
+size_t ddlog_snapshot_ring_size_internal(const ddlog_buffer_t* ring);
+void ddlog_snapshot_ring_internal(ddlog_buffer_t* copy, const ddlog_buffer_t* ring, char* memory);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_stats.h
+ * \brief Performance counters of the log buffers.
+ *
+ * The counters are kept in per ring shards (see ddlog_stats_shard_t) and
+ * summed up only when they are queried.
+ */
+#ifndef __DDLOG_STATS_H
+#define __DDLOG_STATS_H
+#include <stdint.h>
+#include "ddlog.h"
+#include "private/ddlog_internal.h"
+#include "private/ddlog_thread.h"
+
+/**
+ * \brief Returns with the counter shard of the calling thread in a ring
+ */
+static inline ddlog_stats_shard_t* ddlog_stats_shard_internal(ddlog_buffer_t* ring){
+    if (ring->single_producer){
+        return &ring->stats[0];
+    }
+    return &ring->stats[ddlog_thread_id & (DDLOG_STATS_SHARD_NUM - 1)];
+}
+
+/**
+ * \brief Increments a counter of a ring shard
+ *
+ * \param ring The ring owning the counter
+ * \param counter The counter in the shard of the calling thread
+ * \param value The increment
+ *
+ * The counters of a private ring are written by the owner thread only,
+ * no atomic operation is needed.
+ */
+static inline void ddlog_stats_add_internal(const ddlog_buffer_t* ring, volatile uint64_t* counter, uint64_t value){
+    if (ring->single_producer){
+        __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * \brief Returns with the number of bytes an event takes in the data ring and the ext arena
+ */
+static inline uint64_t ddlog_stats_event_bytes_internal(const ddlog_event_t* event){
+    uint64_t bytes = event->data_size;
+    if (event->ext_data_size > 0 && (event->flags & DDLOG_EVENT_FLAG_EXT_INLINE) == 0){
+        bytes += (event->ext_data_size + 7) & ~((uint64_t) 7);
+    }
+    return bytes;
+}
+
+/**
+ * \brief Counts a stored event
+ *
+ * \param ring The ring the event is stored in
+ * \param seq The sequence number of the event
+ * \param bytes The size of the event data (see ddlog_stats_event_bytes_internal())
+ */
+static inline void ddlog_stats_event_written_internal(ddlog_buffer_t* ring, uint64_t seq, uint64_t bytes){
+    ddlog_stats_shard_t* shard = ddlog_stats_shard_internal(ring);
+
+    ddlog_stats_add_internal(ring, &shard->events_written, 1);
+    ddlog_stats_add_internal(ring, &shard->bytes_written, bytes);
+    if (((seq + 1) & ring->mask) == 0){
+        ddlog_stats_add_internal(ring, &shard->wraps, 1);
+    }
+}
+
+void ddlog_stats_collect_internal(const ddlog_buffer_t* buffer, ddlog_stats_t* stats);
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2015 Jozsef Galajda <jozsef.galajda@gmail.com>
+ * All rights reserved.
+ */
+
+/**
+ * \file ddlog_thread.h
+ * \brief Registry of the logging threads.
+ *
+ * ddlog_thread_init() registers the calling thread and assigns a compact
+ * numeric id to it. The events store only the id, the thread name is
+ * resolved from the registry when the events are displayed.
+ */
+#ifndef __DDLOG_THREAD_H
+#define __DDLOG_THREAD_H
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DDLOG_MAX_THREAD_NUM      1024
+#define DDLOG_THREAD_NAME_LEN     16
+#define DDLOG_THREAD_ID_NONE      0
+
+/**
+ * \struct ddlog_thread_info_t
+ * \brief Registry entry of a logging thread.
+ *
+ * The entries are never reused, the events of exited threads
+ * can still be resolved.
+ */
+typedef struct ddlog_thread_info_t {
+    volatile int valid;                  /*!< The entry is completely filled */
+    pid_t tid;                           /*!< The kernel thread id */
+    uint64_t start_time;                 /*!< Registration timestamp in clock ticks */
+    char name[DDLOG_THREAD_NAME_LEN];    /*!< The thread name */
+} ddlog_thread_info_t;
+
+extern __thread uint16_t ddlog_thread_id;
+
+uint16_t ddlog_thread_register_internal(const char* name);
+const ddlog_thread_info_t* ddlog_thread_get_info_internal(uint16_t thread_id);
+unsigned int ddlog_thread_get_num_internal(void);
+
+#endif